@@ -23,8 +23,228 @@
 #   endif
 #endif
 
+#ifndef __tbtree_prefetch
+#   if defined(__GNUC__)
+#       define __tbtree_prefetch(x) __builtin_prefetch(x)
+#   else
+#       define __tbtree_prefetch(x) ((void)(x))
+#   endif
+#endif
+
+#ifndef __tbtree_static_assert
+#   if defined(__cplusplus)
+#       define __tbtree_static_assert(x, msg) static_assert(x, msg)
+#       define __tbtree_alignof(type) alignof(type)
+#   else
+#       define __tbtree_static_assert(x, msg) _Static_assert(x, msg)
+#       define __tbtree_alignof(type) _Alignof(type)
+#   endif
+#endif
+
+/* Spreads the runs of TB_PARALLEL_FOREACH over the OpenMP threads when
+ * built with `-fopenmp`, and runs them in turn otherwise. */
+#ifndef __tbtree_parallel_for
+#   if defined(_OPENMP)
+#       define __tbtree_parallel_for _Pragma("omp parallel for schedule(dynamic, 1)")
+#   else
+#       define __tbtree_parallel_for
+#   endif
+#endif
+
+#include <stddef.h>
 #include <stdint.h>
 
+/* Defining TBTREE_RCU before the inclusion lets readers run concurrently
+ * with a single writer. TB_INSERT and TB_REMOVE publish every link and
+ * flag word with a release store (TB_STORE_LEFT...) and the lookups,
+ * batched lookups and iterators load them with acquire, so that a reader
+ * only ever reaches fully linked nodes. A lookup racing with a rotation
+ * may still miss a node; see `struct tb_epoch` for retrying it and for
+ * reclaiming removed nodes. The bulk operations (TB_BALANCE, TB_MERGE,
+ * TB_SPLIT, TB_JOIN...) still need the readers excluded, and so do all
+ * updates of scapegoat trees, which rebuild subtrees through TB_BALANCE,
+ * and the lookups of splay trees, which restructure the tree. */
+#ifdef TBTREE_RCU
+#   if !defined(__GNUC__)
+#       error "TBTREE_RCU needs the GCC __atomic builtins"
+#   endif
+#   define __tbtree_load(x)         __atomic_load_n(&(x), __ATOMIC_ACQUIRE)
+#   define __tbtree_store(x, v)     __atomic_store_n(&(x), (v), __ATOMIC_RELEASE)
+#   define __tbtree_nonnull(x)      ((x) != NULL)
+#else
+#   define __tbtree_load(x)         (x)
+#   define __tbtree_store(x, v)     ((x) = (v))
+#   define __tbtree_nonnull(x)      ((void)(x), 1)
+#endif
+
+#ifndef __tbtree_has_feature
+#   ifdef __has_feature
+#       define __tbtree_has_feature(x) __has_feature(x)
+#   else
+#       define __tbtree_has_feature(x) (0)
+#   endif
+#endif
+
+/* ThreadSanitizer does not model fences and warns about them, so its
+ * builds order through a sequentially consistent read-modify-write of
+ * a shared word instead, which it does understand. */
+#ifndef __tbtree_fence
+#   if defined(__SANITIZE_THREAD__) || __tbtree_has_feature(thread_sanitizer)
+__tbtree_unused static unsigned long __tbtree_fence_word;
+#       define __tbtree_fence(order) \
+            ((void)(order), (void)__atomic_fetch_add(&__tbtree_fence_word, 0, __ATOMIC_SEQ_CST))
+#   else
+#       define __tbtree_fence(order) __atomic_thread_fence(order)
+#   endif
+#endif
+
+/* Defining TBTREE_STATS before the inclusion makes the generated functions
+ * count their work in `TB_COUNTERS` and generates TB_STATS. `TB_COUNTERS`
+ * defaults to a thread local `struct tb_counters` of each including file
+ * and may be defined to any other lvalue of that type. Without it the hooks
+ * expand to nothing. */
+#ifdef TBTREE_STATS
+/* `tb_steps` over `tb_lookups + tb_inserts` is the mean descent depth. */
+struct tb_counters {
+    unsigned long long tb_lookups;      /* FIND, NFIND, PFIND and batched keys */
+    unsigned long long tb_inserts;
+    unsigned long long tb_removes;
+    unsigned long long tb_cmps;         /* comparator calls */
+    unsigned long long tb_steps;        /* nodes visited by lookups and inserts */
+    unsigned long long tb_rotations;
+    unsigned long long tb_rebuilds;     /* subtrees rebuilt by TB_BALANCE */
+};
+
+#ifndef TB_COUNTERS
+#   ifdef __cplusplus
+__tbtree_unused static thread_local struct tb_counters tb_counters;
+#   else
+__tbtree_unused static _Thread_local struct tb_counters tb_counters;
+#   endif
+#   define TB_COUNTERS tb_counters
+#endif
+
+#define TB_COUNTERS_RESET() do { \
+        struct tb_counters tb_zero = { 0, 0, 0, 0, 0, 0, 0 }; \
+        TB_COUNTERS = tb_zero; \
+    } while (0)
+
+#define TB_STAT(counter, n)     ((void)(TB_COUNTERS.tb_##counter += (n)))
+#define TB_STAT_CMP(cmp)        (TB_STAT(cmps, 1), (cmp))
+
+#ifndef TB_STATS_DEPTHS
+#define TB_STATS_DEPTHS 64
+#endif
+
+/* Shape of a tree as reported by TB_STATS. The root is at depth 0 and
+ * `tb_depths` counts the nodes of each depth, the last slot also holding
+ * the deeper ones. */
+struct tb_stats {
+    size_t tb_count;
+    size_t tb_height;
+    double tb_avg_depth;
+    size_t tb_depths[TB_STATS_DEPTHS];
+};
+#else
+#define TB_STAT(counter, n)     ((void)0)
+#define TB_STAT_CMP(cmp)        cmp
+#endif
+
+#ifdef TBTREE_RCU
+#ifndef TB_EPOCH_SLOTS
+#define TB_EPOCH_SLOTS 64
+#endif
+
+/* Epoch based reclamation. Each reader thread owns one of the slots and
+ * wraps its accesses in tb_epoch_enter() and tb_epoch_exit(). A node
+ * removed by the writer may be freed once tb_epoch_safe() holds for the
+ * tag returned by tb_epoch_retire() after the removal.
+ *
+ * `tb_seq` is odd while the writer updates the tree: lookups that must not
+ * miss a node moved by a rotation retry while tb_epoch_read_retry() holds,
+ * provided the writer wraps its updates in tb_epoch_write_begin() and
+ * tb_epoch_write_end(). */
+struct tb_epoch {
+    unsigned long tb_epoch;
+    unsigned long tb_seq;
+    unsigned long tb_slots[TB_EPOCH_SLOTS];
+};
+
+#define TB_EPOCH_INITIALIZER \
+    { 1, 0, { 0 } }
+
+__tbtree_unused static inline void tb_epoch_init(struct tb_epoch *epoch)
+{
+    epoch->tb_epoch = 1;
+    epoch->tb_seq = 0;
+    for (size_t i = 0; i < TB_EPOCH_SLOTS; ++i)
+        epoch->tb_slots[i] = 0;
+}
+
+__tbtree_unused static inline void tb_epoch_enter(struct tb_epoch *epoch, size_t slot)
+{
+    unsigned long now = __atomic_load_n(&epoch->tb_epoch, __ATOMIC_ACQUIRE);
+    __atomic_store_n(&epoch->tb_slots[slot], now, __ATOMIC_RELAXED);
+    __tbtree_fence(__ATOMIC_SEQ_CST);
+}
+
+__tbtree_unused static inline void tb_epoch_exit(struct tb_epoch *epoch, size_t slot)
+{
+    __atomic_store_n(&epoch->tb_slots[slot], 0, __ATOMIC_RELEASE);
+}
+
+/* Returns the tag of the nodes unlinked so far and starts a new epoch. */
+__tbtree_unused static inline unsigned long tb_epoch_retire(struct tb_epoch *epoch)
+{
+    return __atomic_fetch_add(&epoch->tb_epoch, 1, __ATOMIC_SEQ_CST);
+}
+
+/* Returns nonzero once no reader can still hold a node tagged `tag`. */
+__tbtree_unused static inline int tb_epoch_safe(struct tb_epoch *epoch, unsigned long tag)
+{
+    __tbtree_fence(__ATOMIC_SEQ_CST);
+    for (size_t i = 0; i < TB_EPOCH_SLOTS; ++i) {
+        unsigned long now = __atomic_load_n(&epoch->tb_slots[i], __ATOMIC_ACQUIRE);
+        if (now && now <= tag)
+            return 0;
+    }
+    return 1;
+}
+
+/* Waits until the nodes unlinked so far can be freed. */
+__tbtree_unused static inline void tb_epoch_synchronize(struct tb_epoch *epoch)
+{
+    unsigned long tag = tb_epoch_retire(epoch);
+    while (!tb_epoch_safe(epoch, tag))
+        continue;
+}
+
+__tbtree_unused static inline void tb_epoch_write_begin(struct tb_epoch *epoch)
+{
+    __atomic_store_n(&epoch->tb_seq, epoch->tb_seq + 1, __ATOMIC_RELAXED);
+    __tbtree_fence(__ATOMIC_RELEASE);
+}
+
+__tbtree_unused static inline void tb_epoch_write_end(struct tb_epoch *epoch)
+{
+    __atomic_store_n(&epoch->tb_seq, epoch->tb_seq + 1, __ATOMIC_RELEASE);
+}
+
+__tbtree_unused static inline unsigned long tb_epoch_read_begin(struct tb_epoch *epoch)
+{
+    unsigned long seq;
+    while ((seq = __atomic_load_n(&epoch->tb_seq, __ATOMIC_ACQUIRE)) & 1)
+        continue;
+    return seq;
+}
+
+__tbtree_unused static inline int tb_epoch_read_retry(struct tb_epoch *epoch, unsigned long seq)
+{
+    __tbtree_fence(__ATOMIC_ACQUIRE);
+    return __atomic_load_n(&epoch->tb_seq, __ATOMIC_RELAXED) != seq;
+}
+#endif
+
 #define TB_HEAD(name, type) \
     struct name { \
         struct type *tb_root; \
@@ -37,6 +257,127 @@
         (head)->tb_root = NULL; \
     } while (0)
 
+/* Scapegoat trees keep the node count in the head instead of
+ * per-node balance bits. */
+#define TB_HEAD_SG(name, type) \
+    struct name { \
+        struct type *tb_root; \
+        size_t tb_count; \
+        size_t tb_max; \
+    }
+
+#define TB_HEAD_SG_INITIALIZER(head) \
+    { NULL, 0, 0 }
+
+#define TB_INIT_SG(head) do { \
+        (head)->tb_root = NULL; \
+        (head)->tb_count = 0; \
+        (head)->tb_max = 0; \
+    } while (0)
+
+/* Index trees link nodes of one array by 32-bit indices relative to
+ * `tb_base`, so the array can be grown with realloc() or mapped at another
+ * address by updating `tb_base` alone. */
+#define TB_HEAD_IDX(name, type) \
+    struct name { \
+        struct type *tb_base; \
+        uint32_t tb_root; \
+    }
+
+#define TB_HEAD_IDX_INITIALIZER(base) \
+    { (base), 0 }
+
+#define TB_INIT_IDX(head, base) do { \
+        (head)->tb_base = (base); \
+        (head)->tb_root = 0; \
+    } while (0)
+
+/* Images of index trees are a `struct tb_image` followed by the node
+ * array, written as is since the links are relative to it. The node type
+ * must not hold pointers of its own. A file of another byte order fails
+ * the magic check. */
+#define TB_IMAGE_MAGIC          0x54425452u
+#define TB_IMAGE_VERSION        1u
+
+struct tb_image {
+    uint32_t tb_magic;
+    uint32_t tb_version;
+    uint32_t tb_node_size;
+    uint32_t tb_root;
+    uint64_t tb_count;
+    uint64_t tb_checksum;       /* FNV-1a of the fields above and the nodes */
+};
+
+__tbtree_unused static inline uint64_t tb_image_checksum(uint64_t hash, const void *data,
+                                                         size_t size)
+{
+    const unsigned char *p = (const unsigned char *)data;
+    for (size_t i = 0; i < size; ++i)
+        hash = (hash ^ p[i]) * 0x100000001b3u;
+    return hash;
+}
+
+#define TB_IMAGE_CHECKSUM(image, nodes, size) \
+    tb_image_checksum(tb_image_checksum(0xcbf29ce484222325u, image, \
+                                        offsetof(struct tb_image, tb_checksum)), \
+                      nodes, size)
+
+/* Packs the first 8 bytes of a key big-endian, zero padded, so that the
+ * prefixes of byte strings compare as integers like memcmp() and strcmp()
+ * order the strings, up to ties. */
+__tbtree_unused static inline uint64_t tb_prefix(const void *key, size_t len)
+{
+    const unsigned char *p = (const unsigned char *)key;
+    uint64_t prefix = 0;
+    for (size_t i = 0; i < 8; ++i)
+        prefix = prefix << 8 | (i < len ? p[i] : 0);
+    return prefix;
+}
+
+__tbtree_unused static inline uint64_t tb_prefix_str(const char *str)
+{
+    size_t len = 0;
+    while (len < 8 && str[len])
+        ++len;
+    return tb_prefix(str, len);
+}
+
+/* Sharded trees spread one key space over `n` trees `tree` generated with
+ * TB_GENERATE or TB_GENERATE_RB, each guarded by its own lock, so that
+ * updates of distant keys run in parallel. Shard `i` holds the keys from
+ * its lower bound `tb_lo` up to that of the next bounded shard. The bounds
+ * are copies of nodes with their links cleared, so `cmp` may only depend
+ * on members held by value. They are published under `tb_seq`, see
+ * TB_SHARD_STORE. `tb_total` is the node count of the last full scan of
+ * the shard counts, see TB_SHARD_ADAPT. The sharded trees need the GCC
+ * __atomic builtins. */
+#define TB_HEAD_SHARDED(name, tree, type, locktype, n) \
+    struct name { \
+        size_t tb_total; \
+        struct { \
+            struct tree tb_tree; \
+            locktype tb_lock; \
+            size_t tb_count; \
+            unsigned tb_seq; \
+            int tb_bounded; \
+            struct type tb_lo; \
+        } tb_shards[n]; \
+    }
+
+#define TB_NSHARDS(head) \
+    (sizeof((head)->tb_shards) / sizeof((head)->tb_shards[0]))
+
+#define TB_INIT_SHARDED(head, lockinit) do { \
+        (head)->tb_total = 0; \
+        for (size_t tb_i = 0; tb_i < TB_NSHARDS(head); ++tb_i) { \
+            TB_INIT(&(head)->tb_shards[tb_i].tb_tree); \
+            lockinit(&(head)->tb_shards[tb_i].tb_lock); \
+            (head)->tb_shards[tb_i].tb_count = 0; \
+            (head)->tb_shards[tb_i].tb_seq = 0; \
+            (head)->tb_shards[tb_i].tb_bounded = 0; \
+        } \
+    } while (0)
+
 #define TB_ENTRY(type) \
     struct { \
         struct type *tb_left; \
@@ -44,6 +385,34 @@
         struct type *tb_parent; \
     }
 
+/* Same as TB_ENTRY with the size of the subtree for order statistics. */
+#define TB_ENTRY_RANKED(type) \
+    struct { \
+        struct type *tb_left; \
+        struct type *tb_right; \
+        struct type *tb_parent; \
+        size_t tb_size; \
+    }
+
+/* Same as TB_ENTRY with a cached prefix of the key for TB_GENERATE_PREFIX. */
+#define TB_ENTRY_PREFIX(type) \
+    struct { \
+        struct type *tb_left; \
+        struct type *tb_right; \
+        struct type *tb_parent; \
+        uint64_t tb_prefix; \
+    }
+
+/* Index links store `index + 1` with 0 as NULL. The thread and color
+ * bits share `tb_parent` with the parent link, which limits a tree to the
+ * first 2^29 - 1 nodes of its array, see TB_IDX_MAX. */
+#define TB_ENTRY_IDX(type) \
+    struct { \
+        uint32_t tb_left; \
+        uint32_t tb_right; \
+        uint32_t tb_parent; \
+    }
+
 #define TB_ROOT(head)           ((head)->tb_root)
 #define TB_EMPTY(head)          (TB_ROOT(head) == NULL)
 
@@ -51,12 +420,24 @@
 #define TB_RIGHT(elm, field)    ((elm)->field.tb_right)
 
 #define TB_UP(elm, field)       ((elm)->field.tb_parent)
+#define TB_SIZE(elm, field)     ((elm)->field.tb_size)
+#define TB_PREFIX(elm, field)   ((elm)->field.tb_prefix)
 #define TB_BITS(elm, field)     (*(uintptr_t *)&TB_UP(elm, field))
 
 #define TB_LBIT                 ((uintptr_t)1)
 #define TB_RBIT                 ((uintptr_t)2)
 #define TB_MASK                 ((uintptr_t)3)
 
+/* The red-black color lives in the third low bit of `tb_parent`, so the
+ * red-black families need nodes aligned to at least 8 bytes, while the
+ * others only use the thread bits and need 4. Both are asserted by the
+ * generated functions. TB_NODE_FLAGS gives the bits of `tb_parent` that
+ * are not part of the parent link for the alignment of `elm`. */
+#define TB_CBIT                 ((uintptr_t)4)
+#define TB_FLAGS                ((uintptr_t)7)
+
+#define TB_NODE_FLAGS(elm)      (TB_FLAGS & ((uintptr_t)__tbtree_alignof(__typeof__(*(elm))) - 1))
+
 #define TB_SET(elm, field)      (TB_BITS(elm, field) |= TB_MASK)
 #define TB_LSET(elm, field)     (TB_BITS(elm, field) |= TB_LBIT)
 #define TB_RSET(elm, field)     (TB_BITS(elm, field) |= TB_RBIT)
@@ -69,22 +450,135 @@
 #define TB_LLEAF(elm, field)    ((TB_BITS(elm, field) & TB_LBIT) != 0)
 #define TB_RLEAF(elm, field)    ((TB_BITS(elm, field) & TB_RBIT) != 0)
 
+#define TB_IS_RED(elm, field)   ((TB_BITS(elm, field) & TB_CBIT) != 0)
+#define TB_IS_BLACK(elm, field) ((TB_BITS(elm, field) & TB_CBIT) == 0)
+
+#define TB_SET_RED(elm, field)  (TB_BITS(elm, field) |= TB_CBIT)
+#define TB_SET_BLACK(elm, field) (TB_BITS(elm, field) &= ~TB_CBIT)
+
+#define TB_SET_COLOR(elm, src, field) do { \
+        TB_BITS(elm, field) &= ~TB_CBIT; \
+        TB_BITS(elm, field) |= TB_BITS(src, field) & TB_CBIT; \
+    } while (0)
+
+#define TB_LRED(elm, field)     (!TB_LLEAF(elm, field) && TB_IS_RED(TB_LEFT(elm, field), field))
+#define TB_RRED(elm, field)     (!TB_RLEAF(elm, field) && TB_IS_RED(TB_RIGHT(elm, field), field))
+
+/* Reader side accessors, see TBTREE_RCU. */
+#define TB_LOAD_LEFT(elm, field)    __tbtree_load(TB_LEFT(elm, field))
+#define TB_LOAD_RIGHT(elm, field)   __tbtree_load(TB_RIGHT(elm, field))
+#define TB_LOAD_LLEAF(elm, field)   ((__tbtree_load(TB_BITS(elm, field)) & TB_LBIT) != 0)
+#define TB_LOAD_RLEAF(elm, field)   ((__tbtree_load(TB_BITS(elm, field)) & TB_RBIT) != 0)
+
+/* Writer side counterparts of the setters above, see TBTREE_RCU. Each
+ * builds the whole word and publishes it with a single store, so that
+ * a reader never loads a half updated link or flag word. */
+#define TB_STORE_LEFT(elm, field, v)    __tbtree_store(TB_LEFT(elm, field), v)
+#define TB_STORE_RIGHT(elm, field, v)   __tbtree_store(TB_RIGHT(elm, field), v)
+#define TB_STORE_BITS(elm, field, v)    __tbtree_store(TB_BITS(elm, field), v)
+
+#define TB_STORE_LSET(elm, field)   TB_STORE_BITS(elm, field, TB_BITS(elm, field) | TB_LBIT)
+#define TB_STORE_RSET(elm, field)   TB_STORE_BITS(elm, field, TB_BITS(elm, field) | TB_RBIT)
+#define TB_STORE_LCLEAR(elm, field) TB_STORE_BITS(elm, field, TB_BITS(elm, field) & ~TB_LBIT)
+#define TB_STORE_RCLEAR(elm, field) TB_STORE_BITS(elm, field, TB_BITS(elm, field) & ~TB_RBIT)
+#define TB_STORE_RED(elm, field)    TB_STORE_BITS(elm, field, TB_BITS(elm, field) | TB_CBIT)
+#define TB_STORE_BLACK(elm, field)  TB_STORE_BITS(elm, field, TB_BITS(elm, field) & ~TB_CBIT)
+
+#define TB_STORE_COLOR(elm, src, field) \
+    TB_STORE_BITS(elm, field, (TB_BITS(elm, field) & ~TB_CBIT) | (TB_BITS(src, field) & TB_CBIT))
+
+#define TB_LSIZE(elm, field)    (TB_LLEAF(elm, field) ? 0 : TB_SIZE(TB_LEFT(elm, field), field))
+#define TB_RSIZE(elm, field)    (TB_RLEAF(elm, field) ? 0 : TB_SIZE(TB_RIGHT(elm, field), field))
+
 #define TB_PARENT(elm, field)   ((__typeof__(TB_UP(elm, field))) \
-                                 (TB_BITS(elm, field) & ~TB_MASK))
+                                 (TB_BITS(elm, field) & ~TB_NODE_FLAGS(elm)))
 
 #define TB_SET_PARENT(elm, parent, field) do { \
-        TB_BITS(elm, field) &= TB_MASK; \
+        TB_BITS(elm, field) &= TB_NODE_FLAGS(elm); \
         TB_BITS(elm, field) |= (uintptr_t)(parent); \
     } while (0)
 
+#define TB_STORE_PARENT(elm, parent, field) \
+    TB_STORE_BITS(elm, field, (TB_BITS(elm, field) & TB_NODE_FLAGS(elm)) | (uintptr_t)(parent))
+
 #define TB_SWAP_CHILD(head, parent, out, in, field) do { \
         if ((parent) == NULL) { \
-            TB_ROOT(head) = (in); \
+            __tbtree_store(TB_ROOT(head), in); \
         } else if (TB_LEFT(parent, field) == (out)) { \
-            TB_LEFT(parent, field) = (in); \
+            __tbtree_store(TB_LEFT(parent, field), in); \
+        } else { \
+            __tbtree_store(TB_RIGHT(parent, field), in); \
+        } \
+    } while (0)
+
+#define TB_IDX_PTR(base, idx)   ((idx) ? (base) + ((idx) - 1) : NULL)
+#define TB_IDX(base, elm)       ((elm) ? (uint32_t)((elm) - (base)) + 1 : 0)
+
+#define TB_IDX_BITS(elm, field) ((elm)->field.tb_parent)
+
+/* The largest link that fits next to the flags in `tb_parent`. */
+#define TB_IDX_MAX              (UINT32_MAX >> 3)
+#define TB_IDX_FITS(base, elm)  ((size_t)((elm) - (base)) < TB_IDX_MAX)
+
+#define TB_IDX_LEFT(base, elm, field)   TB_IDX_PTR(base, (elm)->field.tb_left)
+#define TB_IDX_RIGHT(base, elm, field)  TB_IDX_PTR(base, (elm)->field.tb_right)
+#define TB_IDX_PARENT(base, elm, field) TB_IDX_PTR(base, TB_IDX_BITS(elm, field) >> 3)
+
+#define TB_IDX_SET_PARENT(base, elm, parent, field) \
+    (TB_IDX_BITS(elm, field) = (TB_IDX_BITS(elm, field) & (uint32_t)TB_FLAGS) | \
+                               TB_IDX(base, parent) << 3)
+
+#define TB_IDX_SET_FLAG(elm, flag, field)   (TB_IDX_BITS(elm, field) |= (uint32_t)(flag))
+#define TB_IDX_CLEAR_FLAG(elm, flag, field) (TB_IDX_BITS(elm, field) &= ~(uint32_t)(flag))
+
+#define TB_IDX_LLEAF(elm, field)    ((TB_IDX_BITS(elm, field) & TB_LBIT) != 0)
+#define TB_IDX_RLEAF(elm, field)    ((TB_IDX_BITS(elm, field) & TB_RBIT) != 0)
+#define TB_IDX_IS_RED(elm, field)   ((TB_IDX_BITS(elm, field) & TB_CBIT) != 0)
+
+#define TB_IDX_LRED(base, elm, field) \
+    (!TB_IDX_LLEAF(elm, field) && TB_IDX_IS_RED(TB_IDX_LEFT(base, elm, field), field))
+#define TB_IDX_RRED(base, elm, field) \
+    (!TB_IDX_RLEAF(elm, field) && TB_IDX_IS_RED(TB_IDX_RIGHT(base, elm, field), field))
+
+/* Rotations keep the threads intact: a missing child
+ * on the moved side turns into a thread to the rotated node.
+ * The augmented data is updated bottom-up with `aug`. */
+#define TB_ROTATE_LEFT(type, head, elm, field, aug) do { \
+        struct type *tb_child = TB_RIGHT(elm, field); \
+        struct type *tb_up = TB_PARENT(elm, field); \
+        TB_STAT(rotations, 1); \
+        if (TB_LLEAF(tb_child, field)) { \
+            TB_STORE_RSET(elm, field); \
+        } else { \
+            TB_STORE_RIGHT(elm, field, TB_LEFT(tb_child, field)); \
+            TB_STORE_PARENT(TB_RIGHT(elm, field), elm, field); \
+        } \
+        TB_STORE_LEFT(tb_child, field, elm); \
+        TB_STORE_LCLEAR(tb_child, field); \
+        TB_SWAP_CHILD(head, tb_up, elm, tb_child, field); \
+        TB_STORE_PARENT(tb_child, tb_up, field); \
+        TB_STORE_PARENT(elm, tb_child, field); \
+        (void)aug(elm); \
+        (void)aug(tb_child); \
+    } while (0)
+
+#define TB_ROTATE_RIGHT(type, head, elm, field, aug) do { \
+        struct type *tb_child = TB_LEFT(elm, field); \
+        struct type *tb_up = TB_PARENT(elm, field); \
+        TB_STAT(rotations, 1); \
+        if (TB_RLEAF(tb_child, field)) { \
+            TB_STORE_LSET(elm, field); \
         } else { \
-            TB_RIGHT(parent, field) = (in); \
+            TB_STORE_LEFT(elm, field, TB_RIGHT(tb_child, field)); \
+            TB_STORE_PARENT(TB_LEFT(elm, field), elm, field); \
         } \
+        TB_STORE_RIGHT(tb_child, field, elm); \
+        TB_STORE_RCLEAR(tb_child, field); \
+        TB_SWAP_CHILD(head, tb_up, elm, tb_child, field); \
+        TB_STORE_PARENT(tb_child, tb_up, field); \
+        TB_STORE_PARENT(elm, tb_child, field); \
+        (void)aug(elm); \
+        (void)aug(tb_child); \
     } while (0)
 
 #define TB_PROTOTYPE(name, type, field, cmp) \
@@ -98,117 +592,2723 @@
     TB_PROTOTYPE_MAX(name, type, attr); \
     TB_PROTOTYPE_PREV(name, type, attr); \
     TB_PROTOTYPE_NEXT(name, type, attr); \
+    TB_PROTOTYPE_PREV_N(name, type, attr); \
+    TB_PROTOTYPE_NEXT_N(name, type, attr); \
+    TB_PROTOTYPE_FIRST(name, type, attr); \
+    TB_PROTOTYPE_LAST(name, type, attr); \
+    TB_PROTOTYPE_FIND(name, type, attr); \
+    TB_PROTOTYPE_NFIND(name, type, attr); \
+    TB_PROTOTYPE_PFIND(name, type, attr); \
+    TB_PROTOTYPE_FIND_BATCH(name, type, attr); \
+    TB_PROTOTYPE_NFIND_BATCH(name, type, attr); \
+    TB_PROTOTYPE_RANGE_FIRST(name, type, attr); \
+    TB_PROTOTYPE_RANGE_NEXT(name, type, attr); \
+    TB_PROTOTYPE_FREEZE(name, type, attr); \
+    TB_PROTOTYPE_FROZEN(name, type, attr); \
+    TB_PROTOTYPE_PARTITION(name, type, attr); \
+    TB_PROTOTYPE_INSERT(name, type, attr); \
+    TB_PROTOTYPE_INSERT_HINT(name, type, attr); \
+    TB_PROTOTYPE_REMOVE(name, type, attr); \
+    TB_PROTOTYPE_REINSERT(name, type, attr); \
+    TB_PROTOTYPE_COMPRESS(name, type, attr); \
+    TB_PROTOTYPE_BALANCE(name, type, attr); \
+    TB_PROTOTYPE_REBALANCE(name, type, attr); \
+    TB_PROTOTYPE_BUILD_SORTED(name, type, attr); \
+    TB_PROTOTYPE_MERGE(name, type, attr); \
+    TB_PROTOTYPE_SPLIT(name, type, attr); \
+    TB_PROTOTYPE_JOIN(name, type, attr); \
+    TB_PROTOTYPE_REMOVE_RANGE(name, type, attr); \
+    TB_PROTOTYPE_STATS(name, type, attr); \
+
+#define TB_PROTOTYPE_RB(name, type, field, cmp) \
+    TB_PROTOTYPE_RB_INTERNAL(name, type, field, cmp,)
+
+#define TB_PROTOTYPE_RB_STATIC(name, type, field, cmp) \
+    TB_PROTOTYPE_RB_INTERNAL(name, type, field, cmp, __tbtree_unused static)
+
+#define TB_PROTOTYPE_RB_INTERNAL(name, type, field, cmp, attr) \
+    TB_PROTOTYPE_INTERNAL(name, type, field, cmp, attr) \
+    TB_PROTOTYPE_INSERT_COLOR(name, type, attr); \
+    TB_PROTOTYPE_REMOVE_COLOR(name, type, attr); \
+    TB_PROTOTYPE_JOIN3(name, type, attr); \
+
+#define TB_PROTOTYPE_SG(name, type, field, cmp) \
+    TB_PROTOTYPE_SG_INTERNAL(name, type, field, cmp,)
+
+#define TB_PROTOTYPE_SG_STATIC(name, type, field, cmp) \
+    TB_PROTOTYPE_SG_INTERNAL(name, type, field, cmp, __tbtree_unused static)
+
+/* Scapegoat trees generate neither TB_SPLIT nor TB_JOIN. */
+#define TB_PROTOTYPE_SG_INTERNAL(name, type, field, cmp, attr) \
+    TB_PROTOTYPE_MIN(name, type, attr); \
+    TB_PROTOTYPE_MAX(name, type, attr); \
+    TB_PROTOTYPE_PREV(name, type, attr); \
+    TB_PROTOTYPE_NEXT(name, type, attr); \
+    TB_PROTOTYPE_PREV_N(name, type, attr); \
+    TB_PROTOTYPE_NEXT_N(name, type, attr); \
+    TB_PROTOTYPE_FIRST(name, type, attr); \
+    TB_PROTOTYPE_LAST(name, type, attr); \
+    TB_PROTOTYPE_FIND(name, type, attr); \
+    TB_PROTOTYPE_NFIND(name, type, attr); \
+    TB_PROTOTYPE_PFIND(name, type, attr); \
+    TB_PROTOTYPE_FIND_BATCH(name, type, attr); \
+    TB_PROTOTYPE_NFIND_BATCH(name, type, attr); \
+    TB_PROTOTYPE_RANGE_FIRST(name, type, attr); \
+    TB_PROTOTYPE_RANGE_NEXT(name, type, attr); \
+    TB_PROTOTYPE_FREEZE(name, type, attr); \
+    TB_PROTOTYPE_FROZEN(name, type, attr); \
+    TB_PROTOTYPE_PARTITION(name, type, attr); \
+    TB_PROTOTYPE_INSERT(name, type, attr); \
+    TB_PROTOTYPE_INSERT_HINT(name, type, attr); \
+    TB_PROTOTYPE_REMOVE(name, type, attr); \
+    TB_PROTOTYPE_REINSERT(name, type, attr); \
+    TB_PROTOTYPE_COMPRESS(name, type, attr); \
+    TB_PROTOTYPE_BALANCE(name, type, attr); \
+    TB_PROTOTYPE_REBALANCE(name, type, attr); \
+    TB_PROTOTYPE_BUILD_SORTED(name, type, attr); \
+    TB_PROTOTYPE_MERGE(name, type, attr); \
+    TB_PROTOTYPE_REMOVE_RANGE(name, type, attr); \
+    TB_PROTOTYPE_STATS(name, type, attr); \
+    TB_PROTOTYPE_INSERT_SG(name, type, attr); \
+    TB_PROTOTYPE_REMOVE_SG(name, type, attr); \
+
+#define TB_PROTOTYPE_SPLAY(name, type, field, cmp) \
+    TB_PROTOTYPE_SPLAY_INTERNAL(name, type, field, cmp,)
+
+#define TB_PROTOTYPE_SPLAY_STATIC(name, type, field, cmp) \
+    TB_PROTOTYPE_SPLAY_INTERNAL(name, type, field, cmp, __tbtree_unused static)
+
+#define TB_PROTOTYPE_SPLAY_INTERNAL(name, type, field, cmp, attr) \
+    TB_PROTOTYPE_INTERNAL(name, type, field, cmp, attr) \
+    TB_PROTOTYPE_SPLAY_ROOT(name, type, attr); \
+
+#define TB_PROTOTYPE_KEY(name, type, field, keyfield, keytype) \
+    TB_PROTOTYPE_KEY_INTERNAL(name, type, field, keyfield, keytype,)
+
+#define TB_PROTOTYPE_KEY_STATIC(name, type, field, keyfield, keytype) \
+    TB_PROTOTYPE_KEY_INTERNAL(name, type, field, keyfield, keytype, __tbtree_unused static)
+
+#define TB_PROTOTYPE_KEY_INTERNAL(name, type, field, keyfield, keytype, attr) \
+    TB_PROTOTYPE_INTERNAL(name, type, field, name##_TB_KEY_CMP, attr) \
+    TB_PROTOTYPE_KEY_CMP(name, type, attr); \
+    TB_PROTOTYPE_FIND_KEY(name, type, keytype, attr); \
+    TB_PROTOTYPE_NFIND_KEY(name, type, keytype, attr); \
+    TB_PROTOTYPE_PFIND_KEY(name, type, keytype, attr); \
+    TB_PROTOTYPE_FREEZE_KEY(name, type, keytype, attr); \
+    TB_PROTOTYPE_FROZEN_KEY(name, type, keytype, attr); \
+
+#define TB_PROTOTYPE_PREFIX(name, type, field, cmp) \
+    TB_PROTOTYPE_PREFIX_INTERNAL(name, type, field, cmp,)
+
+#define TB_PROTOTYPE_PREFIX_STATIC(name, type, field, cmp) \
+    TB_PROTOTYPE_PREFIX_INTERNAL(name, type, field, cmp, __tbtree_unused static)
+
+#define TB_PROTOTYPE_PREFIX_INTERNAL(name, type, field, cmp, attr) \
+    TB_PROTOTYPE_INTERNAL(name, type, field, name##_TB_PREFIX_CMP, attr) \
+    TB_PROTOTYPE_PREFIX_CMP(name, type, attr); \
+
+#define TB_PROTOTYPE_RB_PREFIX(name, type, field, cmp) \
+    TB_PROTOTYPE_RB_PREFIX_INTERNAL(name, type, field, cmp,)
+
+#define TB_PROTOTYPE_RB_PREFIX_STATIC(name, type, field, cmp) \
+    TB_PROTOTYPE_RB_PREFIX_INTERNAL(name, type, field, cmp, __tbtree_unused static)
+
+#define TB_PROTOTYPE_RB_PREFIX_INTERNAL(name, type, field, cmp, attr) \
+    TB_PROTOTYPE_RB_INTERNAL(name, type, field, name##_TB_PREFIX_CMP, attr) \
+    TB_PROTOTYPE_PREFIX_CMP(name, type, attr); \
+
+#define TB_PROTOTYPE_MULTI(name, type, field, cmp) \
+    TB_PROTOTYPE_MULTI_INTERNAL(name, type, field, cmp,)
+
+#define TB_PROTOTYPE_MULTI_STATIC(name, type, field, cmp) \
+    TB_PROTOTYPE_MULTI_INTERNAL(name, type, field, cmp, __tbtree_unused static)
+
+#define TB_PROTOTYPE_MULTI_INTERNAL(name, type, field, cmp, attr) \
+    TB_PROTOTYPE_MIN(name, type, attr); \
+    TB_PROTOTYPE_MAX(name, type, attr); \
+    TB_PROTOTYPE_PREV(name, type, attr); \
+    TB_PROTOTYPE_NEXT(name, type, attr); \
+    TB_PROTOTYPE_PREV_N(name, type, attr); \
+    TB_PROTOTYPE_NEXT_N(name, type, attr); \
     TB_PROTOTYPE_FIRST(name, type, attr); \
     TB_PROTOTYPE_LAST(name, type, attr); \
+    TB_PROTOTYPE_MULTI_CMP(name, type, attr); \
     TB_PROTOTYPE_FIND(name, type, attr); \
     TB_PROTOTYPE_NFIND(name, type, attr); \
+    TB_PROTOTYPE_PFIND(name, type, attr); \
+    TB_PROTOTYPE_EQUAL_RANGE(name, type, attr); \
+    TB_PROTOTYPE_RANGE_FIRST(name, type, attr); \
+    TB_PROTOTYPE_RANGE_NEXT(name, type, attr); \
+    TB_PROTOTYPE_FREEZE(name, type, attr); \
+    TB_PROTOTYPE_FROZEN(name, type, attr); \
+    TB_PROTOTYPE_PARTITION(name, type, attr); \
     TB_PROTOTYPE_INSERT(name, type, attr); \
+    TB_PROTOTYPE_INSERT_HINT(name, type, attr); \
     TB_PROTOTYPE_REMOVE(name, type, attr); \
     TB_PROTOTYPE_REINSERT(name, type, attr); \
+    TB_PROTOTYPE_COMPRESS(name, type, attr); \
+    TB_PROTOTYPE_BALANCE(name, type, attr); \
+    TB_PROTOTYPE_REBALANCE(name, type, attr); \
+    TB_PROTOTYPE_BUILD_SORTED(name, type, attr); \
+    TB_PROTOTYPE_SPLIT(name, type, attr); \
+    TB_PROTOTYPE_JOIN(name, type, attr); \
+    TB_PROTOTYPE_REMOVE_RANGE(name, type, attr); \
+    TB_PROTOTYPE_STATS(name, type, attr); \
+
+#define TB_PROTOTYPE_RB_MULTI(name, type, field, cmp) \
+    TB_PROTOTYPE_RB_MULTI_INTERNAL(name, type, field, cmp,)
+
+#define TB_PROTOTYPE_RB_MULTI_STATIC(name, type, field, cmp) \
+    TB_PROTOTYPE_RB_MULTI_INTERNAL(name, type, field, cmp, __tbtree_unused static)
+
+#define TB_PROTOTYPE_RB_MULTI_INTERNAL(name, type, field, cmp, attr) \
+    TB_PROTOTYPE_MULTI_INTERNAL(name, type, field, cmp, attr) \
+    TB_PROTOTYPE_INSERT_COLOR(name, type, attr); \
+    TB_PROTOTYPE_REMOVE_COLOR(name, type, attr); \
+    TB_PROTOTYPE_JOIN3(name, type, attr); \
+
+#define TB_PROTOTYPE_RB_KEY(name, type, field, keyfield, keytype) \
+    TB_PROTOTYPE_RB_KEY_INTERNAL(name, type, field, keyfield, keytype,)
+
+#define TB_PROTOTYPE_RB_KEY_STATIC(name, type, field, keyfield, keytype) \
+    TB_PROTOTYPE_RB_KEY_INTERNAL(name, type, field, keyfield, keytype, __tbtree_unused static)
+
+#define TB_PROTOTYPE_RB_KEY_INTERNAL(name, type, field, keyfield, keytype, attr) \
+    TB_PROTOTYPE_RB_INTERNAL(name, type, field, name##_TB_KEY_CMP, attr) \
+    TB_PROTOTYPE_KEY_CMP(name, type, attr); \
+    TB_PROTOTYPE_FIND_KEY(name, type, keytype, attr); \
+    TB_PROTOTYPE_NFIND_KEY(name, type, keytype, attr); \
+    TB_PROTOTYPE_PFIND_KEY(name, type, keytype, attr); \
+    TB_PROTOTYPE_FREEZE_KEY(name, type, keytype, attr); \
+    TB_PROTOTYPE_FROZEN_KEY(name, type, keytype, attr); \
+
+#define TB_PROTOTYPE_RANKED(name, type, field, cmp) \
+    TB_PROTOTYPE_RANKED_INTERNAL(name, type, field, cmp,)
+
+#define TB_PROTOTYPE_RANKED_STATIC(name, type, field, cmp) \
+    TB_PROTOTYPE_RANKED_INTERNAL(name, type, field, cmp, __tbtree_unused static)
+
+#define TB_PROTOTYPE_RANKED_INTERNAL(name, type, field, cmp, attr) \
+    TB_PROTOTYPE_INTERNAL(name, type, field, cmp, attr) \
+    TB_PROTOTYPE_UPDATE_SIZE(name, type, attr); \
+    TB_PROTOTYPE_SELECT(name, type, attr); \
+    TB_PROTOTYPE_RANK(name, type, attr); \
+    TB_PROTOTYPE_COUNT(name, type, attr); \
+
+#define TB_PROTOTYPE_RB_RANKED(name, type, field, cmp) \
+    TB_PROTOTYPE_RB_RANKED_INTERNAL(name, type, field, cmp,)
+
+#define TB_PROTOTYPE_RB_RANKED_STATIC(name, type, field, cmp) \
+    TB_PROTOTYPE_RB_RANKED_INTERNAL(name, type, field, cmp, __tbtree_unused static)
+
+#define TB_PROTOTYPE_RB_RANKED_INTERNAL(name, type, field, cmp, attr) \
+    TB_PROTOTYPE_RB_INTERNAL(name, type, field, cmp, attr) \
+    TB_PROTOTYPE_UPDATE_SIZE(name, type, attr); \
+    TB_PROTOTYPE_SELECT(name, type, attr); \
+    TB_PROTOTYPE_RANK(name, type, attr); \
+    TB_PROTOTYPE_COUNT(name, type, attr); \
+
+#define TB_PROTOTYPE_INTERVAL(name, type, field, cmp) \
+    TB_PROTOTYPE_INTERVAL_INTERNAL(name, type, field, cmp,)
+
+#define TB_PROTOTYPE_INTERVAL_STATIC(name, type, field, cmp) \
+    TB_PROTOTYPE_INTERVAL_INTERNAL(name, type, field, cmp, __tbtree_unused static)
+
+#define TB_PROTOTYPE_INTERVAL_INTERNAL(name, type, field, cmp, attr) \
+    TB_PROTOTYPE_RB_INTERNAL(name, type, field, cmp, attr) \
+    TB_PROTOTYPE_UPDATE_MAX(name, type, attr); \
+    TB_PROTOTYPE_OVERLAP_MIN(name, type, attr); \
+    TB_PROTOTYPE_OVERLAP(name, type, attr); \
+    TB_PROTOTYPE_OVERLAP_NEXT(name, type, attr); \
+
+#define TB_PROTOTYPE_IDX(name, type, field, cmp) \
+    TB_PROTOTYPE_IDX_INTERNAL(name, type, field, cmp,)
+
+#define TB_PROTOTYPE_IDX_STATIC(name, type, field, cmp) \
+    TB_PROTOTYPE_IDX_INTERNAL(name, type, field, cmp, __tbtree_unused static)
+
+#define TB_PROTOTYPE_IDX_INTERNAL(name, type, field, cmp, attr) \
+    TB_PROTOTYPE_FIRST(name, type, attr); \
+    TB_PROTOTYPE_LAST(name, type, attr); \
+    TB_PROTOTYPE_IDX_PREV(name, type, attr); \
+    TB_PROTOTYPE_IDX_NEXT(name, type, attr); \
+    TB_PROTOTYPE_FIND(name, type, attr); \
+    TB_PROTOTYPE_NFIND(name, type, attr); \
+    TB_PROTOTYPE_IDX_INSERT_COLOR(name, type, attr); \
+    TB_PROTOTYPE_REMOVE_COLOR(name, type, attr); \
+    TB_PROTOTYPE_INSERT(name, type, attr); \
+    TB_PROTOTYPE_REMOVE(name, type, attr); \
+    TB_PROTOTYPE_IDX_SAVE(name, type, attr); \
+    TB_PROTOTYPE_IDX_LOAD(name, type, attr); \
+    TB_PROTOTYPE_IDX_VERIFY(name, type, attr); \
+
+#define TB_PROTOTYPE_SHARDED(name, type) \
+    TB_PROTOTYPE_SHARDED_INTERNAL(name, type,)
+
+#define TB_PROTOTYPE_SHARDED_STATIC(name, type) \
+    TB_PROTOTYPE_SHARDED_INTERNAL(name, type, __tbtree_unused static)
+
+#define TB_PROTOTYPE_SHARDED_INTERNAL(name, type, attr) \
+    TB_PROTOTYPE_SHARD_LOCK(name, type, attr); \
+    TB_PROTOTYPE_SHARD_MOVE(name, type, attr); \
+    TB_PROTOTYPE_SHARD_BALANCE(name, type, attr); \
+    TB_PROTOTYPE_SHARD_ADAPT(name, type, attr); \
+    TB_PROTOTYPE_INSERT(name, type, attr); \
+    TB_PROTOTYPE_REMOVE(name, type, attr); \
+    TB_PROTOTYPE_FIND(name, type, attr); \
+    TB_PROTOTYPE_NFIND(name, type, attr); \
+    TB_PROTOTYPE_WALK(name, type, attr); \
+    TB_PROTOTYPE_COUNT(name, type, attr); \
 
 #define TB_PROTOTYPE_MIN(name, type, attr) \
     attr struct type *name##_TB_MIN(struct type *)
 
-#define TB_PROTOTYPE_MAX(name, type, attr) \
-    attr struct type *name##_TB_MAX(struct type *)
+#define TB_PROTOTYPE_MAX(name, type, attr) \
+    attr struct type *name##_TB_MAX(struct type *)
+
+#define TB_PROTOTYPE_PREV(name, type, attr) \
+    attr struct type *name##_TB_PREV(struct type *)
+
+#define TB_PROTOTYPE_NEXT(name, type, attr) \
+    attr struct type *name##_TB_NEXT(struct type *)
+
+#define TB_PROTOTYPE_PREV_N(name, type, attr) \
+    attr size_t name##_TB_PREV_N(struct type **, struct type **, size_t)
+
+#define TB_PROTOTYPE_NEXT_N(name, type, attr) \
+    attr size_t name##_TB_NEXT_N(struct type **, struct type **, size_t)
+
+#define TB_PROTOTYPE_FIRST(name, type, attr) \
+    attr struct type *name##_TB_FIRST(struct name *)
+
+#define TB_PROTOTYPE_LAST(name, type, attr) \
+    attr struct type *name##_TB_LAST(struct name *)
+
+#define TB_PROTOTYPE_FIND(name, type, attr) \
+    attr struct type *name##_TB_FIND(struct name *, struct type *)
+
+#define TB_PROTOTYPE_NFIND(name, type, attr) \
+    attr struct type *name##_TB_NFIND(struct name *, struct type *)
+
+#define TB_PROTOTYPE_PFIND(name, type, attr) \
+    attr struct type *name##_TB_PFIND(struct name *, struct type *)
+
+#define TB_PROTOTYPE_FIND_BATCH(name, type, attr) \
+    attr void name##_TB_FIND_BATCH(struct name *, struct type **, size_t, struct type **)
+
+#define TB_PROTOTYPE_NFIND_BATCH(name, type, attr) \
+    attr void name##_TB_NFIND_BATCH(struct name *, struct type **, size_t, struct type **)
+
+#define TB_PROTOTYPE_RANGE_FIRST(name, type, attr) \
+    attr struct type *name##_TB_RANGE_FIRST(struct name *, struct type *, struct type *, int)
+
+#define TB_PROTOTYPE_FREEZE(name, type, attr) \
+    attr size_t name##_TB_FREEZE(struct name *, struct type **, size_t)
+
+#define TB_PROTOTYPE_FROZEN(name, type, attr) \
+    attr size_t name##_TB_FROZEN_LOWER(struct type **, size_t, struct type *); \
+    attr size_t name##_TB_FROZEN_UPPER(struct type **, size_t, struct type *); \
+    attr struct type *name##_TB_FROZEN_FIND(struct type **, size_t, struct type *); \
+    attr struct type *name##_TB_FROZEN_NFIND(struct type **, size_t, struct type *)
+
+#define TB_PROTOTYPE_PARTITION(name, type, attr) \
+    attr size_t name##_TB_PARTITION(struct name *, size_t, struct type **); \
+    attr void name##_TB_PARALLEL_FOREACH(struct type **, size_t, \
+                                         void (*)(struct type *, void *), void *)
+
+#define TB_PROTOTYPE_RANGE_NEXT(name, type, attr) \
+    attr struct type *name##_TB_RANGE_NEXT(struct type *, struct type *, int)
+
+#define TB_PROTOTYPE_INSERT(name, type, attr) \
+    attr struct type *name##_TB_INSERT(struct name *, struct type *)
+
+#define TB_PROTOTYPE_INSERT_HINT(name, type, attr) \
+    attr struct type *name##_TB_INSERT_HINT(struct name *, struct type *, struct type *)
+
+#define TB_PROTOTYPE_REMOVE(name, type, attr) \
+    attr struct type *name##_TB_REMOVE(struct name *, struct type *)
+
+#define TB_PROTOTYPE_REINSERT(name, type, attr) \
+    attr struct type *name##_TB_REINSERT(struct name *, struct type *)
+
+#define TB_PROTOTYPE_INSERT_COLOR(name, type, attr) \
+    attr int name##_TB_INSERT_COLOR(struct name *, struct type *)
+
+#define TB_PROTOTYPE_REMOVE_COLOR(name, type, attr) \
+    attr void name##_TB_REMOVE_COLOR(struct name *, struct type *, struct type *, int)
+
+#define TB_PROTOTYPE_COMPRESS(name, type, attr) \
+    attr struct type *name##_TB_COMPRESS(struct name *, struct type *, size_t)
+
+#define TB_PROTOTYPE_BALANCE(name, type, attr) \
+    attr struct type *name##_TB_BALANCE(struct name *, struct type *)
+
+#define TB_PROTOTYPE_REBALANCE(name, type, attr) \
+    attr void name##_TB_REBALANCE(struct name *)
+
+#define TB_PROTOTYPE_BUILD_SORTED(name, type, attr) \
+    attr void name##_TB_BUILD_SORTED(struct name *, struct type **, size_t)
+
+#define TB_PROTOTYPE_MERGE(name, type, attr) \
+    attr void name##_TB_MERGE(struct name *, struct name *, \
+                              struct type *(*)(struct type *, struct type *))
+
+#define TB_PROTOTYPE_SPLIT(name, type, attr) \
+    attr void name##_TB_SPLIT(struct name *, struct type *, struct name *, struct name *)
+
+#define TB_PROTOTYPE_JOIN(name, type, attr) \
+    attr void name##_TB_JOIN(struct name *, struct name *)
+
+#define TB_PROTOTYPE_REMOVE_RANGE(name, type, attr) \
+    attr size_t name##_TB_REMOVE_RANGE(struct name *, struct type *, struct type *, int, \
+                                       void (*)(struct type *))
+
+/* Without TBTREE_STATS this only declares `struct name`. */
+#ifdef TBTREE_STATS
+#define TB_PROTOTYPE_STATS(name, type, attr) \
+    attr void name##_TB_STATS(struct name *, struct tb_stats *)
+#else
+#define TB_PROTOTYPE_STATS(name, type, attr) \
+    struct name
+#endif
+
+#define TB_PROTOTYPE_JOIN3(name, type, attr) \
+    attr struct type *name##_TB_JOIN3(struct type *, int, struct type *, \
+                                      struct type *, int, int *)
+
+#define TB_PROTOTYPE_SPLAY_ROOT(name, type, attr) \
+    attr void name##_TB_SPLAY(struct name *, struct type *); \
+    attr struct type *name##_TB_SPLAY_DESCEND(struct name *, struct type *, \
+                                              struct type **, struct type **)
+
+#define TB_PROTOTYPE_INSERT_SG(name, type, attr) \
+    attr void name##_TB_INSERT_SG(struct name *, struct type *)
+
+#define TB_PROTOTYPE_REMOVE_SG(name, type, attr) \
+    attr void name##_TB_REMOVE_SG(struct name *, struct type *)
+
+#define TB_PROTOTYPE_PREFIX_CMP(name, type, attr) \
+    attr int name##_TB_PREFIX_CMP(struct type *, struct type *)
+
+#define TB_PROTOTYPE_MULTI_CMP(name, type, attr) \
+    attr int name##_TB_MULTI_AFTER(struct type *, struct type *); \
+    attr int name##_TB_MULTI_BEFORE(struct type *, struct type *)
+
+#define TB_PROTOTYPE_EQUAL_RANGE(name, type, attr) \
+    attr struct type *name##_TB_EQUAL_RANGE(struct name *, struct type *, struct type **)
+
+#define TB_PROTOTYPE_KEY_CMP(name, type, attr) \
+    attr int name##_TB_KEY_CMP(const struct type *, const struct type *)
+
+#define TB_PROTOTYPE_FIND_KEY(name, type, keytype, attr) \
+    attr struct type *name##_TB_FIND_KEY(struct name *, keytype)
+
+#define TB_PROTOTYPE_NFIND_KEY(name, type, keytype, attr) \
+    attr struct type *name##_TB_NFIND_KEY(struct name *, keytype)
+
+#define TB_PROTOTYPE_PFIND_KEY(name, type, keytype, attr) \
+    attr struct type *name##_TB_PFIND_KEY(struct name *, keytype)
+
+#define TB_PROTOTYPE_FREEZE_KEY(name, type, keytype, attr) \
+    attr size_t name##_TB_FREEZE_KEY(struct name *, keytype *, struct type **, size_t)
+
+#define TB_PROTOTYPE_FROZEN_KEY(name, type, keytype, attr) \
+    attr size_t name##_TB_FROZEN_LOWER_KEY(const keytype *, size_t, keytype); \
+    attr size_t name##_TB_FROZEN_UPPER_KEY(const keytype *, size_t, keytype); \
+    attr struct type *name##_TB_FROZEN_FIND_KEY(const keytype *, struct type **, size_t, \
+                                                keytype); \
+    attr struct type *name##_TB_FROZEN_NFIND_KEY(const keytype *, struct type **, size_t, \
+                                                 keytype)
+
+#define TB_PROTOTYPE_IDX_PREV(name, type, attr) \
+    attr struct type *name##_TB_PREV(struct name *, struct type *)
+
+#define TB_PROTOTYPE_IDX_NEXT(name, type, attr) \
+    attr struct type *name##_TB_NEXT(struct name *, struct type *)
+
+#define TB_PROTOTYPE_IDX_SAVE(name, type, attr) \
+    attr void name##_TB_SAVE(struct name *, size_t, struct tb_image *)
+
+#define TB_PROTOTYPE_IDX_LOAD(name, type, attr) \
+    attr int name##_TB_LOAD(struct name *, const void *, size_t)
+
+#define TB_PROTOTYPE_IDX_VERIFY(name, type, attr) \
+    attr int name##_TB_VERIFY(const void *, size_t)
+
+#define TB_PROTOTYPE_IDX_INSERT_COLOR(name, type, attr) \
+    attr void name##_TB_INSERT_COLOR(struct name *, struct type *)
+
+#define TB_PROTOTYPE_SHARD_LOCK(name, type, attr) \
+    attr size_t name##_TB_SHARD_LOCK(struct name *, struct type *)
+
+#define TB_PROTOTYPE_SHARD_MOVE(name, type, attr) \
+    attr void name##_TB_SHARD_MOVE(struct name *, size_t)
+
+#define TB_PROTOTYPE_SHARD_BALANCE(name, type, attr) \
+    attr void name##_TB_SHARD_BALANCE(struct name *)
+
+#define TB_PROTOTYPE_SHARD_ADAPT(name, type, attr) \
+    attr void name##_TB_SHARD_ADAPT(struct name *, size_t)
+
+#define TB_PROTOTYPE_WALK(name, type, attr) \
+    attr void name##_TB_WALK(struct name *, void (*)(struct type *, void *), void *)
+
+#define TB_PROTOTYPE_UPDATE_SIZE(name, type, attr) \
+    attr int name##_TB_UPDATE_SIZE(struct type *)
+
+#define TB_PROTOTYPE_SELECT(name, type, attr) \
+    attr struct type *name##_TB_SELECT(struct name *, size_t)
+
+#define TB_PROTOTYPE_RANK(name, type, attr) \
+    attr size_t name##_TB_RANK(struct name *, struct type *)
+
+#define TB_PROTOTYPE_COUNT(name, type, attr) \
+    attr size_t name##_TB_COUNT(struct name *)
+
+#define TB_PROTOTYPE_UPDATE_MAX(name, type, attr) \
+    attr int name##_TB_UPDATE_MAX(struct type *)
+
+#define TB_PROTOTYPE_OVERLAP_MIN(name, type, attr) \
+    attr struct type *name##_TB_OVERLAP_MIN(struct type *, const struct type *)
+
+#define TB_PROTOTYPE_OVERLAP(name, type, attr) \
+    attr struct type *name##_TB_OVERLAP(struct name *, const struct type *)
+
+#define TB_PROTOTYPE_OVERLAP_NEXT(name, type, attr) \
+    attr struct type *name##_TB_OVERLAP_NEXT(struct type *, const struct type *)
+
+#define TB_GENERATE(name, type, field, cmp) \
+    TB_GENERATE_INTERNAL(name, type, field, cmp,)
+
+#define TB_GENERATE_STATIC(name, type, field, cmp) \
+    TB_GENERATE_INTERNAL(name, type, field, cmp, __tbtree_unused static)
+
+#define TB_GENERATE_INTERNAL(name, type, field, cmp, attr) \
+    TB_GENERATE_AUGMENT_INTERNAL(name, type, field, cmp, TB_AUGMENT_NONE, attr)
+
+/* `aug(elm)` is called on every node whose subtree has changed, children
+ * before parents, and must recompute the data of `elm` from its own and
+ * that of its children, returning nonzero if it has changed. Updates stop
+ * propagating upwards once it returns 0. The prototypes are the same as
+ * for TB_GENERATE. */
+#define TB_GENERATE_AUGMENT(name, type, field, cmp, aug) \
+    TB_GENERATE_AUGMENT_INTERNAL(name, type, field, cmp, aug,)
+
+#define TB_GENERATE_AUGMENT_STATIC(name, type, field, cmp, aug) \
+    TB_GENERATE_AUGMENT_INTERNAL(name, type, field, cmp, aug, __tbtree_unused static)
+
+#define TB_GENERATE_AUGMENT_INTERNAL(name, type, field, cmp, aug, attr) \
+    TB_GENERATE_MIN(name, type, field, attr) \
+    TB_GENERATE_MAX(name, type, field, attr) \
+    TB_GENERATE_PREV(name, type, field, attr) \
+    TB_GENERATE_NEXT(name, type, field, attr) \
+    TB_GENERATE_PREV_N(name, type, field, attr) \
+    TB_GENERATE_NEXT_N(name, type, field, attr) \
+    TB_GENERATE_FIRST(name, type, attr) \
+    TB_GENERATE_LAST(name, type, attr) \
+    TB_GENERATE_FIND(name, type, field, TB_STAT_CMP(cmp), attr) \
+    TB_GENERATE_NFIND(name, type, field, TB_STAT_CMP(cmp), attr) \
+    TB_GENERATE_PFIND(name, type, field, TB_STAT_CMP(cmp), attr) \
+    TB_GENERATE_FIND_BATCH(name, type, field, TB_STAT_CMP(cmp), attr) \
+    TB_GENERATE_NFIND_BATCH(name, type, field, TB_STAT_CMP(cmp), attr) \
+    TB_GENERATE_RANGE_FIRST(name, type, field, TB_STAT_CMP(cmp), attr) \
+    TB_GENERATE_RANGE_NEXT(name, type, field, TB_STAT_CMP(cmp), attr) \
+    TB_GENERATE_FREEZE(name, type, field, attr) \
+    TB_GENERATE_FROZEN(name, type, field, TB_STAT_CMP(cmp), attr) \
+    TB_GENERATE_PARTITION(name, type, field, attr) \
+    TB_GENERATE_INSERT_FIX(name, type, field, TB_STAT_CMP(cmp), TB_NOFIX, aug, attr) \
+    TB_GENERATE_REMOVE_FIX(name, type, field, TB_STAT_CMP(cmp), TB_NOFIX, aug, attr) \
+    TB_GENERATE_REINSERT(name, type, field, TB_STAT_CMP(cmp), attr) \
+    TB_GENERATE_COMPRESS(name, type, field, aug, TB_COLOR_NONE, attr) \
+    TB_GENERATE_BALANCE(name, type, field, aug, TB_COLOR_NONE, attr) \
+    TB_GENERATE_REBALANCE(name, type, field, attr) \
+    TB_GENERATE_BUILD_SORTED(name, type, field, aug, attr) \
+    TB_GENERATE_MERGE(name, type, field, TB_STAT_CMP(cmp), aug, attr) \
+    TB_GENERATE_SPLIT(name, type, field, TB_STAT_CMP(cmp), aug, attr) \
+    TB_GENERATE_JOIN(name, type, field, aug, attr) \
+    TB_GENERATE_REMOVE_RANGE(name, type, field, attr) \
+    TB_GENERATE_STATS(name, type, field, attr) \
+
+#define TB_GENERATE_RB(name, type, field, cmp) \
+    TB_GENERATE_RB_INTERNAL(name, type, field, cmp,)
+
+#define TB_GENERATE_RB_STATIC(name, type, field, cmp) \
+    TB_GENERATE_RB_INTERNAL(name, type, field, cmp, __tbtree_unused static)
+
+#define TB_GENERATE_RB_INTERNAL(name, type, field, cmp, attr) \
+    TB_GENERATE_RB_AUGMENT_INTERNAL(name, type, field, cmp, TB_AUGMENT_NONE, attr)
+
+#define TB_GENERATE_RB_AUGMENT(name, type, field, cmp, aug) \
+    TB_GENERATE_RB_AUGMENT_INTERNAL(name, type, field, cmp, aug,)
+
+#define TB_GENERATE_RB_AUGMENT_STATIC(name, type, field, cmp, aug) \
+    TB_GENERATE_RB_AUGMENT_INTERNAL(name, type, field, cmp, aug, __tbtree_unused static)
+
+#define TB_GENERATE_RB_AUGMENT_INTERNAL(name, type, field, cmp, aug, attr) \
+    TB_GENERATE_MIN(name, type, field, attr) \
+    TB_GENERATE_MAX(name, type, field, attr) \
+    TB_GENERATE_PREV(name, type, field, attr) \
+    TB_GENERATE_NEXT(name, type, field, attr) \
+    TB_GENERATE_PREV_N(name, type, field, attr) \
+    TB_GENERATE_NEXT_N(name, type, field, attr) \
+    TB_GENERATE_FIRST(name, type, attr) \
+    TB_GENERATE_LAST(name, type, attr) \
+    TB_GENERATE_FIND(name, type, field, TB_STAT_CMP(cmp), attr) \
+    TB_GENERATE_NFIND(name, type, field, TB_STAT_CMP(cmp), attr) \
+    TB_GENERATE_PFIND(name, type, field, TB_STAT_CMP(cmp), attr) \
+    TB_GENERATE_FIND_BATCH(name, type, field, TB_STAT_CMP(cmp), attr) \
+    TB_GENERATE_NFIND_BATCH(name, type, field, TB_STAT_CMP(cmp), attr) \
+    TB_GENERATE_RANGE_FIRST(name, type, field, TB_STAT_CMP(cmp), attr) \
+    TB_GENERATE_RANGE_NEXT(name, type, field, TB_STAT_CMP(cmp), attr) \
+    TB_GENERATE_FREEZE(name, type, field, attr) \
+    TB_GENERATE_FROZEN(name, type, field, TB_STAT_CMP(cmp), attr) \
+    TB_GENERATE_PARTITION(name, type, field, attr) \
+    TB_GENERATE_INSERT_COLOR(name, type, field, aug, attr) \
+    TB_GENERATE_REMOVE_COLOR(name, type, field, aug, attr) \
+    TB_GENERATE_INSERT_FIX(name, type, field, TB_STAT_CMP(cmp), name##_TB_INSERT_COLOR, aug, attr) \
+    TB_GENERATE_RB_REMOVE(name, type, field, TB_STAT_CMP(cmp), aug, attr) \
+    TB_GENERATE_REINSERT(name, type, field, TB_STAT_CMP(cmp), attr) \
+    TB_GENERATE_COMPRESS(name, type, field, aug, TB_COLOR_RB, attr) \
+    TB_GENERATE_BALANCE(name, type, field, aug, TB_COLOR_RB, attr) \
+    TB_GENERATE_REBALANCE(name, type, field, attr) \
+    TB_GENERATE_BUILD_SORTED(name, type, field, aug, attr) \
+    TB_GENERATE_MERGE(name, type, field, TB_STAT_CMP(cmp), aug, attr) \
+    TB_GENERATE_JOIN3(name, type, field, aug, attr) \
+    TB_GENERATE_RB_SPLIT(name, type, field, TB_STAT_CMP(cmp), attr) \
+    TB_GENERATE_RB_JOIN(name, type, field, attr) \
+    TB_GENERATE_REMOVE_RANGE(name, type, field, attr) \
+    TB_GENERATE_STATS(name, type, field, attr) \
+
+/* Splay trees move the node reached by TB_FIND, TB_NFIND and TB_PFIND, and
+ * each inserted node, to the root, so that recently used keys stay a few
+ * levels deep, with amortized O(log n) operations. The lookups modify the
+ * tree, so they need the same exclusion as the updates. */
+#define TB_GENERATE_SPLAY(name, type, field, cmp) \
+    TB_GENERATE_SPLAY_INTERNAL(name, type, field, cmp,)
+
+#define TB_GENERATE_SPLAY_STATIC(name, type, field, cmp) \
+    TB_GENERATE_SPLAY_INTERNAL(name, type, field, cmp, __tbtree_unused static)
+
+#define TB_GENERATE_SPLAY_INTERNAL(name, type, field, cmp, attr) \
+    TB_GENERATE_MIN(name, type, field, attr) \
+    TB_GENERATE_MAX(name, type, field, attr) \
+    TB_GENERATE_PREV(name, type, field, attr) \
+    TB_GENERATE_NEXT(name, type, field, attr) \
+    TB_GENERATE_PREV_N(name, type, field, attr) \
+    TB_GENERATE_NEXT_N(name, type, field, attr) \
+    TB_GENERATE_FIRST(name, type, attr) \
+    TB_GENERATE_LAST(name, type, attr) \
+    TB_GENERATE_SPLAY_ROOT(name, type, field, attr) \
+    TB_GENERATE_SPLAY_FIND(name, type, field, TB_STAT_CMP(cmp), attr) \
+    TB_GENERATE_FIND_BATCH(name, type, field, TB_STAT_CMP(cmp), attr) \
+    TB_GENERATE_NFIND_BATCH(name, type, field, TB_STAT_CMP(cmp), attr) \
+    TB_GENERATE_RANGE_FIRST(name, type, field, TB_STAT_CMP(cmp), attr) \
+    TB_GENERATE_RANGE_NEXT(name, type, field, TB_STAT_CMP(cmp), attr) \
+    TB_GENERATE_FREEZE(name, type, field, attr) \
+    TB_GENERATE_FROZEN(name, type, field, TB_STAT_CMP(cmp), attr) \
+    TB_GENERATE_PARTITION(name, type, field, attr) \
+    TB_GENERATE_INSERT_FIX(name, type, field, TB_STAT_CMP(cmp), name##_TB_SPLAY, \
+                           TB_AUGMENT_NONE, attr) \
+    TB_GENERATE_REMOVE_FIX(name, type, field, TB_STAT_CMP(cmp), TB_NOFIX, \
+                           TB_AUGMENT_NONE, attr) \
+    TB_GENERATE_REINSERT(name, type, field, TB_STAT_CMP(cmp), attr) \
+    TB_GENERATE_COMPRESS(name, type, field, TB_AUGMENT_NONE, TB_COLOR_NONE, attr) \
+    TB_GENERATE_BALANCE(name, type, field, TB_AUGMENT_NONE, TB_COLOR_NONE, attr) \
+    TB_GENERATE_REBALANCE(name, type, field, attr) \
+    TB_GENERATE_BUILD_SORTED(name, type, field, TB_AUGMENT_NONE, attr) \
+    TB_GENERATE_MERGE(name, type, field, TB_STAT_CMP(cmp), TB_AUGMENT_NONE, attr) \
+    TB_GENERATE_SPLIT(name, type, field, TB_STAT_CMP(cmp), TB_AUGMENT_NONE, attr) \
+    TB_GENERATE_JOIN(name, type, field, TB_AUGMENT_NONE, attr) \
+    TB_GENERATE_REMOVE_RANGE(name, type, field, attr) \
+    TB_GENERATE_STATS(name, type, field, attr) \
+
+#define TB_GENERATE_SG(name, type, field, cmp) \
+    TB_GENERATE_SG_INTERNAL(name, type, field, cmp,)
+
+#define TB_GENERATE_SG_STATIC(name, type, field, cmp) \
+    TB_GENERATE_SG_INTERNAL(name, type, field, cmp, __tbtree_unused static)
+
+#define TB_GENERATE_SG_INTERNAL(name, type, field, cmp, attr) \
+    TB_GENERATE_MIN(name, type, field, attr) \
+    TB_GENERATE_MAX(name, type, field, attr) \
+    TB_GENERATE_PREV(name, type, field, attr) \
+    TB_GENERATE_NEXT(name, type, field, attr) \
+    TB_GENERATE_PREV_N(name, type, field, attr) \
+    TB_GENERATE_NEXT_N(name, type, field, attr) \
+    TB_GENERATE_FIRST(name, type, attr) \
+    TB_GENERATE_LAST(name, type, attr) \
+    TB_GENERATE_FIND(name, type, field, TB_STAT_CMP(cmp), attr) \
+    TB_GENERATE_NFIND(name, type, field, TB_STAT_CMP(cmp), attr) \
+    TB_GENERATE_PFIND(name, type, field, TB_STAT_CMP(cmp), attr) \
+    TB_GENERATE_FIND_BATCH(name, type, field, TB_STAT_CMP(cmp), attr) \
+    TB_GENERATE_NFIND_BATCH(name, type, field, TB_STAT_CMP(cmp), attr) \
+    TB_GENERATE_RANGE_FIRST(name, type, field, TB_STAT_CMP(cmp), attr) \
+    TB_GENERATE_RANGE_NEXT(name, type, field, TB_STAT_CMP(cmp), attr) \
+    TB_GENERATE_FREEZE(name, type, field, attr) \
+    TB_GENERATE_FROZEN(name, type, field, TB_STAT_CMP(cmp), attr) \
+    TB_GENERATE_PARTITION(name, type, field, attr) \
+    TB_GENERATE_COMPRESS(name, type, field, TB_AUGMENT_NONE, TB_COLOR_NONE, attr) \
+    TB_GENERATE_BALANCE(name, type, field, TB_AUGMENT_NONE, TB_COLOR_NONE, attr) \
+    TB_GENERATE_SG_REBALANCE(name, type, field, attr) \
+    TB_GENERATE_SG_BUILD_SORTED(name, type, field, attr) \
+    TB_GENERATE_SG_MERGE(name, type, field, TB_STAT_CMP(cmp), attr) \
+    TB_GENERATE_INSERT_SG(name, type, field, attr) \
+    TB_GENERATE_REMOVE_SG(name, type, field, attr) \
+    TB_GENERATE_INSERT_FIX(name, type, field, TB_STAT_CMP(cmp), name##_TB_INSERT_SG, TB_AUGMENT_NONE, attr) \
+    TB_GENERATE_REMOVE_FIX(name, type, field, TB_STAT_CMP(cmp), name##_TB_REMOVE_SG, TB_AUGMENT_NONE, attr) \
+    TB_GENERATE_REINSERT(name, type, field, TB_STAT_CMP(cmp), attr) \
+    TB_GENERATE_SG_REMOVE_RANGE(name, type, field, TB_STAT_CMP(cmp), attr) \
+    TB_GENERATE_STATS(name, type, field, attr) \
+
+/* Trees ordered by the scalar member `keyfield` of type `keytype`, with
+ * lookups by a bare key. */
+#define TB_GENERATE_KEY(name, type, field, keyfield, keytype) \
+    TB_GENERATE_KEY_INTERNAL(name, type, field, keyfield, keytype,)
+
+#define TB_GENERATE_KEY_STATIC(name, type, field, keyfield, keytype) \
+    TB_GENERATE_KEY_INTERNAL(name, type, field, keyfield, keytype, __tbtree_unused static)
+
+#define TB_GENERATE_KEY_INTERNAL(name, type, field, keyfield, keytype, attr) \
+    TB_GENERATE_KEY_CMP(name, type, keyfield, attr) \
+    TB_GENERATE_INTERNAL(name, type, field, name##_TB_KEY_CMP, attr) \
+    TB_GENERATE_FIND_KEY(name, type, field, keyfield, keytype, attr) \
+    TB_GENERATE_NFIND_KEY(name, type, field, keyfield, keytype, attr) \
+    TB_GENERATE_PFIND_KEY(name, type, field, keyfield, keytype, attr) \
+    TB_GENERATE_FREEZE_KEY(name, type, field, keyfield, keytype, attr) \
+    TB_GENERATE_FROZEN_KEY(name, type, keytype, attr) \
+
+#define TB_GENERATE_RB_KEY(name, type, field, keyfield, keytype) \
+    TB_GENERATE_RB_KEY_INTERNAL(name, type, field, keyfield, keytype,)
+
+#define TB_GENERATE_RB_KEY_STATIC(name, type, field, keyfield, keytype) \
+    TB_GENERATE_RB_KEY_INTERNAL(name, type, field, keyfield, keytype, __tbtree_unused static)
+
+#define TB_GENERATE_RB_KEY_INTERNAL(name, type, field, keyfield, keytype, attr) \
+    TB_GENERATE_KEY_CMP(name, type, keyfield, attr) \
+    TB_GENERATE_RB_INTERNAL(name, type, field, name##_TB_KEY_CMP, attr) \
+    TB_GENERATE_FIND_KEY(name, type, field, keyfield, keytype, attr) \
+    TB_GENERATE_NFIND_KEY(name, type, field, keyfield, keytype, attr) \
+    TB_GENERATE_PFIND_KEY(name, type, field, keyfield, keytype, attr) \
+    TB_GENERATE_FREEZE_KEY(name, type, field, keyfield, keytype, attr) \
+    TB_GENERATE_FROZEN_KEY(name, type, keytype, attr) \
+
+/* Prefix trees need TB_ENTRY_PREFIX and order the nodes by the cached
+ * `TB_PREFIX(elm, field)` first, calling `cmp` only on ties, so that most
+ * levels of a descent do not touch the key. The prefix must be set, e.g.
+ * with tb_prefix() or tb_prefix_str(), on nodes before they are inserted
+ * or reinserted and on the keys of lookups, and must order like `cmp`. */
+#define TB_GENERATE_PREFIX(name, type, field, cmp) \
+    TB_GENERATE_PREFIX_INTERNAL(name, type, field, cmp,)
+
+#define TB_GENERATE_PREFIX_STATIC(name, type, field, cmp) \
+    TB_GENERATE_PREFIX_INTERNAL(name, type, field, cmp, __tbtree_unused static)
+
+#define TB_GENERATE_PREFIX_INTERNAL(name, type, field, cmp, attr) \
+    TB_GENERATE_PREFIX_CMP(name, type, field, cmp, attr) \
+    TB_GENERATE_INTERNAL(name, type, field, name##_TB_PREFIX_CMP, attr) \
+
+#define TB_GENERATE_RB_PREFIX(name, type, field, cmp) \
+    TB_GENERATE_RB_PREFIX_INTERNAL(name, type, field, cmp,)
+
+#define TB_GENERATE_RB_PREFIX_STATIC(name, type, field, cmp) \
+    TB_GENERATE_RB_PREFIX_INTERNAL(name, type, field, cmp, __tbtree_unused static)
+
+#define TB_GENERATE_RB_PREFIX_INTERNAL(name, type, field, cmp, attr) \
+    TB_GENERATE_PREFIX_CMP(name, type, field, cmp, attr) \
+    TB_GENERATE_RB_INTERNAL(name, type, field, name##_TB_PREFIX_CMP, attr) \
+
+/* Multisets keep equal keys in insertion order: TB_INSERT always links
+ * `elm`, after the nodes equal to it, and TB_FIND returns the first of
+ * them. TB_EQUAL_RANGE finds all of them at once. TB_MERGE and the batch
+ * lookups are not generated. */
+#define TB_GENERATE_MULTI(name, type, field, cmp) \
+    TB_GENERATE_MULTI_INTERNAL(name, type, field, cmp,)
+
+#define TB_GENERATE_MULTI_STATIC(name, type, field, cmp) \
+    TB_GENERATE_MULTI_INTERNAL(name, type, field, cmp, __tbtree_unused static)
+
+#define TB_GENERATE_MULTI_INTERNAL(name, type, field, cmp, attr) \
+    TB_GENERATE_MIN(name, type, field, attr) \
+    TB_GENERATE_MAX(name, type, field, attr) \
+    TB_GENERATE_PREV(name, type, field, attr) \
+    TB_GENERATE_NEXT(name, type, field, attr) \
+    TB_GENERATE_PREV_N(name, type, field, attr) \
+    TB_GENERATE_NEXT_N(name, type, field, attr) \
+    TB_GENERATE_FIRST(name, type, attr) \
+    TB_GENERATE_LAST(name, type, attr) \
+    TB_GENERATE_MULTI_CMP(name, type, TB_STAT_CMP(cmp), attr) \
+    TB_GENERATE_MULTI_FIND(name, type, field, TB_STAT_CMP(cmp), attr) \
+    TB_GENERATE_RANGE_FIRST(name, type, field, TB_STAT_CMP(cmp), attr) \
+    TB_GENERATE_RANGE_NEXT(name, type, field, TB_STAT_CMP(cmp), attr) \
+    TB_GENERATE_FREEZE(name, type, field, attr) \
+    TB_GENERATE_FROZEN(name, type, field, TB_STAT_CMP(cmp), attr) \
+    TB_GENERATE_PARTITION(name, type, field, attr) \
+    TB_GENERATE_INSERT_FIX(name, type, field, name##_TB_MULTI_AFTER, TB_NOFIX, \
+                           TB_AUGMENT_NONE, attr) \
+    TB_GENERATE_REMOVE_FIX(name, type, field, TB_STAT_CMP(cmp), TB_NOFIX, \
+                           TB_AUGMENT_NONE, attr) \
+    TB_GENERATE_REINSERT(name, type, field, name##_TB_MULTI_BEFORE, attr) \
+    TB_GENERATE_COMPRESS(name, type, field, TB_AUGMENT_NONE, TB_COLOR_NONE, attr) \
+    TB_GENERATE_BALANCE(name, type, field, TB_AUGMENT_NONE, TB_COLOR_NONE, attr) \
+    TB_GENERATE_REBALANCE(name, type, field, attr) \
+    TB_GENERATE_BUILD_SORTED(name, type, field, TB_AUGMENT_NONE, attr) \
+    TB_GENERATE_SPLIT(name, type, field, TB_STAT_CMP(cmp), TB_AUGMENT_NONE, attr) \
+    TB_GENERATE_JOIN(name, type, field, TB_AUGMENT_NONE, attr) \
+    TB_GENERATE_REMOVE_RANGE(name, type, field, attr) \
+    TB_GENERATE_STATS(name, type, field, attr) \
+
+#define TB_GENERATE_RB_MULTI(name, type, field, cmp) \
+    TB_GENERATE_RB_MULTI_INTERNAL(name, type, field, cmp,)
+
+#define TB_GENERATE_RB_MULTI_STATIC(name, type, field, cmp) \
+    TB_GENERATE_RB_MULTI_INTERNAL(name, type, field, cmp, __tbtree_unused static)
+
+#define TB_GENERATE_RB_MULTI_INTERNAL(name, type, field, cmp, attr) \
+    TB_GENERATE_MIN(name, type, field, attr) \
+    TB_GENERATE_MAX(name, type, field, attr) \
+    TB_GENERATE_PREV(name, type, field, attr) \
+    TB_GENERATE_NEXT(name, type, field, attr) \
+    TB_GENERATE_PREV_N(name, type, field, attr) \
+    TB_GENERATE_NEXT_N(name, type, field, attr) \
+    TB_GENERATE_FIRST(name, type, attr) \
+    TB_GENERATE_LAST(name, type, attr) \
+    TB_GENERATE_MULTI_CMP(name, type, TB_STAT_CMP(cmp), attr) \
+    TB_GENERATE_MULTI_FIND(name, type, field, TB_STAT_CMP(cmp), attr) \
+    TB_GENERATE_RANGE_FIRST(name, type, field, TB_STAT_CMP(cmp), attr) \
+    TB_GENERATE_RANGE_NEXT(name, type, field, TB_STAT_CMP(cmp), attr) \
+    TB_GENERATE_FREEZE(name, type, field, attr) \
+    TB_GENERATE_FROZEN(name, type, field, TB_STAT_CMP(cmp), attr) \
+    TB_GENERATE_PARTITION(name, type, field, attr) \
+    TB_GENERATE_INSERT_COLOR(name, type, field, TB_AUGMENT_NONE, attr) \
+    TB_GENERATE_REMOVE_COLOR(name, type, field, TB_AUGMENT_NONE, attr) \
+    TB_GENERATE_INSERT_FIX(name, type, field, name##_TB_MULTI_AFTER, \
+                           name##_TB_INSERT_COLOR, TB_AUGMENT_NONE, attr) \
+    TB_GENERATE_RB_REMOVE(name, type, field, TB_STAT_CMP(cmp), TB_AUGMENT_NONE, attr) \
+    TB_GENERATE_REINSERT(name, type, field, name##_TB_MULTI_BEFORE, attr) \
+    TB_GENERATE_COMPRESS(name, type, field, TB_AUGMENT_NONE, TB_COLOR_RB, attr) \
+    TB_GENERATE_BALANCE(name, type, field, TB_AUGMENT_NONE, TB_COLOR_RB, attr) \
+    TB_GENERATE_REBALANCE(name, type, field, attr) \
+    TB_GENERATE_BUILD_SORTED(name, type, field, TB_AUGMENT_NONE, attr) \
+    TB_GENERATE_JOIN3(name, type, field, TB_AUGMENT_NONE, attr) \
+    TB_GENERATE_RB_SPLIT(name, type, field, name##_TB_MULTI_BEFORE, attr) \
+    TB_GENERATE_RB_JOIN(name, type, field, attr) \
+    TB_GENERATE_REMOVE_RANGE(name, type, field, attr) \
+    TB_GENERATE_STATS(name, type, field, attr) \
+
+/* Order statistics need TB_ENTRY_RANKED and keep the subtree sizes
+ * up to date through every update. */
+#define TB_GENERATE_RANKED(name, type, field, cmp) \
+    TB_GENERATE_RANKED_INTERNAL(name, type, field, cmp,)
+
+#define TB_GENERATE_RANKED_STATIC(name, type, field, cmp) \
+    TB_GENERATE_RANKED_INTERNAL(name, type, field, cmp, __tbtree_unused static)
+
+#define TB_GENERATE_RANKED_INTERNAL(name, type, field, cmp, attr) \
+    TB_GENERATE_UPDATE_SIZE(name, type, field, attr) \
+    TB_GENERATE_AUGMENT_INTERNAL(name, type, field, cmp, name##_TB_UPDATE_SIZE, attr) \
+    TB_GENERATE_SELECT(name, type, field, attr) \
+    TB_GENERATE_RANK(name, type, field, attr) \
+    TB_GENERATE_COUNT(name, type, field, attr) \
+
+#define TB_GENERATE_RB_RANKED(name, type, field, cmp) \
+    TB_GENERATE_RB_RANKED_INTERNAL(name, type, field, cmp,)
+
+#define TB_GENERATE_RB_RANKED_STATIC(name, type, field, cmp) \
+    TB_GENERATE_RB_RANKED_INTERNAL(name, type, field, cmp, __tbtree_unused static)
+
+#define TB_GENERATE_RB_RANKED_INTERNAL(name, type, field, cmp, attr) \
+    TB_GENERATE_UPDATE_SIZE(name, type, field, attr) \
+    TB_GENERATE_RB_AUGMENT_INTERNAL(name, type, field, cmp, name##_TB_UPDATE_SIZE, attr) \
+    TB_GENERATE_SELECT(name, type, field, attr) \
+    TB_GENERATE_RANK(name, type, field, attr) \
+    TB_GENERATE_COUNT(name, type, field, attr) \
+
+/* Interval trees are red-black trees of closed intervals [lo, hi] ordered
+ * by `cmp`, which must sort by `lo` first. `max` is kept as the greatest
+ * `hi` of each subtree; `lo`, `hi` and `max` name members of `type`. */
+#define TB_GENERATE_INTERVAL(name, type, field, cmp, lo, hi, max) \
+    TB_GENERATE_INTERVAL_INTERNAL(name, type, field, cmp, lo, hi, max,)
+
+#define TB_GENERATE_INTERVAL_STATIC(name, type, field, cmp, lo, hi, max) \
+    TB_GENERATE_INTERVAL_INTERNAL(name, type, field, cmp, lo, hi, max, __tbtree_unused static)
+
+#define TB_GENERATE_INTERVAL_INTERNAL(name, type, field, cmp, lo, hi, max, attr) \
+    TB_GENERATE_UPDATE_MAX(name, type, field, hi, max, attr) \
+    TB_GENERATE_RB_AUGMENT_INTERNAL(name, type, field, cmp, name##_TB_UPDATE_MAX, attr) \
+    TB_GENERATE_OVERLAP_MIN(name, type, field, lo, hi, max, attr) \
+    TB_GENERATE_OVERLAP(name, type, field, attr) \
+    TB_GENERATE_OVERLAP_NEXT(name, type, field, lo, hi, attr) \
+
+/* Red-black trees over TB_HEAD_IDX and TB_ENTRY_IDX. Traversal takes
+ * the head since links are resolved against `tb_base`. */
+#define TB_GENERATE_IDX(name, type, field, cmp) \
+    TB_GENERATE_IDX_INTERNAL(name, type, field, cmp,)
+
+#define TB_GENERATE_IDX_STATIC(name, type, field, cmp) \
+    TB_GENERATE_IDX_INTERNAL(name, type, field, cmp, __tbtree_unused static)
+
+#define TB_GENERATE_IDX_INTERNAL(name, type, field, cmp, attr) \
+    TB_GENERATE_IDX_FIRST(name, type, field, attr) \
+    TB_GENERATE_IDX_LAST(name, type, field, attr) \
+    TB_GENERATE_IDX_PREV(name, type, field, attr) \
+    TB_GENERATE_IDX_NEXT(name, type, field, attr) \
+    TB_GENERATE_IDX_FIND(name, type, field, TB_STAT_CMP(cmp), attr) \
+    TB_GENERATE_IDX_NFIND(name, type, field, TB_STAT_CMP(cmp), attr) \
+    TB_GENERATE_IDX_INSERT_COLOR(name, type, field, attr) \
+    TB_GENERATE_IDX_REMOVE_COLOR(name, type, field, attr) \
+    TB_GENERATE_IDX_INSERT(name, type, field, TB_STAT_CMP(cmp), attr) \
+    TB_GENERATE_IDX_REMOVE(name, type, field, attr) \
+    TB_GENERATE_IDX_SAVE(name, type, attr) \
+    TB_GENERATE_IDX_LOAD(name, type, attr) \
+    TB_GENERATE_IDX_VERIFY(name, type, attr) \
+
+/* Sharded trees over `tree`, which must be generated before. `lock` and
+ * `unlock` take a pointer to the lock of a shard. */
+#define TB_GENERATE_SHARDED(name, tree, type, field, cmp, lock, unlock) \
+    TB_GENERATE_SHARDED_INTERNAL(name, tree, type, field, cmp, lock, unlock,)
+
+#define TB_GENERATE_SHARDED_STATIC(name, tree, type, field, cmp, lock, unlock) \
+    TB_GENERATE_SHARDED_INTERNAL(name, tree, type, field, cmp, lock, unlock, \
+                                 __tbtree_unused static)
+
+#define TB_GENERATE_SHARDED_INTERNAL(name, tree, type, field, cmp, lock, unlock, attr) \
+    TB_GENERATE_SHARD_LOCK(name, type, cmp, lock, unlock, attr) \
+    TB_GENERATE_SHARD_MOVE(name, tree, type, field, lock, unlock, attr) \
+    TB_GENERATE_SHARD_BALANCE(name, tree, type, field, lock, unlock, attr) \
+    TB_GENERATE_SHARD_ADAPT(name, attr) \
+    TB_GENERATE_SHARDED_INSERT(name, tree, type, unlock, attr) \
+    TB_GENERATE_SHARDED_REMOVE(name, tree, type, unlock, attr) \
+    TB_GENERATE_SHARDED_FIND(name, tree, type, unlock, attr) \
+    TB_GENERATE_SHARDED_NFIND(name, tree, type, lock, unlock, attr) \
+    TB_GENERATE_SHARDED_WALK(name, tree, type, lock, unlock, attr) \
+    TB_GENERATE_SHARDED_COUNT(name, attr) \
+
+/* The reader side loads each link before its thread bit: a link read
+ * as a child may only be NULL while the writer races with the reader. */
+#define TB_GENERATE_MIN(name, type, field, attr) \
+    attr struct type *name##_TB_MIN(struct type *elm) { \
+        struct type *tmp; \
+        __tbtree_static_assert(__tbtree_alignof(struct type) >= TB_MASK + 1, \
+                               "tree nodes must be aligned to 4 bytes"); \
+        while ((tmp = TB_LOAD_LEFT(elm, field), !TB_LOAD_LLEAF(elm, field)) && \
+               __tbtree_nonnull(tmp)) \
+            elm = tmp; \
+        return elm; \
+    }
+
+#define TB_GENERATE_MAX(name, type, field, attr) \
+    attr struct type *name##_TB_MAX(struct type *elm) { \
+        struct type *tmp; \
+        while ((tmp = TB_LOAD_RIGHT(elm, field), !TB_LOAD_RLEAF(elm, field)) && \
+               __tbtree_nonnull(tmp)) \
+            elm = tmp; \
+        return elm; \
+    }
+
+#define TB_GENERATE_PREV(name, type, field, attr) \
+    attr struct type *name##_TB_PREV(struct type *elm) { \
+        struct type *tmp = TB_LOAD_LEFT(elm, field); \
+        if (TB_LOAD_LLEAF(elm, field) || !__tbtree_nonnull(tmp)) \
+            return tmp; \
+        return TB_MAX(name, tmp); \
+    }
+
+#define TB_GENERATE_NEXT(name, type, field, attr) \
+    attr struct type *name##_TB_NEXT(struct type *elm) { \
+        struct type *tmp = TB_LOAD_RIGHT(elm, field); \
+        if (TB_LOAD_RLEAF(elm, field) || !__tbtree_nonnull(tmp)) \
+            return tmp; \
+        return TB_MIN(name, tmp); \
+    }
+
+/* Gathers up to `n` nodes from `*cur` on into `out` and moves the cursor
+ * past them, to NULL at the end of the tree, so that the next call resumes
+ * there. Returns the number of gathered nodes:
+ *
+ *     for (cur = TB_FIRST(name, head); (k = TB_NEXT_N(name, &cur, out, n));)
+ *         process(out, k);
+ */
+#define TB_GENERATE_NEXT_N(name, type, field, attr) \
+    attr size_t name##_TB_NEXT_N(struct type **cur, struct type **out, size_t n) { \
+        struct type *elm = *cur; \
+        size_t i = 0; \
+        for (; elm && i < n; ++i) { \
+            out[i] = elm; \
+            elm = name##_TB_NEXT(elm); \
+        } \
+        *cur = elm; \
+        return i; \
+    }
+
+#define TB_GENERATE_PREV_N(name, type, field, attr) \
+    attr size_t name##_TB_PREV_N(struct type **cur, struct type **out, size_t n) { \
+        struct type *elm = *cur; \
+        size_t i = 0; \
+        for (; elm && i < n; ++i) { \
+            out[i] = elm; \
+            elm = name##_TB_PREV(elm); \
+        } \
+        *cur = elm; \
+        return i; \
+    }
+
+#define TB_GENERATE_FIRST(name, type, attr) \
+    attr struct type *name##_TB_FIRST(struct name *head) { \
+        struct type *root = __tbtree_load(TB_ROOT(head)); \
+        return root ? TB_MIN(name, root) : NULL; \
+    }
+
+#define TB_GENERATE_LAST(name, type, attr) \
+    attr struct type *name##_TB_LAST(struct name *head) { \
+        struct type *root = __tbtree_load(TB_ROOT(head)); \
+        return root ? TB_MAX(name, root) : NULL; \
+    }
+
+#define TB_GENERATE_FIND(name, type, field, cmp, attr) \
+    attr struct type *name##_TB_FIND(struct name *head, struct type *elm) { \
+        struct type *tmp = __tbtree_load(TB_ROOT(head)); \
+        TB_STAT(lookups, 1); \
+        while (tmp) { \
+            int comp = (cmp)(elm, tmp); \
+            TB_STAT(steps, 1); \
+            if (comp < 0) { \
+                if (TB_LOAD_LLEAF(tmp, field)) \
+                    return NULL; \
+                tmp = TB_LOAD_LEFT(tmp, field); \
+            } else if (comp > 0) { \
+                if (TB_LOAD_RLEAF(tmp, field)) \
+                    return NULL; \
+                tmp = TB_LOAD_RIGHT(tmp, field); \
+            } else { \
+                return tmp; \
+            } \
+        } \
+        return NULL; \
+    }
+
+#define TB_GENERATE_NFIND(name, type, field, cmp, attr) \
+    attr struct type *name##_TB_NFIND(struct name *head, struct type *elm) { \
+        struct type *tmp = __tbtree_load(TB_ROOT(head)); \
+        TB_STAT(lookups, 1); \
+        while (tmp) { \
+            int comp = (cmp)(elm, tmp); \
+            TB_STAT(steps, 1); \
+            if (comp < 0) { \
+                if (TB_LOAD_LLEAF(tmp, field)) \
+                    return tmp; \
+                tmp = TB_LOAD_LEFT(tmp, field); \
+            } else if (comp > 0) { \
+                if (TB_LOAD_RLEAF(tmp, field)) \
+                    return TB_LOAD_RIGHT(tmp, field); \
+                tmp = TB_LOAD_RIGHT(tmp, field); \
+            } else { \
+                return tmp; \
+            } \
+        } \
+        return NULL; \
+    }
+
+/* Returns the greatest node less than or equal to `elm`, or NULL. */
+#define TB_GENERATE_PFIND(name, type, field, cmp, attr) \
+    attr struct type *name##_TB_PFIND(struct name *head, struct type *elm) { \
+        struct type *tmp = __tbtree_load(TB_ROOT(head)); \
+        TB_STAT(lookups, 1); \
+        while (tmp) { \
+            int comp = (cmp)(elm, tmp); \
+            TB_STAT(steps, 1); \
+            if (comp < 0) { \
+                if (TB_LOAD_LLEAF(tmp, field)) \
+                    return TB_LOAD_LEFT(tmp, field); \
+                tmp = TB_LOAD_LEFT(tmp, field); \
+            } else if (comp > 0) { \
+                if (TB_LOAD_RLEAF(tmp, field)) \
+                    return tmp; \
+                tmp = TB_LOAD_RIGHT(tmp, field); \
+            } else { \
+                return tmp; \
+            } \
+        } \
+        return NULL; \
+    }
+
+#define TB_GENERATE_PREFIX_CMP(name, type, field, cmp, attr) \
+    attr int name##_TB_PREFIX_CMP(struct type *a, struct type *b) { \
+        uint64_t x = TB_PREFIX(a, field), y = TB_PREFIX(b, field); \
+        return x != y ? (x > y) - (x < y) : (cmp)(a, b); \
+    }
+
+/* Multiset orders that break ties between equal keys, placing `a` after
+ * or before the nodes equal to it. */
+#define TB_GENERATE_MULTI_CMP(name, type, cmp, attr) \
+    attr int name##_TB_MULTI_AFTER(struct type *a, struct type *b) { \
+        int comp = (cmp)(a, b); \
+        return comp ? comp : 1; \
+    } \
+    \
+    attr int name##_TB_MULTI_BEFORE(struct type *a, struct type *b) { \
+        int comp = (cmp)(a, b); \
+        return comp ? comp : -1; \
+    }
+
+/* Sets `res` to the first node for which `(cmp)(elm, node) op 0`. */
+#define TB_MULTI_BOUND(head, elm, field, cmp, op, res) do { \
+        __typeof__(res) tb_tmp = TB_ROOT(head); \
+        TB_STAT(lookups, 1); \
+        (res) = NULL; \
+        while (tb_tmp) { \
+            TB_STAT(steps, 1); \
+            if ((cmp)(elm, tb_tmp) op 0) { \
+                (res) = tb_tmp; \
+                tb_tmp = TB_LLEAF(tb_tmp, field) ? NULL : TB_LEFT(tb_tmp, field); \
+            } else { \
+                tb_tmp = TB_RLEAF(tb_tmp, field) ? NULL : TB_RIGHT(tb_tmp, field); \
+            } \
+        } \
+    } while (0)
+
+/* TB_EQUAL_RANGE returns the first node equal to `elm`, or NULL, and
+ * sets `end` to the node following the last one, so that the run of
+ * equal nodes is walked with TB_NEXT up to `end`. */
+#define TB_GENERATE_MULTI_FIND(name, type, field, cmp, attr) \
+    attr struct type *name##_TB_NFIND(struct name *head, struct type *elm) { \
+        struct type *res; \
+        TB_MULTI_BOUND(head, elm, field, cmp, <=, res); \
+        return res; \
+    } \
+    \
+    attr struct type *name##_TB_FIND(struct name *head, struct type *elm) { \
+        struct type *res = name##_TB_NFIND(head, elm); \
+        return res && (cmp)(elm, res) == 0 ? res : NULL; \
+    } \
+    \
+    attr struct type *name##_TB_PFIND(struct name *head, struct type *elm) { \
+        struct type *res; \
+        TB_MULTI_BOUND(head, elm, field, cmp, <, res); \
+        return res ? TB_PREV(name, res) : TB_LAST(name, head); \
+    } \
+    \
+    attr struct type *name##_TB_EQUAL_RANGE(struct name *head, struct type *elm, \
+                                            struct type **end) { \
+        struct type *res = name##_TB_FIND(head, elm); \
+        if (res) \
+            TB_MULTI_BOUND(head, elm, field, cmp, <, *end); \
+        return res; \
+    }
+
+#define TB_SPLAY_ROTATE(type, head, elm, field, left) do { \
+        if (left) \
+            TB_ROTATE_RIGHT(type, head, elm, field, TB_AUGMENT_NONE); \
+        else \
+            TB_ROTATE_LEFT(type, head, elm, field, TB_AUGMENT_NONE); \
+    } while (0)
+
+/* Brings `elm` to the root with zig-zig and zig-zag double rotations. */
+#define TB_GENERATE_SPLAY_ROOT(name, type, field, attr) \
+    attr void name##_TB_SPLAY(struct name *head, struct type *elm) { \
+        struct type *parent, *grand; \
+        while ((parent = TB_PARENT(elm, field))) { \
+            int left = TB_LEFT(parent, field) == elm; \
+            if (!(grand = TB_PARENT(parent, field))) { \
+                TB_SPLAY_ROTATE(type, head, parent, field, left); \
+            } else if ((TB_LEFT(grand, field) == parent) == left) { \
+                TB_SPLAY_ROTATE(type, head, grand, field, left); \
+                TB_SPLAY_ROTATE(type, head, parent, field, left); \
+            } else { \
+                TB_SPLAY_ROTATE(type, head, parent, field, left); \
+                TB_SPLAY_ROTATE(type, head, grand, field, !left); \
+            } \
+        } \
+    }
+
+/* The splay lookups bring the last node of the descent to the root, which
+ * is the match or a neighbor of the key. */
+#define TB_GENERATE_SPLAY_FIND(name, type, field, cmp, attr) \
+    attr struct type *name##_TB_SPLAY_DESCEND(struct name *head, struct type *elm, \
+                                              struct type **ge, struct type **le) { \
+        struct type *tmp = TB_ROOT(head), *last = NULL; \
+        TB_STAT(lookups, 1); \
+        *ge = *le = NULL; \
+        while (tmp) { \
+            int comp = (cmp)(elm, tmp); \
+            TB_STAT(steps, 1); \
+            last = tmp; \
+            if (comp <= 0) \
+                *ge = tmp; \
+            if (comp >= 0) \
+                *le = tmp; \
+            if (comp < 0) \
+                tmp = TB_LLEAF(tmp, field) ? NULL : TB_LEFT(tmp, field); \
+            else if (comp > 0) \
+                tmp = TB_RLEAF(tmp, field) ? NULL : TB_RIGHT(tmp, field); \
+            else \
+                break; \
+        } \
+        if (last) \
+            name##_TB_SPLAY(head, last); \
+        return tmp; \
+    } \
+    \
+    attr struct type *name##_TB_FIND(struct name *head, struct type *elm) { \
+        struct type *ge, *le; \
+        return name##_TB_SPLAY_DESCEND(head, elm, &ge, &le); \
+    } \
+    \
+    attr struct type *name##_TB_NFIND(struct name *head, struct type *elm) { \
+        struct type *ge, *le; \
+        name##_TB_SPLAY_DESCEND(head, elm, &ge, &le); \
+        return ge; \
+    } \
+    \
+    attr struct type *name##_TB_PFIND(struct name *head, struct type *elm) { \
+        struct type *ge, *le; \
+        name##_TB_SPLAY_DESCEND(head, elm, &ge, &le); \
+        return le; \
+    }
+
+/* Looks up the `n` nodes of `keys` like TB_FIND or TB_NFIND, storing the
+ * results in `out`, which must not alias `keys`. Up to 64 descents advance
+ * in lockstep and each one prefetches its next node, so that their cache
+ * misses overlap instead of stalling one lookup at a time. */
+#define TB_GENERATE_BATCH(name, type, field, cmp, fn, nearest, attr) \
+    attr void name##_TB_##fn(struct name *head, struct type **keys, size_t n, \
+                             struct type **out) { \
+        TB_STAT(lookups, n); \
+        for (size_t m = 0; n; n -= m, keys += m, out += m) { \
+            m = n < 64 ? n : 64; \
+            uint64_t active = 0; \
+            for (size_t i = 0; i < m; ++i) { \
+                out[i] = __tbtree_load(TB_ROOT(head)); \
+                active |= (uint64_t)(out[i] != NULL) << i; \
+            } \
+            while (active) { \
+                for (size_t i = 0; i < m; ++i) { \
+                    struct type *tmp = out[i]; \
+                    int comp, dir; \
+                    if (!(active >> i & 1)) \
+                        continue; \
+                    comp = (cmp)(keys[i], tmp); \
+                    TB_STAT(steps, 1); \
+                    dir = comp > 0; \
+                    if (!comp) { \
+                        active &= ~((uint64_t)1 << i); \
+                    } else if (dir ? TB_LOAD_RLEAF(tmp, field) : TB_LOAD_LLEAF(tmp, field)) { \
+                        out[i] = !(nearest) ? NULL : dir ? TB_LOAD_RIGHT(tmp, field) : tmp; \
+                        active &= ~((uint64_t)1 << i); \
+                    } else { \
+                        out[i] = tmp = dir ? TB_LOAD_RIGHT(tmp, field) : TB_LOAD_LEFT(tmp, field); \
+                        if (__tbtree_nonnull(tmp)) \
+                            __tbtree_prefetch(tmp); \
+                        else \
+                            active &= ~((uint64_t)1 << i); \
+                    } \
+                } \
+            } \
+        } \
+    }
+
+#define TB_GENERATE_FIND_BATCH(name, type, field, cmp, attr) \
+    TB_GENERATE_BATCH(name, type, field, cmp, FIND_BATCH, 0, attr)
+
+#define TB_GENERATE_NFIND_BATCH(name, type, field, cmp, attr) \
+    TB_GENERATE_BATCH(name, type, field, cmp, NFIND_BATCH, 1, attr)
+
+/* A frozen snapshot stores the nodes of a tree in Eytzinger order: an
+ * array holding the implicit complete tree breadth first from position 1,
+ * the children of `k` being at `2k` and `2k + 1`. A lookup then computes
+ * its next position instead of loading it, descends without branching on
+ * the comparison and prefetches the positions four levels below. Position
+ * 0 holds NULL and stands for no node. The snapshot stays valid for as
+ * long as the tree is not changed. */
+__tbtree_unused static inline size_t tb_frozen_first(size_t count)
+{
+    size_t k = 1;
+    if (!count)
+        return 0;
+    while (2 * k <= count)
+        k *= 2;
+    return k;
+}
+
+__tbtree_unused static inline size_t tb_frozen_last(size_t count)
+{
+    size_t k = 1;
+    if (!count)
+        return 0;
+    while (2 * k + 1 <= count)
+        k = 2 * k + 1;
+    return k;
+}
+
+/* Climbs from `k` past the ancestors of which it is a right descendant:
+ * the result of a descent that has fallen off the tree. */
+__tbtree_unused static inline size_t tb_frozen_up(size_t k)
+{
+#if defined(__GNUC__)
+    return k >> (__builtin_ctzll(~(unsigned long long)k) + 1);
+#else
+    while (k & 1)
+        k >>= 1;
+    return k >> 1;
+#endif
+}
+
+__tbtree_unused static inline size_t tb_frozen_next(size_t k, size_t count)
+{
+    if (2 * k + 1 > count)
+        return tb_frozen_up(k);
+    for (k = 2 * k + 1; 2 * k <= count; k *= 2)
+        continue;
+    return k;
+}
+
+__tbtree_unused static inline size_t tb_frozen_prev(size_t k, size_t count)
+{
+    if (2 * k > count) {
+        while (!(k & 1))
+            k >>= 1;
+        return k >> 1;
+    }
+    for (k = 2 * k; 2 * k + 1 <= count; k = 2 * k + 1)
+        continue;
+    return k;
+}
+
+#define TB_FROZEN_PREFETCH(arr, k) \
+    __tbtree_prefetch((const void *)((uintptr_t)(arr) + 16 * (k) * sizeof(*(arr))))
+
+/* Fills `elms` with a snapshot of the tree, which takes one slot more than
+ * the tree has nodes. Returns the node count, leaving `elms` untouched if
+ * its `n` slots do not suffice. */
+#define TB_GENERATE_FREEZE(name, type, field, attr) \
+    attr size_t name##_TB_FREEZE(struct name *head, struct type **elms, size_t n) { \
+        struct type *tmp; \
+        size_t count = 0, k; \
+        TB_FOREACH(tmp, name, head) \
+            ++count; \
+        if (count >= n) \
+            return count; \
+        elms[0] = NULL; \
+        k = tb_frozen_first(count); \
+        TB_FOREACH(tmp, name, head) { \
+            elms[k] = tmp; \
+            k = tb_frozen_next(k, count); \
+        } \
+        return count; \
+    }
+
+/* Lookups in a snapshot of `count` nodes: LOWER and UPPER return the
+ * position of the first node not less than and greater than `elm`. */
+#define TB_GENERATE_FROZEN(name, type, field, cmp, attr) \
+    attr size_t name##_TB_FROZEN_LOWER(struct type **elms, size_t count, struct type *elm) { \
+        size_t k = 1; \
+        TB_STAT(lookups, 1); \
+        while (k <= count) { \
+            TB_FROZEN_PREFETCH(elms, k); \
+            TB_STAT(steps, 1); \
+            k = 2 * k + ((cmp)(elms[k], elm) < 0); \
+        } \
+        return tb_frozen_up(k); \
+    } \
+    \
+    attr size_t name##_TB_FROZEN_UPPER(struct type **elms, size_t count, struct type *elm) { \
+        size_t k = 1; \
+        TB_STAT(lookups, 1); \
+        while (k <= count) { \
+            TB_FROZEN_PREFETCH(elms, k); \
+            TB_STAT(steps, 1); \
+            k = 2 * k + ((cmp)(elms[k], elm) <= 0); \
+        } \
+        return tb_frozen_up(k); \
+    } \
+    \
+    attr struct type *name##_TB_FROZEN_FIND(struct type **elms, size_t count, \
+                                            struct type *elm) { \
+        struct type *tmp = elms[name##_TB_FROZEN_LOWER(elms, count, elm)]; \
+        return tmp && (cmp)(elm, tmp) == 0 ? tmp : NULL; \
+    } \
+    \
+    attr struct type *name##_TB_FROZEN_NFIND(struct type **elms, size_t count, \
+                                             struct type *elm) { \
+        return elms[name##_TB_FROZEN_LOWER(elms, count, elm)]; \
+    }
+
+/* Range bounds: `lo` and `hi` are included unless their bit is set,
+ * and a NULL bound is unbounded. */
+#define TB_CLOSED               0
+#define TB_LOPEN                1
+#define TB_HOPEN                2
+#define TB_OPEN                 (TB_LOPEN | TB_HOPEN)
+
+#define TB_RANGE_BELOW(cmp, elm, hi, bounds) \
+    (!(hi) || ((bounds) & TB_HOPEN ? (cmp)(elm, hi) < 0 : (cmp)(elm, hi) <= 0))
+
+/* Returns the first node within the bounds, or NULL. */
+#define TB_GENERATE_RANGE_FIRST(name, type, field, cmp, attr) \
+    attr struct type *name##_TB_RANGE_FIRST(struct name *head, struct type *lo, \
+                                            struct type *hi, int bounds) { \
+        struct type *tmp = TB_ROOT(head), *res = NULL; \
+        if (!lo) \
+            res = TB_FIRST(name, head); \
+        while (lo && tmp) { \
+            int comp = (cmp)(lo, tmp); \
+            if (bounds & TB_LOPEN ? comp < 0 : comp <= 0) { \
+                res = tmp; \
+                tmp = TB_LLEAF(tmp, field) ? NULL : TB_LEFT(tmp, field); \
+            } else { \
+                tmp = TB_RLEAF(tmp, field) ? NULL : TB_RIGHT(tmp, field); \
+            } \
+        } \
+        return res && TB_RANGE_BELOW(cmp, res, hi, bounds) ? res : NULL; \
+    }
+
+/* Returns the node after `elm` if it is still below `hi`, or NULL. */
+#define TB_GENERATE_RANGE_NEXT(name, type, field, cmp, attr) \
+    attr struct type *name##_TB_RANGE_NEXT(struct type *elm, struct type *hi, int bounds) { \
+        elm = TB_NEXT(name, elm); \
+        return elm && TB_RANGE_BELOW(cmp, elm, hi, bounds) ? elm : NULL; \
+    }
+
+/* Unlinks the nodes within the bounds with two splits and a join,
+ * passing each of them to `cb` if set, and returns their number. */
+#define TB_GENERATE_REMOVE_RANGE(name, type, field, attr) \
+    attr size_t name##_TB_REMOVE_RANGE(struct name *head, struct type *lo, \
+                                       struct type *hi, int bounds, \
+                                       void (*cb)(struct type *)) { \
+        struct type *first = name##_TB_RANGE_FIRST(head, lo, hi, bounds); \
+        struct type *stop = NULL, *elm, *next; \
+        struct name mid, rest; \
+        size_t n = 0; \
+        if (!first) \
+            return 0; \
+        if (hi) \
+            stop = name##_TB_RANGE_FIRST(head, hi, NULL, \
+                                         bounds & TB_HOPEN ? TB_CLOSED : TB_LOPEN); \
+        TB_SPLIT(name, head, first, head, &mid); \
+        if (stop) { \
+            TB_SPLIT(name, &mid, stop, &mid, &rest); \
+        } else { \
+            TB_INIT(&rest); \
+        } \
+        TB_FOREACH_SAFE(elm, name, &mid, next) { \
+            ++n; \
+            if (cb) \
+                cb(elm); \
+        } \
+        TB_JOIN(name, head, &rest); \
+        return n; \
+    }
+
+/* Scapegoat trees have no split, so the nodes are removed one by one. */
+#define TB_GENERATE_SG_REMOVE_RANGE(name, type, field, cmp, attr) \
+    attr size_t name##_TB_REMOVE_RANGE(struct name *head, struct type *lo, \
+                                       struct type *hi, int bounds, \
+                                       void (*cb)(struct type *)) { \
+        struct type *elm = name##_TB_RANGE_FIRST(head, lo, hi, bounds), *next; \
+        size_t n = 0; \
+        for (; elm; elm = next, ++n) { \
+            next = name##_TB_RANGE_NEXT(elm, hi, bounds); \
+            TB_REMOVE(name, head, elm); \
+            if (cb) \
+                cb(elm); \
+        } \
+        return n; \
+    }
+
+#define TB_NOFIX(head, elm)     ((void)0)
+
+/* `color(elm, field, red)` paints the nodes rebuilt by TB_COMPRESS and
+ * TB_BALANCE in the red-black families and does nothing in the others,
+ * whose nodes may have no room for the color bit. */
+#define TB_COLOR_NONE(elm, field, red) ((void)0)
+#define TB_COLOR_RB(elm, field, red) \
+    ((void)((red) ? TB_SET_RED(elm, field) : TB_SET_BLACK(elm, field)))
+
+/* `aug(elm)` recomputes the augmented data of `elm` from its children
+ * and returns nonzero if it has changed. */
+#define TB_AUGMENT_NONE(elm)    (0)
+
+/* Updates `elm` and its ancestors until `aug` reports no change. */
+#define TB_AUGMENT_WALK(type, elm, field, aug) do { \
+        struct type *tb_node = (elm); \
+        while (tb_node && aug(tb_node)) \
+            tb_node = TB_PARENT(tb_node, field); \
+    } while (0)
+
+/* Updates the path from `up`, the old parent of `next`, to `next`
+ * once it has taken the place of a node with both children. */
+#define TB_AUGMENT_NEXT(type, up, next, field, aug) do { \
+        struct type *tb_tmp = (up); \
+        while (tb_tmp != (next) && aug(tb_tmp)) \
+            tb_tmp = TB_PARENT(tb_tmp, field); \
+        (void)aug(next); \
+    } while (0)
+
+/* The links of `elm` are stored as well, since TB_REINSERT links a node
+ * that readers may still be visiting. */
+#define TB_INSERT_ROOT(elm, field) do { \
+        TB_STORE_BITS(elm, field, TB_MASK); \
+        TB_STORE_LEFT(elm, field, NULL); \
+        TB_STORE_RIGHT(elm, field, NULL); \
+    } while (0)
+
+#define TB_INSERT_LEFT(tmp, elm, field) do { \
+        TB_STORE_BITS(elm, field, (uintptr_t)(tmp) | TB_MASK); \
+        TB_STORE_RIGHT(elm, field, tmp); \
+        TB_STORE_LEFT(elm, field, TB_LEFT(tmp, field)); \
+        TB_STORE_LEFT(tmp, field, elm); \
+        TB_STORE_LCLEAR(tmp, field); \
+    } while (0)
+
+#define TB_INSERT_RIGHT(tmp, elm, field) do { \
+        TB_STORE_BITS(elm, field, (uintptr_t)(tmp) | TB_MASK); \
+        TB_STORE_LEFT(elm, field, tmp); \
+        TB_STORE_RIGHT(elm, field, TB_RIGHT(tmp, field)); \
+        TB_STORE_RIGHT(tmp, field, elm); \
+        TB_STORE_RCLEAR(tmp, field); \
+    } while (0)
+
+/* Links `elm` as a new leaf of the subtree at `tmp` and sets `tmp` to NULL,
+ * or leaves it at the node equal to `elm`. The side is picked from the
+ * comparison and the end of the path from the thread bit of that side. */
+#define TB_INSERT_LEAF(tmp, elm, field, cmp) do { \
+        for (;;) { \
+            int tb_comp = (cmp)(elm, tmp); \
+            int tb_dir = tb_comp > 0; \
+            TB_STAT(steps, 1); \
+            if (!tb_comp) \
+                break; \
+            if (TB_BITS(tmp, field) & (TB_LBIT << tb_dir)) { \
+                if (tb_dir) \
+                    TB_INSERT_RIGHT(tmp, elm, field); \
+                else \
+                    TB_INSERT_LEFT(tmp, elm, field); \
+                (tmp) = NULL; \
+                break; \
+            } \
+            (tmp) = tb_dir ? TB_RIGHT(tmp, field) : TB_LEFT(tmp, field); \
+        } \
+    } while (0)
+
+#define TB_GENERATE_INSERT(name, type, field, cmp, attr) \
+    TB_GENERATE_INSERT_FIX(name, type, field, cmp, TB_NOFIX, TB_AUGMENT_NONE, attr)
+
+/* `fix` is called once `elm` is linked as a new leaf.
+ *
+ * TB_INSERT_HINT starts next to `hint` instead of the root: `elm` is linked
+ * in O(1) when it falls between `hint` and one of its threaded neighbors,
+ * which makes sorted and clustered input cheap. Otherwise it climbs from
+ * `hint` only until the subtree that must hold `elm`. */
+#define TB_GENERATE_INSERT_FIX(name, type, field, cmp, fix, aug, attr) \
+    attr struct type *name##_TB_INSERT(struct name *head, struct type *elm) { \
+        struct type *tmp = TB_ROOT(head); \
+        TB_STAT(inserts, 1); \
+        if (!tmp) { \
+            TB_INSERT_ROOT(elm, field); \
+            __tbtree_store(TB_ROOT(head), elm); \
+        } else { \
+            TB_INSERT_LEAF(tmp, elm, field, cmp); \
+            if (tmp) { \
+                TB_INSERT_ROOT(elm, field); \
+                return tmp; \
+            } \
+        } \
+        (void)aug(elm); \
+        TB_AUGMENT_WALK(type, TB_PARENT(elm, field), field, aug); \
+        fix(head, elm); \
+        return NULL; \
+    } \
+    \
+    attr struct type *name##_TB_INSERT_HINT(struct name *head, struct type *hint, \
+                                            struct type *elm) { \
+        struct type *tmp = hint, *parent = NULL; \
+        int comp; \
+        if (!hint) \
+            return name##_TB_INSERT(head, elm); \
+        TB_STAT(inserts, 1); \
+        if ((comp = (cmp)(elm, hint)) > 0) { \
+            tmp = TB_NEXT(name, hint); \
+            if (!tmp || (cmp)(elm, tmp) < 0) { \
+                if (TB_RLEAF(hint, field)) \
+                    TB_INSERT_RIGHT(hint, elm, field); \
+                else \
+                    TB_INSERT_LEFT(tmp, elm, field); \
+                tmp = NULL; \
+            } else { \
+                for (tmp = hint; (parent = TB_PARENT(tmp, field)); tmp = parent) { \
+                    if (TB_LEFT(parent, field) == tmp && (cmp)(elm, parent) <= 0) \
+                        break; \
+                } \
+            } \
+        } else if (comp < 0) { \
+            tmp = TB_PREV(name, hint); \
+            if (!tmp || (cmp)(elm, tmp) > 0) { \
+                if (TB_LLEAF(hint, field)) \
+                    TB_INSERT_LEFT(hint, elm, field); \
+                else \
+                    TB_INSERT_RIGHT(tmp, elm, field); \
+                tmp = NULL; \
+            } else { \
+                for (tmp = hint; (parent = TB_PARENT(tmp, field)); tmp = parent) { \
+                    if (TB_RIGHT(parent, field) == tmp && (cmp)(elm, parent) >= 0) \
+                        break; \
+                } \
+            } \
+        } \
+        if (tmp) { \
+            if (comp) { \
+                if (parent) \
+                    tmp = parent; \
+                TB_INSERT_LEAF(tmp, elm, field, cmp); \
+            } \
+            if (tmp) { \
+                TB_INSERT_ROOT(elm, field); \
+                return tmp; \
+            } \
+        } \
+        (void)aug(elm); \
+        TB_AUGMENT_WALK(type, TB_PARENT(elm, field), field, aug); \
+        fix(head, elm); \
+        return NULL; \
+    }
+
+/* A removed leaf turns the link of its parent into a thread: the thread
+ * bit is set first, so that a reader never follows the new thread as
+ * a child. */
+#define TB_REMOVE_LEAF(type, head, elm, field) do { \
+        struct type *tb_up = TB_PARENT(elm, field); \
+        if (!tb_up) { \
+            __tbtree_store(TB_ROOT(head), NULL); \
+        } else if (TB_LEFT(tb_up, field) == (elm)) { \
+            TB_STORE_LSET(tb_up, field); \
+            TB_STORE_LEFT(tb_up, field, TB_LEFT(elm, field)); \
+        } else { \
+            TB_STORE_RSET(tb_up, field); \
+            TB_STORE_RIGHT(tb_up, field, TB_RIGHT(elm, field)); \
+        } \
+    } while (0)
+
+#define TB_REMOVE_LLEAF(name, type, head, elm, field) do { \
+        struct type *tb_child = TB_RIGHT(elm, field); \
+        struct type *tb_up = TB_PARENT(elm, field); \
+        TB_STORE_LEFT(TB_NEXT(name, elm), field, TB_LEFT(elm, field)); \
+        TB_SWAP_CHILD(head, tb_up, elm, tb_child, field); \
+        TB_STORE_PARENT(tb_child, tb_up, field); \
+    } while (0)
+
+#define TB_REMOVE_RLEAF(name, type, head, elm, field) do { \
+        struct type *tb_child = TB_LEFT(elm, field); \
+        struct type *tb_up = TB_PARENT(elm, field); \
+        TB_STORE_RIGHT(TB_PREV(name, elm), field, TB_RIGHT(elm, field)); \
+        TB_SWAP_CHILD(head, tb_up, elm, tb_child, field); \
+        TB_STORE_PARENT(tb_child, tb_up, field); \
+    } while (0)
+
+/* Replaces `elm`, which has both children, with its successor `next`. */
+#define TB_REMOVE_NEXT(name, type, head, elm, next, field) do { \
+        struct type *tb_up = TB_PARENT(elm, field); \
+        TB_STORE_RIGHT(TB_PREV(name, elm), field, next); \
+        if ((next) != TB_RIGHT(elm, field)) { \
+            struct type *tb_child = TB_PARENT(next, field); \
+            if (TB_RLEAF(next, field)) { \
+                TB_STORE_LSET(tb_child, field); \
+                TB_STORE_LEFT(tb_child, field, next); \
+            } else { \
+                TB_STORE_LEFT(tb_child, field, TB_RIGHT(next, field)); \
+                TB_STORE_PARENT(TB_RIGHT(next, field), tb_child, field); \
+            } \
+            TB_STORE_RIGHT(next, field, TB_RIGHT(elm, field)); \
+            TB_STORE_PARENT(TB_RIGHT(elm, field), next, field); \
+            TB_STORE_RCLEAR(next, field); \
+        } \
+        TB_STORE_LEFT(next, field, TB_LEFT(elm, field)); \
+        TB_STORE_PARENT(TB_LEFT(elm, field), next, field); \
+        TB_STORE_LCLEAR(next, field); \
+        TB_SWAP_CHILD(head, tb_up, elm, next, field); \
+        TB_STORE_PARENT(next, tb_up, field); \
+    } while (0)
+
+#define TB_GENERATE_REMOVE(name, type, field, cmp, attr) \
+    TB_GENERATE_REMOVE_FIX(name, type, field, cmp, TB_NOFIX, TB_AUGMENT_NONE, attr)
+
+/* `fix` is called once `elm` is unlinked from the tree. */
+#define TB_GENERATE_REMOVE_FIX(name, type, field, cmp, fix, aug, attr) \
+    attr struct type *name##_TB_REMOVE(struct name *head, struct type *elm) { \
+        struct type *parent = TB_PARENT(elm, field); \
+        TB_STAT(removes, 1); \
+        if (TB_LEAF(elm, field)) { \
+            TB_REMOVE_LEAF(type, head, elm, field); \
+        } else if (TB_LLEAF(elm, field)) { \
+            TB_REMOVE_LLEAF(name, type, head, elm, field); \
+        } else if (TB_RLEAF(elm, field)) { \
+            TB_REMOVE_RLEAF(name, type, head, elm, field); \
+        } else { \
+            struct type *tmp = TB_NEXT(name, elm); \
+            struct type *up = tmp == TB_RIGHT(elm, field) ? tmp : TB_PARENT(tmp, field); \
+            TB_REMOVE_NEXT(name, type, head, elm, tmp, field); \
+            TB_AUGMENT_NEXT(type, up, tmp, field, aug); \
+        } \
+        TB_AUGMENT_WALK(type, parent, field, aug); \
+        fix(head, elm); \
+        return elm; \
+    }
+
+/* Returns 1 if the black height of the tree has grown. */
+#define TB_GENERATE_INSERT_COLOR(name, type, field, aug, attr) \
+    attr int name##_TB_INSERT_COLOR(struct name *head, struct type *elm) { \
+        struct type *parent, *gparent, *tmp; \
+        __tbtree_static_assert(__tbtree_alignof(struct type) >= TB_FLAGS + 1, \
+                               "red-black tree nodes must be aligned to 8 bytes"); \
+        TB_STORE_RED(elm, field); \
+        while ((parent = TB_PARENT(elm, field)) && TB_IS_RED(parent, field)) { \
+            gparent = TB_PARENT(parent, field); \
+            if (TB_LEFT(gparent, field) == parent) { \
+                if (TB_RRED(gparent, field)) { \
+                    TB_STORE_BLACK(TB_RIGHT(gparent, field), field); \
+                    TB_STORE_BLACK(parent, field); \
+                    TB_STORE_RED(gparent, field); \
+                    elm = gparent; \
+                    continue; \
+                } \
+                if (TB_RIGHT(parent, field) == elm) { \
+                    TB_ROTATE_LEFT(type, head, parent, field, aug); \
+                    tmp = parent; \
+                    parent = elm; \
+                    elm = tmp; \
+                } \
+                TB_STORE_BLACK(parent, field); \
+                TB_STORE_RED(gparent, field); \
+                TB_ROTATE_RIGHT(type, head, gparent, field, aug); \
+            } else { \
+                if (TB_LRED(gparent, field)) { \
+                    TB_STORE_BLACK(TB_LEFT(gparent, field), field); \
+                    TB_STORE_BLACK(parent, field); \
+                    TB_STORE_RED(gparent, field); \
+                    elm = gparent; \
+                    continue; \
+                } \
+                if (TB_LEFT(parent, field) == elm) { \
+                    TB_ROTATE_RIGHT(type, head, parent, field, aug); \
+                    tmp = parent; \
+                    parent = elm; \
+                    elm = tmp; \
+                } \
+                TB_STORE_BLACK(parent, field); \
+                TB_STORE_RED(gparent, field); \
+                TB_ROTATE_LEFT(type, head, gparent, field, aug); \
+            } \
+        } \
+        elm = TB_ROOT(head); \
+        if (TB_IS_BLACK(elm, field)) \
+            return 0; \
+        TB_STORE_BLACK(elm, field); \
+        return 1; \
+    }
+
+/* `elm` is the child that took the place of the removed black node
+ * under `parent`, or NULL if that side is now a thread;
+ * `left` tells which side of `parent` it is. */
+#define TB_GENERATE_REMOVE_COLOR(name, type, field, aug, attr) \
+    attr void name##_TB_REMOVE_COLOR(struct name *head, struct type *parent, \
+                                     struct type *elm, int left) { \
+        struct type *tmp; \
+        while (parent && (!elm || TB_IS_BLACK(elm, field))) { \
+            if (left) { \
+                tmp = TB_RIGHT(parent, field); \
+                if (TB_IS_RED(tmp, field)) { \
+                    TB_STORE_BLACK(tmp, field); \
+                    TB_STORE_RED(parent, field); \
+                    TB_ROTATE_LEFT(type, head, parent, field, aug); \
+                    tmp = TB_RIGHT(parent, field); \
+                } \
+                if (!TB_LRED(tmp, field) && !TB_RRED(tmp, field)) { \
+                    TB_STORE_RED(tmp, field); \
+                    elm = parent; \
+                    parent = TB_PARENT(elm, field); \
+                    left = parent && TB_LEFT(parent, field) == elm; \
+                    continue; \
+                } \
+                if (!TB_RRED(tmp, field)) { \
+                    TB_STORE_BLACK(TB_LEFT(tmp, field), field); \
+                    TB_STORE_RED(tmp, field); \
+                    TB_ROTATE_RIGHT(type, head, tmp, field, aug); \
+                    tmp = TB_RIGHT(parent, field); \
+                } \
+                TB_STORE_COLOR(tmp, parent, field); \
+                TB_STORE_BLACK(parent, field); \
+                TB_STORE_BLACK(TB_RIGHT(tmp, field), field); \
+                TB_ROTATE_LEFT(type, head, parent, field, aug); \
+            } else { \
+                tmp = TB_LEFT(parent, field); \
+                if (TB_IS_RED(tmp, field)) { \
+                    TB_STORE_BLACK(tmp, field); \
+                    TB_STORE_RED(parent, field); \
+                    TB_ROTATE_RIGHT(type, head, parent, field, aug); \
+                    tmp = TB_LEFT(parent, field); \
+                } \
+                if (!TB_LRED(tmp, field) && !TB_RRED(tmp, field)) { \
+                    TB_STORE_RED(tmp, field); \
+                    elm = parent; \
+                    parent = TB_PARENT(elm, field); \
+                    left = parent && TB_LEFT(parent, field) == elm; \
+                    continue; \
+                } \
+                if (!TB_LRED(tmp, field)) { \
+                    TB_STORE_BLACK(TB_RIGHT(tmp, field), field); \
+                    TB_STORE_RED(tmp, field); \
+                    TB_ROTATE_LEFT(type, head, tmp, field, aug); \
+                    tmp = TB_LEFT(parent, field); \
+                } \
+                TB_STORE_COLOR(tmp, parent, field); \
+                TB_STORE_BLACK(parent, field); \
+                TB_STORE_BLACK(TB_LEFT(tmp, field), field); \
+                TB_ROTATE_RIGHT(type, head, parent, field, aug); \
+            } \
+            elm = TB_ROOT(head); \
+            break; \
+        } \
+        if (elm) \
+            TB_STORE_BLACK(elm, field); \
+    }
+
+#define TB_GENERATE_RB_REMOVE(name, type, field, cmp, aug, attr) \
+    attr struct type *name##_TB_REMOVE(struct name *head, struct type *elm) { \
+        struct type *parent = TB_PARENT(elm, field); \
+        struct type *up = parent; \
+        struct type *child = NULL; \
+        int left = parent && TB_LEFT(parent, field) == elm; \
+        int red = TB_IS_RED(elm, field); \
+        TB_STAT(removes, 1); \
+        if (TB_LEAF(elm, field)) { \
+            TB_REMOVE_LEAF(type, head, elm, field); \
+        } else if (TB_LLEAF(elm, field)) { \
+            child = TB_RIGHT(elm, field); \
+            TB_REMOVE_LLEAF(name, type, head, elm, field); \
+        } else if (TB_RLEAF(elm, field)) { \
+            child = TB_LEFT(elm, field); \
+            TB_REMOVE_RLEAF(name, type, head, elm, field); \
+        } else { \
+            struct type *tmp = TB_NEXT(name, elm); \
+            red = TB_IS_RED(tmp, field); \
+            left = tmp != TB_RIGHT(elm, field); \
+            parent = left ? TB_PARENT(tmp, field) : tmp; \
+            child = TB_RLEAF(tmp, field) ? NULL : TB_RIGHT(tmp, field); \
+            TB_REMOVE_NEXT(name, type, head, elm, tmp, field); \
+            TB_STORE_COLOR(tmp, elm, field); \
+            TB_AUGMENT_NEXT(type, parent, tmp, field, aug); \
+        } \
+        TB_AUGMENT_WALK(type, up, field, aug); \
+        if (!red) \
+            name##_TB_REMOVE_COLOR(head, parent, child, left); \
+        return elm; \
+    }
+
+#define TB_GENERATE_REINSERT(name, type, field, cmp, attr) \
+    attr struct type *name##_TB_REINSERT(struct name *head, struct type *elm) { \
+        struct type *tmp; \
+        if (((tmp = TB_PREV(name, elm)) && (cmp)(tmp, elm) >= 0) || \
+            ((tmp = TB_NEXT(name, elm)) && (cmp)(elm, tmp) >= 0)) { \
+            TB_REMOVE(name, head, elm); \
+            return TB_INSERT(name, head, elm); \
+        } \
+        return NULL; \
+    }
+
+/* Compresses the left vine of `n` nodes at `elm` into a complete tree
+ * with rounds of right rotations, Day-Stout-Warren style. The vine must be
+ * linked into the tree, threaded and augmented. In the red-black families
+ * the nodes of the incomplete bottom level are painted red and the rest
+ * black, so the result is also a valid red-black tree.
+ * Returns the new root of the subtree. */
+#define TB_GENERATE_COMPRESS(name, type, field, aug, color, attr) \
+    attr struct type *name##_TB_COMPRESS(struct name *head, struct type *elm, size_t n) { \
+        struct type *tmp, *next; \
+        size_t m = 1, k; \
+        int red = 1; \
+        while (m < n - m) \
+            m = 2 * m + 1; \
+        for (k = n - m; ; k = m >>= 1, red = 0) { \
+            tmp = elm; \
+            for (size_t i = 0; i < k; ++i) { \
+                next = TB_LEFT(tmp, field); \
+                TB_ROTATE_RIGHT(type, head, tmp, field, aug); \
+                if (red) \
+                    color(tmp, field, 1); \
+                if (i == 0) \
+                    elm = next; \
+                tmp = TB_LEFT(next, field); \
+            } \
+            if (m <= 1) \
+                break; \
+        } \
+        return elm; \
+    }
+
+/* Rebuilds the subtree at `elm` into a complete tree in linear time and
+ * constant space: the threads flatten it into a left vine in a single
+ * in-order walk, then TB_COMPRESS balances the vine.
+ * Returns the new root of the subtree. */
+#define TB_GENERATE_BALANCE(name, type, field, aug, color, attr) \
+    attr struct type *name##_TB_BALANCE(struct name *head, struct type *elm) { \
+        struct type *parent = TB_PARENT(elm, field); \
+        struct type *last = TB_MAX(name, elm); \
+        struct type *tmp = TB_MIN(name, elm), *prev = NULL, *next; \
+        size_t n = 1; \
+        TB_STAT(rebuilds, 1); \
+        for (;; prev = tmp, tmp = next, ++n) { \
+            next = tmp == last ? NULL : TB_NEXT(name, tmp); \
+            if (prev) { \
+                TB_LEFT(tmp, field) = prev; \
+                TB_LCLEAR(tmp, field); \
+                TB_SET_PARENT(prev, tmp, field); \
+            } \
+            color(tmp, field, 0); \
+            if (!next) \
+                break; \
+            TB_RIGHT(tmp, field) = next; \
+            TB_RSET(tmp, field); \
+            (void)aug(tmp); \
+        } \
+        (void)aug(last); \
+        TB_SWAP_CHILD(head, parent, elm, last, field); \
+        TB_SET_PARENT(last, parent, field); \
+        return TB_COMPRESS(name, head, last, n); \
+    }
+
+/* Links the `n` nodes of `elms` in order into a threaded left vine. */
+#define TB_BUILD_VINE(type, head, elms, n, field, aug) do { \
+        TB_ROOT(head) = (n) ? (elms)[(n) - 1] : NULL; \
+        for (size_t tb_i = 0; tb_i < (n); ++tb_i) { \
+            struct type *tb_elm = (elms)[tb_i]; \
+            struct type *tb_next = tb_i + 1 < (n) ? (elms)[tb_i + 1] : NULL; \
+            TB_UP(tb_elm, field) = tb_next; \
+            TB_SET(tb_elm, field); \
+            TB_LEFT(tb_elm, field) = tb_i ? (elms)[tb_i - 1] : NULL; \
+            TB_RIGHT(tb_elm, field) = tb_next; \
+            if (tb_i) \
+                TB_LCLEAR(tb_elm, field); \
+            (void)aug(tb_elm); \
+        } \
+    } while (0)
+
+/* Replaces the contents of `head` with the `n` nodes of `elms`, which must
+ * be sorted and unique under `cmp`, without calling it. */
+#define TB_GENERATE_BUILD_SORTED(name, type, field, aug, attr) \
+    attr void name##_TB_BUILD_SORTED(struct name *head, struct type **elms, size_t n) { \
+        TB_BUILD_VINE(type, head, elms, n, field, aug); \
+        if (n) \
+            TB_COMPRESS(name, head, elms[n - 1], n); \
+    }
+
+#define TB_GENERATE_SG_BUILD_SORTED(name, type, field, attr) \
+    attr void name##_TB_BUILD_SORTED(struct name *head, struct type **elms, size_t n) { \
+        TB_BUILD_VINE(type, head, elms, n, field, TB_AUGMENT_NONE); \
+        if (n) \
+            TB_COMPRESS(name, head, elms[n - 1], n); \
+        head->tb_count = head->tb_max = n; \
+    }
+
+#define TB_GENERATE_REBALANCE(name, type, field, attr) \
+    attr void name##_TB_REBALANCE(struct name *head) { \
+        if (!TB_EMPTY(head)) \
+            TB_BALANCE(name, head, TB_ROOT(head)); \
+    }
+
+#define TB_GENERATE_SG_REBALANCE(name, type, field, attr) \
+    attr void name##_TB_REBALANCE(struct name *head) { \
+        if (!TB_EMPTY(head)) \
+            TB_BALANCE(name, head, TB_ROOT(head)); \
+        head->tb_max = head->tb_count; \
+    }
+
+/* Merges the in-order sequences of `dst` and `src` into a threaded left
+ * vine at the root of `dst` with a single walk, leaving `src` empty and
+ * the vine length in `n`. Equal keys are passed to `dup` as (dst, src),
+ * which returns the node to keep or NULL to drop both; a dropped node is
+ * not touched again, so `dup` may free it. Without `dup` the node from
+ * `dst` is kept. */
+#define TB_MERGE_VINE(name, type, cmp, dst, src, dup, n, field, aug) do { \
+        struct type *tb_a = TB_FIRST(name, dst); \
+        struct type *tb_b = TB_FIRST(name, src); \
+        struct type *tb_tail = NULL, *tb_elm; \
+        TB_ROOT(src) = NULL; \
+        while (tb_a || tb_b) { \
+            int tb_comp = !tb_a ? 1 : !tb_b ? -1 : (cmp)(tb_a, tb_b); \
+            if (tb_comp < 0) { \
+                tb_elm = tb_a; \
+                tb_a = TB_NEXT(name, tb_a); \
+            } else if (tb_comp > 0) { \
+                tb_elm = tb_b; \
+                tb_b = TB_NEXT(name, tb_b); \
+            } else { \
+                struct type *tb_na = TB_NEXT(name, tb_a); \
+                struct type *tb_nb = TB_NEXT(name, tb_b); \
+                tb_elm = (dup) ? (dup)(tb_a, tb_b) : tb_a; \
+                tb_a = tb_na; \
+                tb_b = tb_nb; \
+                if (!tb_elm) \
+                    continue; \
+            } \
+            TB_UP(tb_elm, field) = NULL; \
+            TB_SET(tb_elm, field); \
+            TB_LEFT(tb_elm, field) = tb_tail; \
+            TB_RIGHT(tb_elm, field) = NULL; \
+            if (tb_tail) { \
+                TB_LCLEAR(tb_elm, field); \
+                TB_RIGHT(tb_tail, field) = tb_elm; \
+                TB_SET_PARENT(tb_tail, tb_elm, field); \
+            } \
+            (void)aug(tb_elm); \
+            tb_tail = tb_elm; \
+            ++(n); \
+        } \
+        TB_ROOT(dst) = tb_tail; \
+    } while (0)
+
+/* Moves all nodes of `src` into `dst` in O(n + m), leaving both balanced. */
+#define TB_GENERATE_MERGE(name, type, field, cmp, aug, attr) \
+    attr void name##_TB_MERGE(struct name *dst, struct name *src, \
+                              struct type *(*dup)(struct type *, struct type *)) { \
+        size_t n = 0; \
+        TB_MERGE_VINE(name, type, cmp, dst, src, dup, n, field, aug); \
+        if (n) \
+            TB_COMPRESS(name, dst, TB_ROOT(dst), n); \
+    }
+
+#define TB_GENERATE_SG_MERGE(name, type, field, cmp, attr) \
+    attr void name##_TB_MERGE(struct name *dst, struct name *src, \
+                              struct type *(*dup)(struct type *, struct type *)) { \
+        size_t n = 0; \
+        TB_MERGE_VINE(name, type, cmp, dst, src, dup, n, field, TB_AUGMENT_NONE); \
+        if (n) \
+            TB_COMPRESS(name, dst, TB_ROOT(dst), n); \
+        dst->tb_count = dst->tb_max = n; \
+        src->tb_count = src->tb_max = 0; \
+    }
+
+/* Moves the nodes less than `key` into `lo` and the rest into `hi` in a
+ * single descent. `lo` and `hi` may alias `head`, which is left empty
+ * otherwise. The threads across the cut become NULL. */
+#define TB_GENERATE_SPLIT(name, type, field, cmp, aug, attr) \
+    attr void name##_TB_SPLIT(struct name *head, struct type *key, \
+                              struct name *lo, struct name *hi) { \
+        struct type *elm = TB_ROOT(head); \
+        struct type *ltail = NULL, *htail = NULL, *next; \
+        TB_ROOT(head) = NULL; \
+        TB_ROOT(lo) = NULL; \
+        TB_ROOT(hi) = NULL; \
+        for (; elm; elm = next) { \
+            if ((cmp)(key, elm) > 0) { \
+                next = TB_RLEAF(elm, field) ? NULL : TB_RIGHT(elm, field); \
+                if (ltail) \
+                    TB_RIGHT(ltail, field) = elm; \
+                else \
+                    TB_ROOT(lo) = elm; \
+                TB_SET_PARENT(elm, ltail, field); \
+                ltail = elm; \
+            } else { \
+                next = TB_LLEAF(elm, field) ? NULL : TB_LEFT(elm, field); \
+                if (htail) \
+                    TB_LEFT(htail, field) = elm; \
+                else \
+                    TB_ROOT(hi) = elm; \
+                TB_SET_PARENT(elm, htail, field); \
+                htail = elm; \
+            } \
+        } \
+        if (ltail) { \
+            TB_RIGHT(ltail, field) = NULL; \
+            TB_RSET(ltail, field); \
+        } \
+        if (htail) { \
+            TB_LEFT(htail, field) = NULL; \
+            TB_LSET(htail, field); \
+        } \
+        for (; ltail; ltail = TB_PARENT(ltail, field)) \
+            (void)aug(ltail); \
+        for (; htail; htail = TB_PARENT(htail, field)) \
+            (void)aug(htail); \
+    }
+
+/* Appends `hi`, whose keys must all be greater than those of `lo`,
+ * to `lo`, leaving `hi` empty. */
+#define TB_GENERATE_JOIN(name, type, field, aug, attr) \
+    attr void name##_TB_JOIN(struct name *lo, struct name *hi) { \
+        struct type *max = TB_LAST(name, lo); \
+        struct type *min = TB_FIRST(name, hi); \
+        if (!max) { \
+            TB_ROOT(lo) = TB_ROOT(hi); \
+        } else if (min) { \
+            TB_RIGHT(max, field) = TB_ROOT(hi); \
+            TB_RCLEAR(max, field); \
+            TB_SET_PARENT(TB_ROOT(hi), max, field); \
+            TB_LEFT(min, field) = max; \
+            TB_AUGMENT_WALK(type, max, field, aug); \
+        } \
+        TB_ROOT(hi) = NULL; \
+    }
+
+#define TB_BLACK_HEIGHT(type, elm, height, field) do { \
+        struct type *tb_tmp = (elm); \
+        for ((height) = 0; tb_tmp; \
+             tb_tmp = TB_LLEAF(tb_tmp, field) ? NULL : TB_LEFT(tb_tmp, field)) \
+            (height) += TB_IS_BLACK(tb_tmp, field); \
+    } while (0)
+
+/* Detaches the subtree at `elm` as a standalone red-black tree of
+ * black height `height`, given that of its parent's children. */
+#define TB_DETACH(elm, height, field) do { \
+        if (elm) { \
+            TB_SET_PARENT(elm, NULL, field); \
+            if (TB_IS_RED(elm, field)) { \
+                TB_SET_BLACK(elm, field); \
+                ++(height); \
+            } \
+        } \
+    } while (0)
+
+/* Joins the red-black trees at `a` and `b` of black heights `ah` and `bh`
+ * with `elm` in between, and returns the root of the result, storing its
+ * black height in `height`. The threads from the maximum of `a` and the
+ * minimum of `b` must already point to `elm`; a side of `elm` with no
+ * subtree keeps its thread, or gets NULL if it had a child before.
+ * Runs in O(|ah - bh| + 1). */
+#define TB_GENERATE_JOIN3(name, type, field, aug, attr) \
+    attr struct type *name##_TB_JOIN3(struct type *a, int ah, struct type *elm, \
+                                      struct type *b, int bh, int *height) { \
+        struct name tmp; \
+        struct type *parent = NULL, *child; \
+        struct type *prev = TB_LLEAF(elm, field) ? TB_LEFT(elm, field) : NULL; \
+        struct type *next = TB_RLEAF(elm, field) ? TB_RIGHT(elm, field) : NULL; \
+        int h = ah > bh ? ah : bh; \
+        if (ah == bh) { \
+            TB_UP(elm, field) = NULL; \
+            TB_JOIN_LEFT(elm, a, prev, field); \
+            TB_JOIN_RIGHT(elm, b, next, field); \
+            (void)aug(elm); \
+            *height = ah + 1; \
+            return elm; \
+        } \
+        if (ah > bh) { \
+            TB_ROOT(&tmp) = child = a; \
+            for (;;) { \
+                if (TB_IS_BLACK(child, field)) { \
+                    if (h == bh) \
+                        break; \
+                    --h; \
+                } \
+                parent = child; \
+                if (TB_RLEAF(child, field)) { \
+                    child = NULL; \
+                    break; \
+                } \
+                child = TB_RIGHT(child, field); \
+            } \
+            TB_RIGHT(parent, field) = elm; \
+            TB_RCLEAR(parent, field); \
+            TB_UP(elm, field) = parent; \
+            TB_JOIN_LEFT(elm, child, parent, field); \
+            TB_JOIN_RIGHT(elm, b, next, field); \
+            h = ah; \
+        } else { \
+            TB_ROOT(&tmp) = child = b; \
+            for (;;) { \
+                if (TB_IS_BLACK(child, field)) { \
+                    if (h == ah) \
+                        break; \
+                    --h; \
+                } \
+                parent = child; \
+                if (TB_LLEAF(child, field)) { \
+                    child = NULL; \
+                    break; \
+                } \
+                child = TB_LEFT(child, field); \
+            } \
+            TB_LEFT(parent, field) = elm; \
+            TB_LCLEAR(parent, field); \
+            TB_UP(elm, field) = parent; \
+            TB_JOIN_RIGHT(elm, child, parent, field); \
+            TB_JOIN_LEFT(elm, a, prev, field); \
+            h = bh; \
+        } \
+        (void)aug(elm); \
+        TB_AUGMENT_WALK(type, parent, field, aug); \
+        *height = h + name##_TB_INSERT_COLOR(&tmp, elm); \
+        return TB_ROOT(&tmp); \
+    }
+
+#define TB_JOIN_LEFT(elm, child, thread, field) do { \
+        if (child) { \
+            TB_LEFT(elm, field) = (child); \
+            TB_SET_PARENT(child, elm, field); \
+        } else { \
+            TB_LEFT(elm, field) = (thread); \
+            TB_LSET(elm, field); \
+        } \
+    } while (0)
+
+#define TB_JOIN_RIGHT(elm, child, thread, field) do { \
+        if (child) { \
+            TB_RIGHT(elm, field) = (child); \
+            TB_SET_PARENT(child, elm, field); \
+        } else { \
+            TB_RIGHT(elm, field) = (thread); \
+            TB_RSET(elm, field); \
+        } \
+    } while (0)
+
+/* Same as TB_SPLIT, rebuilding both halves bottom-up along the search
+ * path with TB_JOIN3 in O(log n). */
+#define TB_GENERATE_RB_SPLIT(name, type, field, cmp, attr) \
+    attr void name##_TB_SPLIT(struct name *head, struct type *key, \
+                              struct name *lo, struct name *hi) { \
+        struct type *elm = TB_ROOT(head), *prev = NULL, *up, *sub; \
+        struct type *l = NULL, *r = NULL; \
+        int comp = 0, height = 0, lheight = 0, rheight = 0, h; \
+        TB_ROOT(head) = NULL; \
+        if (elm) { \
+            while ((comp = (cmp)(key, elm)) < 0 ? !TB_LLEAF(elm, field) : \
+                   comp > 0 ? !TB_RLEAF(elm, field) : 0) \
+                elm = comp < 0 ? TB_LEFT(elm, field) : TB_RIGHT(elm, field); \
+            TB_BLACK_HEIGHT(type, elm, height, field); \
+            height -= TB_IS_BLACK(elm, field); \
+            if (comp == 0 && !TB_LLEAF(elm, field)) { \
+                l = TB_LEFT(elm, field); \
+                lheight = height; \
+                TB_DETACH(l, lheight, field); \
+                TB_LEFT(elm, field) = NULL; \
+                TB_LSET(elm, field); \
+            } \
+        } \
+        for (; elm; prev = elm, elm = up) { \
+            int black = TB_IS_BLACK(elm, field); \
+            up = TB_PARENT(elm, field); \
+            h = height; \
+            if (prev ? TB_RIGHT(elm, field) == prev : comp > 0) { \
+                sub = TB_LLEAF(elm, field) ? NULL : TB_LEFT(elm, field); \
+                TB_DETACH(sub, h, field); \
+                l = TB_JOIN3(name, sub, h, elm, l, lheight, &lheight); \
+            } else { \
+                sub = TB_RLEAF(elm, field) ? NULL : TB_RIGHT(elm, field); \
+                TB_DETACH(sub, h, field); \
+                r = TB_JOIN3(name, r, rheight, elm, sub, h, &rheight); \
+            } \
+            height += black; \
+        } \
+        if (l) \
+            TB_RIGHT(TB_MAX(name, l), field) = NULL; \
+        if (r) \
+            TB_LEFT(TB_MIN(name, r), field) = NULL; \
+        TB_ROOT(lo) = l; \
+        TB_ROOT(hi) = r; \
+    }
+
+/* Same as TB_JOIN, in O(log n): the minimum of `hi` is removed and
+ * reinserted between the two trees with TB_JOIN3. */
+#define TB_GENERATE_RB_JOIN(name, type, field, attr) \
+    attr void name##_TB_JOIN(struct name *lo, struct name *hi) { \
+        struct type *max = TB_LAST(name, lo); \
+        struct type *elm = TB_FIRST(name, hi); \
+        struct type *min; \
+        int lheight, rheight; \
+        if (!max || !elm) { \
+            if (!max) \
+                TB_ROOT(lo) = TB_ROOT(hi); \
+            TB_ROOT(hi) = NULL; \
+            return; \
+        } \
+        TB_REMOVE(name, hi, elm); \
+        min = TB_FIRST(name, hi); \
+        TB_RIGHT(max, field) = elm; \
+        TB_LEFT(elm, field) = max; \
+        TB_RIGHT(elm, field) = min; \
+        TB_SET(elm, field); \
+        if (min) \
+            TB_LEFT(min, field) = elm; \
+        TB_BLACK_HEIGHT(type, TB_ROOT(lo), lheight, field); \
+        TB_BLACK_HEIGHT(type, TB_ROOT(hi), rheight, field); \
+        TB_ROOT(lo) = TB_JOIN3(name, TB_ROOT(lo), lheight, elm, TB_ROOT(hi), rheight, &lheight); \
+        TB_ROOT(hi) = NULL; \
+    }
+
+/* An insert deeper than 2*log2(n) rebuilds the lowest ancestor
+ * whose child holds more than 2/3 of its subtree. */
+#define TB_GENERATE_INSERT_SG(name, type, field, attr) \
+    attr void name##_TB_INSERT_SG(struct name *head, struct type *elm) { \
+        struct type *parent, *tmp = elm; \
+        size_t n, size = 1, depth = 0, limit = 0; \
+        n = ++head->tb_count; \
+        if (head->tb_max < n) \
+            head->tb_max = n; \
+        for (; n > 1; n >>= 1) \
+            limit += 2; \
+        while ((tmp = TB_PARENT(tmp, field))) \
+            ++depth; \
+        if (depth <= limit) \
+            return; \
+        for (tmp = elm; (parent = TB_PARENT(tmp, field)); tmp = parent) { \
+            struct type *sibling = TB_LEFT(parent, field) == tmp ? \
+                                   (TB_RLEAF(parent, field) ? NULL : TB_RIGHT(parent, field)) : \
+                                   (TB_LLEAF(parent, field) ? NULL : TB_LEFT(parent, field)); \
+            size_t total = size + 1; \
+            if (sibling) { \
+                struct type *last = TB_MAX(name, sibling); \
+                for (sibling = TB_MIN(name, sibling); ; sibling = TB_NEXT(name, sibling)) { \
+                    ++total; \
+                    if (sibling == last) \
+                        break; \
+                } \
+            } \
+            if (3 * size > 2 * total) \
+                break; \
+            size = total; \
+        } \
+        TB_BALANCE(name, head, parent ? parent : tmp); \
+    }
+
+#define TB_GENERATE_REMOVE_SG(name, type, field, attr) \
+    attr void name##_TB_REMOVE_SG(struct name *head, struct type *elm) { \
+        (void)elm; \
+        if (3 * --head->tb_count < 2 * head->tb_max) \
+            TB_REBALANCE(name, head); \
+    }
 
-#define TB_PROTOTYPE_PREV(name, type, attr) \
-    attr struct type *name##_TB_PREV(struct type *)
+/* Visits in order the nodes of the top `limit` levels of the tree at
+ * `root`, tracking the depth of `tmp`, counted from 1, like TB_STATS. */
+#define TB_PARTITION_WALK(root, tmp, parent, depth, limit, field, visit) do { \
+        (tmp) = (root); \
+        for ((depth) = 1; (depth) < (limit) && !TB_LLEAF(tmp, field); ++(depth)) \
+            (tmp) = TB_LEFT(tmp, field); \
+        for (;;) { \
+            visit; \
+            if ((depth) < (limit) && !TB_RLEAF(tmp, field)) { \
+                (tmp) = TB_RIGHT(tmp, field); \
+                for (++(depth); (depth) < (limit) && !TB_LLEAF(tmp, field); ++(depth)) \
+                    (tmp) = TB_LEFT(tmp, field); \
+                continue; \
+            } \
+            for (; ((parent) = TB_PARENT(tmp, field)); --(depth)) { \
+                if (TB_LEFT(parent, field) == (tmp)) \
+                    break; \
+                (tmp) = (parent); \
+            } \
+            if (!(parent)) \
+                break; \
+            (tmp) = (parent); \
+            --(depth); \
+        } \
+    } while (0)
 
-#define TB_PROTOTYPE_NEXT(name, type, attr) \
-    attr struct type *name##_TB_NEXT(struct type *)
+/* TB_PARTITION splits the in-order sequence into at most `k` runs and
+ * stores the first node of each in `out`, followed by NULL, so `out`
+ * needs `k + 1` slots. It returns the number of runs. The nodes of the
+ * top levels cut the sequence into `p` pieces, `o` being set when the
+ * first of these is empty, and the runs start at evenly spaced cuts. The
+ * levels are deepened until there are enough pieces, so the runs are of
+ * about equal length when the tree is balanced, at a cost of O(k) nodes
+ * visited. While the tree is not modified, each run may be walked by its
+ * own thread with TB_FOREACH_RUN, which TB_PARALLEL_FOREACH does with
+ * OpenMP. */
+#define TB_GENERATE_PARTITION(name, type, field, attr) \
+    attr size_t name##_TB_PARTITION(struct name *head, size_t k, struct type **out) { \
+        struct type *root = TB_ROOT(head), *tmp, *parent; \
+        size_t limit = 0, m = 0, prev, p, n, depth, i = 0, j = 1, o = 0; \
+        if (!root || !k) { \
+            out[0] = NULL; \
+            return 0; \
+        } \
+        do { \
+            prev = m; \
+            m = 0; \
+            ++limit; \
+            TB_PARTITION_WALK(root, tmp, parent, depth, limit, field, { \
+                if (!m++) \
+                    o = TB_LLEAF(tmp, field); \
+            }); \
+            p = m + 1 - o; \
+        } while (p < 2 * k && m > prev); \
+        n = p < k ? p : k; \
+        out[0] = TB_FIRST(name, head); \
+        if (n > 1) { \
+            TB_PARTITION_WALK(root, tmp, parent, depth, limit, field, { \
+                if (j < n && i == o + j * p / n - 1) \
+                    out[j++] = tmp; \
+                ++i; \
+            }); \
+        } \
+        out[n] = NULL; \
+        return n; \
+    } \
+    \
+    attr void name##_TB_PARALLEL_FOREACH(struct type **out, size_t n, \
+                                         void (*cb)(struct type *, void *), void *arg) { \
+        __tbtree_parallel_for \
+        for (size_t i = 0; i < n; ++i) { \
+            struct type *tmp; \
+            TB_FOREACH_RUN(tmp, name, out, i) \
+                cb(tmp, arg); \
+        } \
+    }
 
-#define TB_PROTOTYPE_FIRST(name, type, attr) \
-    attr struct type *name##_TB_FIRST(struct name *)
+/* Walks the tree once in order, tracking the depth through the parent
+ * links, which are climbed at most once each. */
+#ifdef TBTREE_STATS
+#define TB_GENERATE_STATS(name, type, field, attr) \
+    attr void name##_TB_STATS(struct name *head, struct tb_stats *out) { \
+        struct type *tmp = TB_ROOT(head), *parent; \
+        size_t depth = 0, total = 0; \
+        out->tb_count = out->tb_height = 0; \
+        out->tb_avg_depth = 0; \
+        for (size_t i = 0; i < TB_STATS_DEPTHS; ++i) \
+            out->tb_depths[i] = 0; \
+        if (!tmp) \
+            return; \
+        for (; !TB_LLEAF(tmp, field); ++depth) \
+            tmp = TB_LEFT(tmp, field); \
+        for (;;) { \
+            ++out->tb_count; \
+            total += depth; \
+            if (out->tb_height <= depth) \
+                out->tb_height = depth + 1; \
+            ++out->tb_depths[depth < TB_STATS_DEPTHS ? depth : TB_STATS_DEPTHS - 1]; \
+            if (!TB_RLEAF(tmp, field)) { \
+                tmp = TB_RIGHT(tmp, field); \
+                for (++depth; !TB_LLEAF(tmp, field); ++depth) \
+                    tmp = TB_LEFT(tmp, field); \
+                continue; \
+            } \
+            for (; (parent = TB_PARENT(tmp, field)); --depth) { \
+                if (TB_LEFT(parent, field) == tmp) \
+                    break; \
+                tmp = parent; \
+            } \
+            if (!parent) \
+                break; \
+            tmp = parent; \
+            --depth; \
+        } \
+        out->tb_avg_depth = (double)total / (double)out->tb_count; \
+    }
+#else
+#define TB_GENERATE_STATS(name, type, field, attr)
+#endif
 
-#define TB_PROTOTYPE_LAST(name, type, attr) \
-    attr struct type *name##_TB_LAST(struct name *)
+#define TB_GENERATE_KEY_CMP(name, type, keyfield, attr) \
+    attr int name##_TB_KEY_CMP(const struct type *a, const struct type *b) { \
+        return (a->keyfield > b->keyfield) - (a->keyfield < b->keyfield); \
+    }
 
-#define TB_PROTOTYPE_FIND(name, type, attr) \
-    attr struct type *name##_TB_FIND(struct name *, struct type *)
+/* Bare key lookups of TB_GENERATE_KEY trees. Each level is one equality
+ * test and the thread bit of the side picked by the key. */
+#define TB_GENERATE_FIND_KEY(name, type, field, keyfield, keytype, attr) \
+    attr struct type *name##_TB_FIND_KEY(struct name *head, keytype key) { \
+        struct type *tmp = TB_ROOT(head); \
+        TB_STAT(lookups, 1); \
+        while (tmp) { \
+            int dir = tmp->keyfield < key; \
+            TB_STAT(steps, 1); \
+            if (tmp->keyfield == key) \
+                return tmp; \
+            if (TB_BITS(tmp, field) & (TB_LBIT << dir)) \
+                return NULL; \
+            tmp = dir ? TB_RIGHT(tmp, field) : TB_LEFT(tmp, field); \
+        } \
+        return NULL; \
+    }
 
-#define TB_PROTOTYPE_NFIND(name, type, attr) \
-    attr struct type *name##_TB_NFIND(struct name *, struct type *)
+#define TB_GENERATE_NFIND_KEY(name, type, field, keyfield, keytype, attr) \
+    attr struct type *name##_TB_NFIND_KEY(struct name *head, keytype key) { \
+        struct type *tmp = TB_ROOT(head), *res = NULL; \
+        TB_STAT(lookups, 1); \
+        while (tmp) { \
+            int dir = tmp->keyfield < key; \
+            TB_STAT(steps, 1); \
+            if (tmp->keyfield == key) \
+                return tmp; \
+            res = dir ? res : tmp; \
+            if (TB_BITS(tmp, field) & (TB_LBIT << dir)) \
+                break; \
+            tmp = dir ? TB_RIGHT(tmp, field) : TB_LEFT(tmp, field); \
+        } \
+        return res; \
+    }
 
-#define TB_PROTOTYPE_INSERT(name, type, attr) \
-    attr struct type *name##_TB_INSERT(struct name *, struct type *)
+#define TB_GENERATE_PFIND_KEY(name, type, field, keyfield, keytype, attr) \
+    attr struct type *name##_TB_PFIND_KEY(struct name *head, keytype key) { \
+        struct type *tmp = TB_ROOT(head), *res = NULL; \
+        TB_STAT(lookups, 1); \
+        while (tmp) { \
+            int dir = tmp->keyfield < key; \
+            TB_STAT(steps, 1); \
+            if (tmp->keyfield == key) \
+                return tmp; \
+            res = dir ? tmp : res; \
+            if (TB_BITS(tmp, field) & (TB_LBIT << dir)) \
+                break; \
+            tmp = dir ? TB_RIGHT(tmp, field) : TB_LEFT(tmp, field); \
+        } \
+        return res; \
+    }
 
-#define TB_PROTOTYPE_REMOVE(name, type, attr) \
-    attr struct type *name##_TB_REMOVE(struct name *, struct type *)
+/* Snapshots of TB_GENERATE_KEY trees keep the keys in the array `keys`
+ * beside `elms`, so that lookups only touch the nodes they return. */
+#define TB_GENERATE_FREEZE_KEY(name, type, field, keyfield, keytype, attr) \
+    attr size_t name##_TB_FREEZE_KEY(struct name *head, keytype *keys, \
+                                     struct type **elms, size_t n) { \
+        size_t count = name##_TB_FREEZE(head, elms, n); \
+        if (count < n) { \
+            keys[0] = 0; \
+            for (size_t k = 1; k <= count; ++k) \
+                keys[k] = elms[k]->keyfield; \
+        } \
+        return count; \
+    }
 
-#define TB_PROTOTYPE_REINSERT(name, type, attr) \
-    attr struct type *name##_TB_REINSERT(struct name *, struct type *)
+#define TB_GENERATE_FROZEN_KEY(name, type, keytype, attr) \
+    attr size_t name##_TB_FROZEN_LOWER_KEY(const keytype *keys, size_t count, keytype key) { \
+        size_t k = 1; \
+        TB_STAT(lookups, 1); \
+        while (k <= count) { \
+            TB_FROZEN_PREFETCH(keys, k); \
+            TB_STAT(steps, 1); \
+            k = 2 * k + (keys[k] < key); \
+        } \
+        return tb_frozen_up(k); \
+    } \
+    \
+    attr size_t name##_TB_FROZEN_UPPER_KEY(const keytype *keys, size_t count, keytype key) { \
+        size_t k = 1; \
+        TB_STAT(lookups, 1); \
+        while (k <= count) { \
+            TB_FROZEN_PREFETCH(keys, k); \
+            TB_STAT(steps, 1); \
+            k = 2 * k + (keys[k] <= key); \
+        } \
+        return tb_frozen_up(k); \
+    } \
+    \
+    attr struct type *name##_TB_FROZEN_FIND_KEY(const keytype *keys, struct type **elms, \
+                                                size_t count, keytype key) { \
+        size_t k = name##_TB_FROZEN_LOWER_KEY(keys, count, key); \
+        return k && keys[k] == key ? elms[k] : NULL; \
+    } \
+    \
+    attr struct type *name##_TB_FROZEN_NFIND_KEY(const keytype *keys, struct type **elms, \
+                                                 size_t count, keytype key) { \
+        return elms[name##_TB_FROZEN_LOWER_KEY(keys, count, key)]; \
+    }
 
-#define TB_GENERATE(name, type, field, cmp) \
-    TB_GENERATE_INTERNAL(name, type, field, cmp,)
+#define TB_GENERATE_UPDATE_SIZE(name, type, field, attr) \
+    attr int name##_TB_UPDATE_SIZE(struct type *elm) { \
+        size_t size = TB_LSIZE(elm, field) + TB_RSIZE(elm, field) + 1; \
+        if (TB_SIZE(elm, field) == size) \
+            return 0; \
+        TB_SIZE(elm, field) = size; \
+        return 1; \
+    }
 
-#define TB_GENERATE_STATIC(name, type, field, cmp) \
-    TB_GENERATE_INTERNAL(name, type, field, cmp, __tbtree_unused static)
+/* Returns the node at zero-based position `k` in order, or NULL. */
+#define TB_GENERATE_SELECT(name, type, field, attr) \
+    attr struct type *name##_TB_SELECT(struct name *head, size_t k) { \
+        struct type *elm = TB_ROOT(head); \
+        while (elm) { \
+            size_t size = TB_LSIZE(elm, field); \
+            if (k < size) { \
+                elm = TB_LEFT(elm, field); \
+            } else if (k > size) { \
+                k -= size + 1; \
+                elm = TB_RLEAF(elm, field) ? NULL : TB_RIGHT(elm, field); \
+            } else { \
+                return elm; \
+            } \
+        } \
+        return NULL; \
+    }
 
-#define TB_GENERATE_INTERNAL(name, type, field, cmp, attr) \
-    TB_GENERATE_MIN(name, type, field, attr) \
-    TB_GENERATE_MAX(name, type, field, attr) \
-    TB_GENERATE_PREV(name, type, field, attr) \
-    TB_GENERATE_NEXT(name, type, field, attr) \
-    TB_GENERATE_FIRST(name, type, attr) \
-    TB_GENERATE_LAST(name, type, attr) \
-    TB_GENERATE_FIND(name, type, field, cmp, attr) \
-    TB_GENERATE_NFIND(name, type, field, cmp, attr) \
-    TB_GENERATE_INSERT(name, type, field, cmp, attr) \
-    TB_GENERATE_REMOVE(name, type, field, cmp, attr) \
-    TB_GENERATE_REINSERT(name, type, field, cmp, attr) \
+/* Returns the number of nodes before `elm`. */
+#define TB_GENERATE_RANK(name, type, field, attr) \
+    attr size_t name##_TB_RANK(struct name *head, struct type *elm) { \
+        size_t rank = TB_LSIZE(elm, field); \
+        struct type *parent; \
+        (void)head; \
+        for (; (parent = TB_PARENT(elm, field)); elm = parent) { \
+            if (TB_RIGHT(parent, field) == elm) \
+                rank += TB_LSIZE(parent, field) + 1; \
+        } \
+        return rank; \
+    }
 
-#define TB_GENERATE_MIN(name, type, field, attr) \
-    attr struct type *name##_TB_MIN(struct type *elm) { \
-        while (!TB_LLEAF(elm, field)) \
-            elm = TB_LEFT(elm, field); \
-        return elm; \
+#define TB_GENERATE_COUNT(name, type, field, attr) \
+    attr size_t name##_TB_COUNT(struct name *head) { \
+        return TB_EMPTY(head) ? 0 : TB_SIZE(TB_ROOT(head), field); \
     }
 
-#define TB_GENERATE_MAX(name, type, field, attr) \
-    attr struct type *name##_TB_MAX(struct type *elm) { \
-        while (!TB_RLEAF(elm, field)) \
-            elm = TB_RIGHT(elm, field); \
-        return elm; \
+#define TB_GENERATE_UPDATE_MAX(name, type, field, hi, max, attr) \
+    attr int name##_TB_UPDATE_MAX(struct type *elm) { \
+        __typeof__(elm->max) val = elm->hi; \
+        if (!TB_LLEAF(elm, field) && val < TB_LEFT(elm, field)->max) \
+            val = TB_LEFT(elm, field)->max; \
+        if (!TB_RLEAF(elm, field) && val < TB_RIGHT(elm, field)->max) \
+            val = TB_RIGHT(elm, field)->max; \
+        if (elm->max == val) \
+            return 0; \
+        elm->max = val; \
+        return 1; \
     }
 
-#define TB_GENERATE_PREV(name, type, field, attr) \
-    attr struct type *name##_TB_PREV(struct type *elm) { \
-        if (TB_LLEAF(elm, field)) \
-            return TB_LEFT(elm, field); \
-        return TB_MAX(name, TB_LEFT(elm, field)); \
+#define TB_OVERLAPS(a, b, lo, hi) ((a)->lo <= (b)->hi && (b)->lo <= (a)->hi)
+
+/* Returns the first node of the subtree at `elm` overlapping `key`,
+ * descending only into subtrees that must hold it. */
+#define TB_GENERATE_OVERLAP_MIN(name, type, field, lo, hi, max, attr) \
+    attr struct type *name##_TB_OVERLAP_MIN(struct type *elm, const struct type *key) { \
+        while (elm && !(elm->max < key->lo)) { \
+            if (!TB_LLEAF(elm, field) && !(TB_LEFT(elm, field)->max < key->lo)) { \
+                elm = TB_LEFT(elm, field); \
+                continue; \
+            } \
+            if (TB_OVERLAPS(elm, key, lo, hi)) \
+                return elm; \
+            if (key->hi < elm->lo) \
+                return NULL; \
+            elm = TB_RLEAF(elm, field) ? NULL : TB_RIGHT(elm, field); \
+        } \
+        return NULL; \
     }
 
-#define TB_GENERATE_NEXT(name, type, field, attr) \
-    attr struct type *name##_TB_NEXT(struct type *elm) { \
-        if (TB_RLEAF(elm, field)) \
-            return TB_RIGHT(elm, field); \
-        return TB_MIN(name, TB_RIGHT(elm, field)); \
+#define TB_GENERATE_OVERLAP(name, type, field, attr) \
+    attr struct type *name##_TB_OVERLAP(struct name *head, const struct type *key) { \
+        return name##_TB_OVERLAP_MIN(TB_ROOT(head), key); \
     }
 
-#define TB_GENERATE_FIRST(name, type, attr) \
+/* Returns the next node after `elm` overlapping `key`. Enumerating all
+ * overlaps this way is a single in-order walk that skips the subtrees
+ * whose `max` ends before `key`, crossing each link at most twice, and
+ * stops at the first node starting after it. Each of the k overlaps may
+ * still hang below a path of nodes that end before `key` while a
+ * descendant does not, so the walk visits O(min(n, k log n)) nodes, as
+ * for any tree augmented with `max` alone, and O(log n + k) when the
+ * overlapping nodes are adjacent in order. */
+#define TB_GENERATE_OVERLAP_NEXT(name, type, field, lo, hi, attr) \
+    attr struct type *name##_TB_OVERLAP_NEXT(struct type *elm, const struct type *key) { \
+        struct type *parent, *tmp; \
+        if (!TB_RLEAF(elm, field) && \
+            (tmp = name##_TB_OVERLAP_MIN(TB_RIGHT(elm, field), key))) \
+            return tmp; \
+        for (; (parent = TB_PARENT(elm, field)); elm = parent) { \
+            if (TB_LEFT(parent, field) != elm) \
+                continue; \
+            if (key->hi < parent->lo) \
+                return NULL; \
+            if (TB_OVERLAPS(parent, key, lo, hi)) \
+                return parent; \
+            if (!TB_RLEAF(parent, field) && \
+                (tmp = name##_TB_OVERLAP_MIN(TB_RIGHT(parent, field), key))) \
+                return tmp; \
+        } \
+        return NULL; \
+    }
+
+#define TB_IDX_SWAP_CHILD(head, base, parent, out, in, field) do { \
+        if ((parent) == NULL) { \
+            (head)->tb_root = TB_IDX(base, in); \
+        } else if ((parent)->field.tb_left == TB_IDX(base, out)) { \
+            (parent)->field.tb_left = TB_IDX(base, in); \
+        } else { \
+            (parent)->field.tb_right = TB_IDX(base, in); \
+        } \
+    } while (0)
+
+#define TB_IDX_ROTATE_LEFT(type, head, base, elm, field) do { \
+        struct type *tb_child = TB_IDX_RIGHT(base, elm, field); \
+        struct type *tb_up = TB_IDX_PARENT(base, elm, field); \
+        TB_STAT(rotations, 1); \
+        if (TB_IDX_LLEAF(tb_child, field)) { \
+            TB_IDX_SET_FLAG(elm, TB_RBIT, field); \
+        } else { \
+            (elm)->field.tb_right = tb_child->field.tb_left; \
+            TB_IDX_SET_PARENT(base, TB_IDX_RIGHT(base, elm, field), elm, field); \
+        } \
+        tb_child->field.tb_left = TB_IDX(base, elm); \
+        TB_IDX_CLEAR_FLAG(tb_child, TB_LBIT, field); \
+        TB_IDX_SWAP_CHILD(head, base, tb_up, elm, tb_child, field); \
+        TB_IDX_SET_PARENT(base, tb_child, tb_up, field); \
+        TB_IDX_SET_PARENT(base, elm, tb_child, field); \
+    } while (0)
+
+#define TB_IDX_ROTATE_RIGHT(type, head, base, elm, field) do { \
+        struct type *tb_child = TB_IDX_LEFT(base, elm, field); \
+        struct type *tb_up = TB_IDX_PARENT(base, elm, field); \
+        TB_STAT(rotations, 1); \
+        if (TB_IDX_RLEAF(tb_child, field)) { \
+            TB_IDX_SET_FLAG(elm, TB_LBIT, field); \
+        } else { \
+            (elm)->field.tb_left = tb_child->field.tb_right; \
+            TB_IDX_SET_PARENT(base, TB_IDX_LEFT(base, elm, field), elm, field); \
+        } \
+        tb_child->field.tb_right = TB_IDX(base, elm); \
+        TB_IDX_CLEAR_FLAG(tb_child, TB_RBIT, field); \
+        TB_IDX_SWAP_CHILD(head, base, tb_up, elm, tb_child, field); \
+        TB_IDX_SET_PARENT(base, tb_child, tb_up, field); \
+        TB_IDX_SET_PARENT(base, elm, tb_child, field); \
+    } while (0)
+
+#define TB_GENERATE_IDX_FIRST(name, type, field, attr) \
     attr struct type *name##_TB_FIRST(struct name *head) { \
-        return TB_EMPTY(head) ? NULL : TB_MIN(name, TB_ROOT(head)); \
+        struct type *base = head->tb_base; \
+        struct type *elm = TB_IDX_PTR(base, head->tb_root); \
+        while (elm && !TB_IDX_LLEAF(elm, field)) \
+            elm = TB_IDX_LEFT(base, elm, field); \
+        return elm; \
     }
 
-#define TB_GENERATE_LAST(name, type, attr) \
+#define TB_GENERATE_IDX_LAST(name, type, field, attr) \
     attr struct type *name##_TB_LAST(struct name *head) { \
-        return TB_EMPTY(head) ? NULL : TB_MAX(name, TB_ROOT(head)); \
+        struct type *base = head->tb_base; \
+        struct type *elm = TB_IDX_PTR(base, head->tb_root); \
+        while (elm && !TB_IDX_RLEAF(elm, field)) \
+            elm = TB_IDX_RIGHT(base, elm, field); \
+        return elm; \
     }
 
-#define TB_GENERATE_FIND(name, type, field, cmp, attr) \
+#define TB_GENERATE_IDX_PREV(name, type, field, attr) \
+    attr struct type *name##_TB_PREV(struct name *head, struct type *elm) { \
+        struct type *base = head->tb_base; \
+        if (TB_IDX_LLEAF(elm, field)) \
+            return TB_IDX_LEFT(base, elm, field); \
+        elm = TB_IDX_LEFT(base, elm, field); \
+        while (!TB_IDX_RLEAF(elm, field)) \
+            elm = TB_IDX_RIGHT(base, elm, field); \
+        return elm; \
+    }
+
+#define TB_GENERATE_IDX_NEXT(name, type, field, attr) \
+    attr struct type *name##_TB_NEXT(struct name *head, struct type *elm) { \
+        struct type *base = head->tb_base; \
+        if (TB_IDX_RLEAF(elm, field)) \
+            return TB_IDX_RIGHT(base, elm, field); \
+        elm = TB_IDX_RIGHT(base, elm, field); \
+        while (!TB_IDX_LLEAF(elm, field)) \
+            elm = TB_IDX_LEFT(base, elm, field); \
+        return elm; \
+    }
+
+#define TB_GENERATE_IDX_FIND(name, type, field, cmp, attr) \
     attr struct type *name##_TB_FIND(struct name *head, struct type *elm) { \
-        struct type *tmp = TB_ROOT(head); \
+        struct type *base = head->tb_base; \
+        struct type *tmp = TB_IDX_PTR(base, head->tb_root); \
+        TB_STAT(lookups, 1); \
         while (tmp) { \
             int comp = (cmp)(elm, tmp); \
+            TB_STAT(steps, 1); \
             if (comp < 0) { \
-                if (TB_LLEAF(tmp, field)) \
+                if (TB_IDX_LLEAF(tmp, field)) \
                     return NULL; \
-                tmp = TB_LEFT(tmp, field); \
+                tmp = TB_IDX_LEFT(base, tmp, field); \
             } else if (comp > 0) { \
-                if (TB_RLEAF(tmp, field)) \
+                if (TB_IDX_RLEAF(tmp, field)) \
                     return NULL; \
-                tmp = TB_RIGHT(tmp, field); \
+                tmp = TB_IDX_RIGHT(base, tmp, field); \
             } else { \
                 return tmp; \
             } \
@@ -216,157 +3316,632 @@
         return NULL; \
     }
 
-#define TB_GENERATE_NFIND(name, type, field, cmp, attr) \
+#define TB_GENERATE_IDX_NFIND(name, type, field, cmp, attr) \
     attr struct type *name##_TB_NFIND(struct name *head, struct type *elm) { \
-        struct type *tmp = TB_ROOT(head); \
-        struct type *res = NULL; \
+        struct type *base = head->tb_base; \
+        struct type *tmp = TB_IDX_PTR(base, head->tb_root); \
+        TB_STAT(lookups, 1); \
         while (tmp) { \
             int comp = (cmp)(elm, tmp); \
+            TB_STAT(steps, 1); \
             if (comp < 0) { \
-                if (TB_LLEAF(tmp, field)) \
+                if (TB_IDX_LLEAF(tmp, field)) \
                     return tmp; \
-                res = tmp; \
-                tmp = TB_LEFT(tmp, field); \
+                tmp = TB_IDX_LEFT(base, tmp, field); \
             } else if (comp > 0) { \
-                if (TB_RLEAF(tmp, field)) \
-                    return NULL; \
-                tmp = TB_RIGHT(tmp, field); \
+                if (TB_IDX_RLEAF(tmp, field)) \
+                    return TB_IDX_RIGHT(base, tmp, field); \
+                tmp = TB_IDX_RIGHT(base, tmp, field); \
             } else { \
                 return tmp; \
             } \
         } \
-        return res; \
+        return NULL; \
     }
 
-#define TB_GENERATE_INSERT(name, type, field, cmp, attr) \
+#define TB_GENERATE_IDX_INSERT_COLOR(name, type, field, attr) \
+    attr void name##_TB_INSERT_COLOR(struct name *head, struct type *elm) { \
+        struct type *base = head->tb_base; \
+        struct type *parent, *gparent, *tmp; \
+        TB_IDX_SET_FLAG(elm, TB_CBIT, field); \
+        while ((parent = TB_IDX_PARENT(base, elm, field)) && TB_IDX_IS_RED(parent, field)) { \
+            gparent = TB_IDX_PARENT(base, parent, field); \
+            if (gparent->field.tb_left == TB_IDX(base, parent)) { \
+                if (TB_IDX_RRED(base, gparent, field)) { \
+                    TB_IDX_CLEAR_FLAG(TB_IDX_RIGHT(base, gparent, field), TB_CBIT, field); \
+                    TB_IDX_CLEAR_FLAG(parent, TB_CBIT, field); \
+                    TB_IDX_SET_FLAG(gparent, TB_CBIT, field); \
+                    elm = gparent; \
+                    continue; \
+                } \
+                if (parent->field.tb_right == TB_IDX(base, elm)) { \
+                    TB_IDX_ROTATE_LEFT(type, head, base, parent, field); \
+                    tmp = parent; \
+                    parent = elm; \
+                    elm = tmp; \
+                } \
+                TB_IDX_CLEAR_FLAG(parent, TB_CBIT, field); \
+                TB_IDX_SET_FLAG(gparent, TB_CBIT, field); \
+                TB_IDX_ROTATE_RIGHT(type, head, base, gparent, field); \
+            } else { \
+                if (TB_IDX_LRED(base, gparent, field)) { \
+                    TB_IDX_CLEAR_FLAG(TB_IDX_LEFT(base, gparent, field), TB_CBIT, field); \
+                    TB_IDX_CLEAR_FLAG(parent, TB_CBIT, field); \
+                    TB_IDX_SET_FLAG(gparent, TB_CBIT, field); \
+                    elm = gparent; \
+                    continue; \
+                } \
+                if (parent->field.tb_left == TB_IDX(base, elm)) { \
+                    TB_IDX_ROTATE_RIGHT(type, head, base, parent, field); \
+                    tmp = parent; \
+                    parent = elm; \
+                    elm = tmp; \
+                } \
+                TB_IDX_CLEAR_FLAG(parent, TB_CBIT, field); \
+                TB_IDX_SET_FLAG(gparent, TB_CBIT, field); \
+                TB_IDX_ROTATE_LEFT(type, head, base, gparent, field); \
+            } \
+        } \
+        TB_IDX_CLEAR_FLAG(TB_IDX_PTR(base, head->tb_root), TB_CBIT, field); \
+    }
+
+#define TB_GENERATE_IDX_REMOVE_COLOR(name, type, field, attr) \
+    attr void name##_TB_REMOVE_COLOR(struct name *head, struct type *parent, \
+                                     struct type *elm, int left) { \
+        struct type *base = head->tb_base; \
+        struct type *tmp; \
+        while (parent && (!elm || !TB_IDX_IS_RED(elm, field))) { \
+            if (left) { \
+                tmp = TB_IDX_RIGHT(base, parent, field); \
+                if (TB_IDX_IS_RED(tmp, field)) { \
+                    TB_IDX_CLEAR_FLAG(tmp, TB_CBIT, field); \
+                    TB_IDX_SET_FLAG(parent, TB_CBIT, field); \
+                    TB_IDX_ROTATE_LEFT(type, head, base, parent, field); \
+                    tmp = TB_IDX_RIGHT(base, parent, field); \
+                } \
+                if (!TB_IDX_LRED(base, tmp, field) && !TB_IDX_RRED(base, tmp, field)) { \
+                    TB_IDX_SET_FLAG(tmp, TB_CBIT, field); \
+                    elm = parent; \
+                    parent = TB_IDX_PARENT(base, elm, field); \
+                    left = parent && parent->field.tb_left == TB_IDX(base, elm); \
+                    continue; \
+                } \
+                if (!TB_IDX_RRED(base, tmp, field)) { \
+                    TB_IDX_CLEAR_FLAG(TB_IDX_LEFT(base, tmp, field), TB_CBIT, field); \
+                    TB_IDX_SET_FLAG(tmp, TB_CBIT, field); \
+                    TB_IDX_ROTATE_RIGHT(type, head, base, tmp, field); \
+                    tmp = TB_IDX_RIGHT(base, parent, field); \
+                } \
+                TB_IDX_CLEAR_FLAG(tmp, TB_CBIT, field); \
+                TB_IDX_BITS(tmp, field) |= TB_IDX_BITS(parent, field) & (uint32_t)TB_CBIT; \
+                TB_IDX_CLEAR_FLAG(parent, TB_CBIT, field); \
+                TB_IDX_CLEAR_FLAG(TB_IDX_RIGHT(base, tmp, field), TB_CBIT, field); \
+                TB_IDX_ROTATE_LEFT(type, head, base, parent, field); \
+            } else { \
+                tmp = TB_IDX_LEFT(base, parent, field); \
+                if (TB_IDX_IS_RED(tmp, field)) { \
+                    TB_IDX_CLEAR_FLAG(tmp, TB_CBIT, field); \
+                    TB_IDX_SET_FLAG(parent, TB_CBIT, field); \
+                    TB_IDX_ROTATE_RIGHT(type, head, base, parent, field); \
+                    tmp = TB_IDX_LEFT(base, parent, field); \
+                } \
+                if (!TB_IDX_LRED(base, tmp, field) && !TB_IDX_RRED(base, tmp, field)) { \
+                    TB_IDX_SET_FLAG(tmp, TB_CBIT, field); \
+                    elm = parent; \
+                    parent = TB_IDX_PARENT(base, elm, field); \
+                    left = parent && parent->field.tb_left == TB_IDX(base, elm); \
+                    continue; \
+                } \
+                if (!TB_IDX_LRED(base, tmp, field)) { \
+                    TB_IDX_CLEAR_FLAG(TB_IDX_RIGHT(base, tmp, field), TB_CBIT, field); \
+                    TB_IDX_SET_FLAG(tmp, TB_CBIT, field); \
+                    TB_IDX_ROTATE_LEFT(type, head, base, tmp, field); \
+                    tmp = TB_IDX_LEFT(base, parent, field); \
+                } \
+                TB_IDX_CLEAR_FLAG(tmp, TB_CBIT, field); \
+                TB_IDX_BITS(tmp, field) |= TB_IDX_BITS(parent, field) & (uint32_t)TB_CBIT; \
+                TB_IDX_CLEAR_FLAG(parent, TB_CBIT, field); \
+                TB_IDX_CLEAR_FLAG(TB_IDX_LEFT(base, tmp, field), TB_CBIT, field); \
+                TB_IDX_ROTATE_RIGHT(type, head, base, parent, field); \
+            } \
+            elm = TB_IDX_PTR(base, head->tb_root); \
+            break; \
+        } \
+        if (elm) \
+            TB_IDX_CLEAR_FLAG(elm, TB_CBIT, field); \
+    }
+
+/* A node whose index does not fit in a link is not linked: TB_INSERT
+ * returns the equal node if there is one and the node itself otherwise. */
+#define TB_GENERATE_IDX_INSERT(name, type, field, cmp, attr) \
     attr struct type *name##_TB_INSERT(struct name *head, struct type *elm) { \
-        struct type *parent = NULL; \
-        struct type *lprev = NULL; \
-        struct type *rprev = NULL; \
-        struct type **prev = &TB_ROOT(head); \
-        struct type *tmp = *prev; \
+        struct type *base = head->tb_base; \
+        struct type *tmp = TB_IDX_PTR(base, head->tb_root); \
+        uint32_t idx = TB_IDX(base, elm); \
+        if (!TB_IDX_FITS(base, elm)) { \
+            tmp = name##_TB_FIND(head, elm); \
+            return tmp ? tmp : elm; \
+        } \
+        elm->field.tb_left = 0; \
+        elm->field.tb_right = 0; \
+        TB_IDX_BITS(elm, field) = (uint32_t)TB_MASK; \
+        TB_STAT(inserts, 1); \
+        if (!tmp) \
+            head->tb_root = idx; \
         while (tmp) { \
             int comp = (cmp)(elm, tmp); \
+            TB_STAT(steps, 1); \
             if (comp < 0) { \
-                if (TB_LLEAF(tmp, field)) { \
-                    TB_UP(elm, field) = TB_RIGHT(elm, field) = tmp; \
-                    TB_SET(elm, field); \
-                    TB_LEFT(elm, field) = TB_LEFT(tmp, field); \
-                    TB_LEFT(tmp, field) = elm; \
-                    TB_LCLEAR(tmp, field); \
-                    return NULL; \
+                if (TB_IDX_LLEAF(tmp, field)) { \
+                    elm->field.tb_left = tmp->field.tb_left; \
+                    elm->field.tb_right = TB_IDX(base, tmp); \
+                    TB_IDX_SET_PARENT(base, elm, tmp, field); \
+                    tmp->field.tb_left = idx; \
+                    TB_IDX_CLEAR_FLAG(tmp, TB_LBIT, field); \
+                    break; \
                 } \
-                rprev = parent = tmp; \
-                prev = &TB_LEFT(tmp, field); \
-                tmp = *prev; \
+                tmp = TB_IDX_LEFT(base, tmp, field); \
             } else if (comp > 0) { \
-                if (TB_RLEAF(tmp, field)) { \
-                    TB_UP(elm, field) = TB_LEFT(elm, field) = tmp; \
-                    TB_SET(elm, field); \
-                    TB_RIGHT(elm, field) = TB_RIGHT(tmp, field); \
-                    TB_RIGHT(tmp, field) = elm; \
-                    TB_RCLEAR(tmp, field); \
-                    return NULL; \
+                if (TB_IDX_RLEAF(tmp, field)) { \
+                    elm->field.tb_right = tmp->field.tb_right; \
+                    elm->field.tb_left = TB_IDX(base, tmp); \
+                    TB_IDX_SET_PARENT(base, elm, tmp, field); \
+                    tmp->field.tb_right = idx; \
+                    TB_IDX_CLEAR_FLAG(tmp, TB_RBIT, field); \
+                    break; \
                 } \
-                lprev = parent = tmp; \
-                prev = &TB_RIGHT(tmp, field); \
-                tmp = *prev; \
+                tmp = TB_IDX_RIGHT(base, tmp, field); \
             } else { \
-                TB_UP(elm, field) = NULL; \
-                TB_SET(elm, field); \
-                TB_LEFT(elm, field) = NULL; \
-                TB_RIGHT(elm, field) = NULL; \
                 return tmp; \
             } \
         } \
-        TB_UP(elm, field) = parent; \
-        TB_SET(elm, field); \
-        TB_LEFT(elm, field) = lprev; \
-        TB_RIGHT(elm, field) = rprev; \
-        *prev = elm; \
+        name##_TB_INSERT_COLOR(head, elm); \
         return NULL; \
     }
 
-#define TB_REMOVE_LEAF(type, head, elm, field) do { \
-        struct type *parent = TB_PARENT(elm, field); \
-        if (!parent) { \
-            TB_ROOT(head) = NULL; \
-        } else if (TB_LEFT(parent, field) == (elm)) { \
-            TB_LEFT(parent, field) = TB_LEFT(elm, field); \
-            TB_LSET(parent, field); \
+#define TB_GENERATE_IDX_REMOVE(name, type, field, attr) \
+    attr struct type *name##_TB_REMOVE(struct name *head, struct type *elm) { \
+        struct type *base = head->tb_base; \
+        struct type *parent = TB_IDX_PARENT(base, elm, field); \
+        struct type *up = parent, *child = NULL; \
+        uint32_t idx = TB_IDX(base, elm); \
+        int left = parent && parent->field.tb_left == idx; \
+        int red = TB_IDX_IS_RED(elm, field); \
+        TB_STAT(removes, 1); \
+        if (TB_IDX_LLEAF(elm, field) && TB_IDX_RLEAF(elm, field)) { \
+            if (!up) { \
+                head->tb_root = 0; \
+            } else if (left) { \
+                up->field.tb_left = elm->field.tb_left; \
+                TB_IDX_SET_FLAG(up, TB_LBIT, field); \
+            } else { \
+                up->field.tb_right = elm->field.tb_right; \
+                TB_IDX_SET_FLAG(up, TB_RBIT, field); \
+            } \
+        } else if (TB_IDX_LLEAF(elm, field)) { \
+            child = TB_IDX_RIGHT(base, elm, field); \
+            name##_TB_NEXT(head, elm)->field.tb_left = elm->field.tb_left; \
+            TB_IDX_SWAP_CHILD(head, base, up, elm, child, field); \
+            TB_IDX_SET_PARENT(base, child, up, field); \
+        } else if (TB_IDX_RLEAF(elm, field)) { \
+            child = TB_IDX_LEFT(base, elm, field); \
+            name##_TB_PREV(head, elm)->field.tb_right = elm->field.tb_right; \
+            TB_IDX_SWAP_CHILD(head, base, up, elm, child, field); \
+            TB_IDX_SET_PARENT(base, child, up, field); \
         } else { \
-            TB_RIGHT(parent, field) = TB_RIGHT(elm, field); \
-            TB_RSET(parent, field); \
+            struct type *next = name##_TB_NEXT(head, elm); \
+            red = TB_IDX_IS_RED(next, field); \
+            left = next != TB_IDX_RIGHT(base, elm, field); \
+            parent = left ? TB_IDX_PARENT(base, next, field) : next; \
+            child = TB_IDX_RLEAF(next, field) ? NULL : TB_IDX_RIGHT(base, next, field); \
+            name##_TB_PREV(head, elm)->field.tb_right = TB_IDX(base, next); \
+            if (left) { \
+                if (child) { \
+                    parent->field.tb_left = next->field.tb_right; \
+                    TB_IDX_SET_PARENT(base, child, parent, field); \
+                } else { \
+                    parent->field.tb_left = TB_IDX(base, next); \
+                    TB_IDX_SET_FLAG(parent, TB_LBIT, field); \
+                } \
+                next->field.tb_right = elm->field.tb_right; \
+                TB_IDX_SET_PARENT(base, TB_IDX_RIGHT(base, elm, field), next, field); \
+                TB_IDX_CLEAR_FLAG(next, TB_RBIT, field); \
+            } \
+            next->field.tb_left = elm->field.tb_left; \
+            TB_IDX_SET_PARENT(base, TB_IDX_LEFT(base, elm, field), next, field); \
+            TB_IDX_CLEAR_FLAG(next, TB_LBIT | TB_CBIT, field); \
+            TB_IDX_BITS(next, field) |= TB_IDX_BITS(elm, field) & (uint32_t)TB_CBIT; \
+            TB_IDX_SWAP_CHILD(head, base, up, elm, next, field); \
+            TB_IDX_SET_PARENT(base, next, up, field); \
         } \
+        if (!red) \
+            name##_TB_REMOVE_COLOR(head, parent, child, left); \
+        return elm; \
+    }
+
+/* Fills `image` for the first `count` nodes at `tb_base`, which must hold
+ * the whole tree, to be written right before them. */
+#define TB_GENERATE_IDX_SAVE(name, type, attr) \
+    attr void name##_TB_SAVE(struct name *head, size_t count, struct tb_image *image) { \
+        image->tb_magic = TB_IMAGE_MAGIC; \
+        image->tb_version = TB_IMAGE_VERSION; \
+        image->tb_node_size = (uint32_t)sizeof(struct type); \
+        image->tb_root = head->tb_root; \
+        image->tb_count = count; \
+        image->tb_checksum = TB_IMAGE_CHECKSUM(image, head->tb_base, \
+                                               count * sizeof(struct type)); \
+    }
+
+/* Whether the `size` bytes at `image` start with a header for this node
+ * type whose nodes all fit in them. */
+#define TB_IMAGE_MATCHES(image, size, type) \
+    ((size) >= sizeof(*(image)) && \
+     (image)->tb_magic == TB_IMAGE_MAGIC && \
+     (image)->tb_version == TB_IMAGE_VERSION && \
+     (image)->tb_node_size == sizeof(struct type) && \
+     (image)->tb_count <= ((size) - sizeof(*(image))) / sizeof(struct type) && \
+     (image)->tb_root <= (image)->tb_count)
+
+/* Points `head` at the tree of the `size` bytes at `data`, typically a
+ * mapped file, in constant time: only the header is checked, no node is
+ * read. The nodes must stay mapped for as long as `head` is used; a
+ * read-only mapping only allows lookups and traversal. Returns -1 and
+ * leaves `head` untouched if the header does not match this node type.
+ * Images that may be damaged are checked with TB_VERIFY first. */
+#define TB_GENERATE_IDX_LOAD(name, type, attr) \
+    attr int name##_TB_LOAD(struct name *head, const void *data, size_t size) { \
+        const struct tb_image *image = (const struct tb_image *)data; \
+        if (!TB_IMAGE_MATCHES(image, size, type)) \
+            return -1; \
+        head->tb_base = (struct type *)(uintptr_t)((const char *)data + sizeof(*image)); \
+        head->tb_root = image->tb_root; \
+        return 0; \
+    }
+
+/* Checks the header of the image at `data` as TB_LOAD does and the
+ * checksum over all of its nodes, which reads the whole image. Returns -1
+ * if either fails. */
+#define TB_GENERATE_IDX_VERIFY(name, type, attr) \
+    attr int name##_TB_VERIFY(const void *data, size_t size) { \
+        const struct tb_image *image = (const struct tb_image *)data; \
+        if (!TB_IMAGE_MATCHES(image, size, type) || \
+            image->tb_checksum != TB_IMAGE_CHECKSUM(image, image + 1, \
+                                                    image->tb_count * sizeof(struct type))) \
+            return -1; \
+        return 0; \
+    }
+
+#ifndef TB_SHARD_SLACK
+#define TB_SHARD_SLACK 64
+#endif
+
+/* A shard is too large once it holds half again as many nodes as the
+ * average, plus some slack for small trees. */
+#define TB_SHARD_SKEWED(count, total, n) \
+    (2 * (count) > 3 * (total) / (n) + 2 * TB_SHARD_SLACK)
+
+#define TB_SHARD_COUNT(head, i) \
+    __atomic_load_n(&(head)->tb_shards[i].tb_count, __ATOMIC_RELAXED)
+
+#define TB_SHARD_SET_COUNT(shard, n) \
+    __atomic_store_n(&(shard)->tb_count, (n), __ATOMIC_RELAXED)
+
+/* The bound of a shard is written under the locks of the shard and of the
+ * one before it, and read without any lock by the shard searches. Writers
+ * make `tb_seq` odd while they store the words of the bound; readers copy
+ * the words out and retry when `tb_seq` was odd or has moved, so they never
+ * compare against a torn bound. All the words are accessed atomically. */
+#define TB_SHARD_STORE(shard, set, src) do { \
+        uintptr_t *tb_dst = (uintptr_t *)&(shard)->tb_lo; \
+        const uintptr_t *tb_word = (const uintptr_t *)(src); \
+        unsigned tb_now = (shard)->tb_seq; \
+        __atomic_store_n(&(shard)->tb_seq, tb_now + 1, __ATOMIC_RELAXED); \
+        __tbtree_fence(__ATOMIC_RELEASE); \
+        for (size_t tb_i = 0; tb_i < sizeof((shard)->tb_lo) / sizeof(uintptr_t); ++tb_i) \
+            __atomic_store_n(&tb_dst[tb_i], tb_word[tb_i], __ATOMIC_RELAXED); \
+        __atomic_store_n(&(shard)->tb_bounded, (set), __ATOMIC_RELAXED); \
+        __atomic_store_n(&(shard)->tb_seq, tb_now + 2, __ATOMIC_RELEASE); \
     } while (0)
 
-#define TB_REMOVE_LLEAF(name, type, head, elm, field) do { \
-        struct type *child = TB_RIGHT(elm, field); \
-        struct type *parent = TB_PARENT(elm, field); \
-        TB_SWAP_CHILD(head, parent, elm, child, field); \
-        TB_SET_PARENT(child, parent, field); \
+/* Copies the bound of `shard` into `dst` and sets `set` to whether it is
+ * set. */
+#define TB_SHARD_LOAD(shard, dst, set) do { \
+        const uintptr_t *tb_word = (const uintptr_t *)&(shard)->tb_lo; \
+        uintptr_t *tb_out = (uintptr_t *)(dst); \
+        for (;;) { \
+            unsigned tb_now = __atomic_load_n(&(shard)->tb_seq, __ATOMIC_ACQUIRE); \
+            if (tb_now & 1) \
+                continue; \
+            (set) = __atomic_load_n(&(shard)->tb_bounded, __ATOMIC_RELAXED); \
+            for (size_t tb_i = 0; (set) && tb_i < sizeof((shard)->tb_lo) / sizeof(uintptr_t); \
+                 ++tb_i) \
+                tb_out[tb_i] = __atomic_load_n(&tb_word[tb_i], __ATOMIC_RELAXED); \
+            __tbtree_fence(__ATOMIC_ACQUIRE); \
+            if (__atomic_load_n(&(shard)->tb_seq, __ATOMIC_RELAXED) == tb_now) \
+                break; \
+        } \
     } while (0)
 
-#define TB_REMOVE_RLEAF(name, type, head, elm, field) do { \
-        struct type *child = TB_LEFT(elm, field); \
-        struct type *parent = TB_PARENT(elm, field); \
-        TB_SWAP_CHILD(head, parent, elm, child, field); \
-        TB_SET_PARENT(child, parent, field); \
+/* Sets the bound of `shard` to a copy of `elm` without its links, or
+ * clears it if `elm` is NULL. */
+#define TB_SHARD_SET_LO(shard, type, elm, field) do { \
+        struct type tb_lo = (elm) ? *(elm) : (shard)->tb_lo; \
+        __typeof__(tb_lo.field) tb_none = { 0 }; \
+        tb_lo.field = tb_none; \
+        TB_SHARD_STORE(shard, (elm) != NULL, &tb_lo); \
     } while (0)
 
-#define TB_GENERATE_REMOVE(name, type, field, cmp, attr) \
-    attr struct type *name##_TB_REMOVE(struct name *head, struct type *elm) { \
-        if (TB_LEAF(elm, field)) { \
-            TB_REMOVE_LEAF(type, head, elm, field); \
-        } else if (TB_LLEAF(elm, field)) { \
-            TB_LEFT(TB_NEXT(name, elm), field) = TB_LEFT(elm, field); \
-            TB_REMOVE_LLEAF(name, type, head, elm, field); \
-        } else if (TB_RLEAF(elm, field)) { \
-            TB_RIGHT(TB_PREV(name, elm), field) = TB_RIGHT(elm, field); \
-            TB_REMOVE_RLEAF(name, type, head, elm, field); \
-        } else { \
-            struct type *tmp = TB_NEXT(name, elm); \
-            TB_RIGHT(TB_PREV(name, elm), field) = tmp; \
-            if (TB_LEAF(tmp, field)) { \
-                TB_REMOVE_LEAF(type, head, tmp, field); \
-            } else { \
-                TB_REMOVE_LLEAF(name, type, head, tmp, field); \
-            } \
-            struct type *parent = TB_PARENT(elm, field); \
-            TB_SWAP_CHILD(head, parent, elm, tmp, field); \
-            TB_UP(tmp, field) = parent; \
-            TB_LEFT(tmp, field) = TB_LEFT(elm, field); \
-            if (!TB_RIGHT(tmp, field)) { \
-                TB_RSET(tmp, field); \
-            } else { \
-                TB_LEFT(TB_NEXT(name, tmp), field) = tmp; \
+/* Locks and returns the shard of `key`. The bounds are searched without
+ * the locks, so the pick is checked again under the lock of the shard,
+ * which also guards its two bounds. */
+#define TB_GENERATE_SHARD_LOCK(name, type, cmp, lock, unlock, attr) \
+    attr size_t name##_TB_SHARD_LOCK(struct name *head, struct type *key) { \
+        size_t n = TB_NSHARDS(head); \
+        struct type bound = { 0 }; \
+        for (;;) { \
+            size_t lo = 0, hi = n; \
+            while (hi - lo > 1) { \
+                size_t mid = lo + (hi - lo) / 2; \
+                int set; \
+                TB_SHARD_LOAD(&head->tb_shards[mid], &bound, set); \
+                if (set && (cmp)(key, &bound) >= 0) \
+                    lo = mid; \
+                else \
+                    hi = mid; \
+            } \
+            lock(&head->tb_shards[lo].tb_lock); \
+            if ((lo == 0 || (head->tb_shards[lo].tb_bounded && \
+                             (cmp)(key, &head->tb_shards[lo].tb_lo) >= 0)) && \
+                (lo + 1 == n || !head->tb_shards[lo + 1].tb_bounded || \
+                 (cmp)(key, &head->tb_shards[lo + 1].tb_lo) < 0)) \
+                return lo; \
+            unlock(&head->tb_shards[lo].tb_lock); \
+        } \
+    }
+
+/* Evens out the counts of shards `i` and `i + 1` under their two locks
+ * alone, moving the nodes next to the bound between them across it in
+ * O(moved) steps. The bounded shards stay a prefix, since a shard only
+ * gains a bound from the last bounded one before it. */
+#define TB_GENERATE_SHARD_MOVE(name, tree, type, field, lock, unlock, attr) \
+    attr void name##_TB_SHARD_MOVE(struct name *head, size_t i) { \
+        __typeof__(head->tb_shards[0]) *lo = &head->tb_shards[i], *hi = lo + 1; \
+        struct type *elm; \
+        struct tree part; \
+        size_t k, m; \
+        lock(&lo->tb_lock); \
+        lock(&hi->tb_lock); \
+        if (lo->tb_count > hi->tb_count + 1) { \
+            m = (lo->tb_count - hi->tb_count) / 2; \
+            for (elm = TB_LAST(tree, &lo->tb_tree), k = 1; k < m; ++k) \
+                elm = TB_PREV(tree, elm); \
+            TB_SPLIT(tree, &lo->tb_tree, elm, &lo->tb_tree, &part); \
+            TB_JOIN(tree, &part, &hi->tb_tree); \
+            TB_ROOT(&hi->tb_tree) = TB_ROOT(&part); \
+            TB_SHARD_SET_LO(hi, type, elm, field); \
+            TB_SHARD_SET_COUNT(lo, lo->tb_count - m); \
+            TB_SHARD_SET_COUNT(hi, hi->tb_count + m); \
+        } else if (hi->tb_count > lo->tb_count + 1) { \
+            m = (hi->tb_count - lo->tb_count) / 2; \
+            for (elm = TB_FIRST(tree, &hi->tb_tree), k = 0; k < m; ++k) \
+                elm = TB_NEXT(tree, elm); \
+            TB_SPLIT(tree, &hi->tb_tree, elm, &part, &hi->tb_tree); \
+            TB_JOIN(tree, &lo->tb_tree, &part); \
+            TB_SHARD_SET_LO(hi, type, elm, field); \
+            TB_SHARD_SET_COUNT(lo, lo->tb_count + m); \
+            TB_SHARD_SET_COUNT(hi, hi->tb_count - m); \
+        } \
+        unlock(&hi->tb_lock); \
+        unlock(&lo->tb_lock); \
+    }
+
+/* Joins all the shards and splits them again into even parts, taking
+ * every lock in order, in O(n) for n nodes. The bound of each shard is set
+ * to its lowest node. */
+#define TB_GENERATE_SHARD_BALANCE(name, tree, type, field, lock, unlock, attr) \
+    attr void name##_TB_SHARD_BALANCE(struct name *head) { \
+        size_t n = TB_NSHARDS(head), total = 0, i, k; \
+        struct type *elm, *next; \
+        struct tree all; \
+        TB_INIT(&all); \
+        for (i = 0; i < n; ++i) { \
+            lock(&head->tb_shards[i].tb_lock); \
+            total += head->tb_shards[i].tb_count; \
+        } \
+        for (i = 0; i < n && !TB_SHARD_SKEWED(head->tb_shards[i].tb_count, total, n); ++i) \
+            continue; \
+        if (i < n) { \
+            for (i = 0; i < n; ++i) \
+                TB_JOIN(tree, &all, &head->tb_shards[i].tb_tree); \
+            elm = TB_FIRST(tree, &all); \
+            for (i = 0; i < n; ++i) { \
+                __typeof__(head->tb_shards[0]) *shard = &head->tb_shards[i]; \
+                k = total / n + (i < total % n); \
+                TB_SHARD_SET_COUNT(shard, k); \
+                if (i) \
+                    TB_SHARD_SET_LO(shard, type, elm, field); \
+                for (next = elm; k--;) \
+                    next = TB_NEXT(tree, next); \
+                if (next) { \
+                    TB_SPLIT(tree, &all, next, &shard->tb_tree, &all); \
+                } else { \
+                    TB_ROOT(&shard->tb_tree) = TB_ROOT(&all); \
+                    TB_INIT(&all); \
+                } \
+                elm = next; \
+            } \
+        } \
+        for (i = n; i--;) \
+            unlock(&head->tb_shards[i].tb_lock); \
+    }
+
+/* Checks the shards without the locks after an update has left one of
+ * them with `count` nodes. Only that count is compared with `tb_total`, so
+ * that an update reads no other shard. All the counts are scanned, which
+ * refreshes `tb_total`, when it looks too large and every TB_SHARD_SLACK
+ * nodes of a shard, since removals lower the average and may leave any
+ * shard too large. The largest one first evens out with its smaller
+ * neighbour, which moves a single bound under two locks. All the shards
+ * are redistributed only when the pair is still too large, as when the
+ * keys keep growing past the last shard and its neighbours are full. */
+#define TB_GENERATE_SHARD_ADAPT(name, attr) \
+    attr void name##_TB_SHARD_ADAPT(struct name *head, size_t count) { \
+        size_t n = TB_NSHARDS(head); \
+        if (count % TB_SHARD_SLACK && \
+            !TB_SHARD_SKEWED(count, __atomic_load_n(&head->tb_total, __ATOMIC_RELAXED), n)) \
+            return; \
+        for (;;) { \
+            size_t total = 0, max = 0, i = 0; \
+            for (size_t j = 0; j < n; ++j) { \
+                count = TB_SHARD_COUNT(head, j); \
+                total += count; \
+                if (max < count) { \
+                    max = count; \
+                    i = j; \
+                } \
             } \
+            __atomic_store_n(&head->tb_total, total, __ATOMIC_RELAXED); \
+            if (!TB_SHARD_SKEWED(max, total, n)) \
+                return; \
+            if (n > 1) { \
+                size_t j = i == 0 ? 0 : i + 1 == n ? i - 1 : \
+                           TB_SHARD_COUNT(head, i - 1) < TB_SHARD_COUNT(head, i + 1) ? i - 1 : i; \
+                name##_TB_SHARD_MOVE(head, j); \
+                if (!TB_SHARD_SKEWED(TB_SHARD_COUNT(head, i), total, n)) \
+                    continue; \
+            } \
+            name##_TB_SHARD_BALANCE(head); \
+            return; \
         } \
+    }
+
+#define TB_GENERATE_SHARDED_INSERT(name, tree, type, unlock, attr) \
+    attr struct type *name##_TB_INSERT(struct name *head, struct type *elm) { \
+        size_t i = name##_TB_SHARD_LOCK(head, elm); \
+        size_t count = head->tb_shards[i].tb_count + 1; \
+        struct type *res = TB_INSERT(tree, &head->tb_shards[i].tb_tree, elm); \
+        if (!res) \
+            TB_SHARD_SET_COUNT(&head->tb_shards[i], count); \
+        unlock(&head->tb_shards[i].tb_lock); \
+        if (!res) \
+            name##_TB_SHARD_ADAPT(head, count); \
+        return res; \
+    }
+
+#define TB_GENERATE_SHARDED_REMOVE(name, tree, type, unlock, attr) \
+    attr struct type *name##_TB_REMOVE(struct name *head, struct type *elm) { \
+        size_t i = name##_TB_SHARD_LOCK(head, elm); \
+        size_t count = head->tb_shards[i].tb_count - 1; \
+        TB_REMOVE(tree, &head->tb_shards[i].tb_tree, elm); \
+        TB_SHARD_SET_COUNT(&head->tb_shards[i], count); \
+        unlock(&head->tb_shards[i].tb_lock); \
+        name##_TB_SHARD_ADAPT(head, count); \
         return elm; \
     }
 
-#define TB_GENERATE_REINSERT(name, type, field, cmp, attr) \
-    attr struct type *name##_TB_REINSERT(struct name *head, struct type *elm) { \
-        struct type *tmp; \
-        if (((tmp = TB_PREV(name, elm)) && (cmp)(tmp, elm) >= 0) || \
-            ((tmp = TB_NEXT(name, elm)) && (cmp)(elm, tmp) >= 0)) { \
-            TB_REMOVE(name, head, elm); \
-            return TB_INSERT(name, head, elm); \
+#define TB_GENERATE_SHARDED_FIND(name, tree, type, unlock, attr) \
+    attr struct type *name##_TB_FIND(struct name *head, struct type *elm) { \
+        size_t i = name##_TB_SHARD_LOCK(head, elm); \
+        struct type *res = TB_FIND(tree, &head->tb_shards[i].tb_tree, elm); \
+        unlock(&head->tb_shards[i].tb_lock); \
+        return res; \
+    }
+
+/* The locks are taken hand over hand in shard order, which keeps the
+ * bounds in between from moving. */
+#define TB_GENERATE_SHARDED_NFIND(name, tree, type, lock, unlock, attr) \
+    attr struct type *name##_TB_NFIND(struct name *head, struct type *elm) { \
+        size_t i = name##_TB_SHARD_LOCK(head, elm); \
+        struct type *res = TB_NFIND(tree, &head->tb_shards[i].tb_tree, elm); \
+        for (; !res && i + 1 < TB_NSHARDS(head); ++i) { \
+            lock(&head->tb_shards[i + 1].tb_lock); \
+            unlock(&head->tb_shards[i].tb_lock); \
+            res = TB_FIRST(tree, &head->tb_shards[i + 1].tb_tree); \
         } \
-        return NULL; \
+        unlock(&head->tb_shards[i].tb_lock); \
+        return res; \
+    }
+
+/* Calls `fn` on each node in order, holding the lock of its shard. */
+#define TB_GENERATE_SHARDED_WALK(name, tree, type, lock, unlock, attr) \
+    attr void name##_TB_WALK(struct name *head, void (*fn)(struct type *, void *), \
+                             void *arg) { \
+        struct type *elm; \
+        size_t i = 0; \
+        lock(&head->tb_shards[0].tb_lock); \
+        for (;; ++i) { \
+            TB_FOREACH(elm, tree, &head->tb_shards[i].tb_tree) \
+                fn(elm, arg); \
+            if (i + 1 == TB_NSHARDS(head)) \
+                break; \
+            lock(&head->tb_shards[i + 1].tb_lock); \
+            unlock(&head->tb_shards[i].tb_lock); \
+        } \
+        unlock(&head->tb_shards[i].tb_lock); \
+    }
+
+#define TB_GENERATE_SHARDED_COUNT(name, attr) \
+    attr size_t name##_TB_COUNT(struct name *head) { \
+        size_t n = 0; \
+        for (size_t i = 0; i < TB_NSHARDS(head); ++i) \
+            n += TB_SHARD_COUNT(head, i); \
+        return n; \
     }
 
 #define TB_MIN(name, ...)           name##_TB_MIN(__VA_ARGS__)
 #define TB_MAX(name, ...)           name##_TB_MAX(__VA_ARGS__)
 #define TB_PREV(name, ...)          name##_TB_PREV(__VA_ARGS__)
 #define TB_NEXT(name, ...)          name##_TB_NEXT(__VA_ARGS__)
+#define TB_PREV_N(name, ...)        name##_TB_PREV_N(__VA_ARGS__)
+#define TB_NEXT_N(name, ...)        name##_TB_NEXT_N(__VA_ARGS__)
 #define TB_FIRST(name, ...)         name##_TB_FIRST(__VA_ARGS__)
 #define TB_LAST(name, ...)          name##_TB_LAST(__VA_ARGS__)
 #define TB_FIND(name, ...)          name##_TB_FIND(__VA_ARGS__)
 #define TB_NFIND(name, ...)         name##_TB_NFIND(__VA_ARGS__)
 #define TB_INSERT(name, ...)        name##_TB_INSERT(__VA_ARGS__)
+#define TB_INSERT_HINT(name, ...)   name##_TB_INSERT_HINT(__VA_ARGS__)
 #define TB_REMOVE(name, ...)        name##_TB_REMOVE(__VA_ARGS__)
 #define TB_REINSERT(name, ...)      name##_TB_REINSERT(__VA_ARGS__)
+#define TB_COMPRESS(name, ...)      name##_TB_COMPRESS(__VA_ARGS__)
+#define TB_BALANCE(name, ...)       name##_TB_BALANCE(__VA_ARGS__)
+#define TB_REBALANCE(name, ...)     name##_TB_REBALANCE(__VA_ARGS__)
+#define TB_BUILD_SORTED(name, ...)  name##_TB_BUILD_SORTED(__VA_ARGS__)
+#define TB_MERGE(name, ...)         name##_TB_MERGE(__VA_ARGS__)
+#define TB_SPLIT(name, ...)         name##_TB_SPLIT(__VA_ARGS__)
+#define TB_JOIN(name, ...)          name##_TB_JOIN(__VA_ARGS__)
+#define TB_JOIN3(name, ...)         name##_TB_JOIN3(__VA_ARGS__)
+#define TB_PFIND(name, ...)         name##_TB_PFIND(__VA_ARGS__)
+#define TB_FIND_BATCH(name, ...)    name##_TB_FIND_BATCH(__VA_ARGS__)
+#define TB_NFIND_BATCH(name, ...)   name##_TB_NFIND_BATCH(__VA_ARGS__)
+#define TB_FIND_KEY(name, ...)      name##_TB_FIND_KEY(__VA_ARGS__)
+#define TB_NFIND_KEY(name, ...)     name##_TB_NFIND_KEY(__VA_ARGS__)
+#define TB_PFIND_KEY(name, ...)     name##_TB_PFIND_KEY(__VA_ARGS__)
+#define TB_RANGE_FIRST(name, ...)   name##_TB_RANGE_FIRST(__VA_ARGS__)
+#define TB_RANGE_NEXT(name, ...)    name##_TB_RANGE_NEXT(__VA_ARGS__)
+#define TB_SELECT(name, ...)        name##_TB_SELECT(__VA_ARGS__)
+#define TB_RANK(name, ...)          name##_TB_RANK(__VA_ARGS__)
+#define TB_COUNT(name, ...)         name##_TB_COUNT(__VA_ARGS__)
+#define TB_OVERLAP(name, ...)       name##_TB_OVERLAP(__VA_ARGS__)
+#define TB_OVERLAP_NEXT(name, ...)  name##_TB_OVERLAP_NEXT(__VA_ARGS__)
+#define TB_WALK(name, ...)          name##_TB_WALK(__VA_ARGS__)
+#define TB_SAVE(name, ...)          name##_TB_SAVE(__VA_ARGS__)
+#define TB_LOAD(name, ...)          name##_TB_LOAD(__VA_ARGS__)
+#define TB_VERIFY(name, ...)        name##_TB_VERIFY(__VA_ARGS__)
+#define TB_STATS(name, ...)         name##_TB_STATS(__VA_ARGS__)
+#define TB_EQUAL_RANGE(name, ...)   name##_TB_EQUAL_RANGE(__VA_ARGS__)
+#define TB_PARTITION(name, ...)     name##_TB_PARTITION(__VA_ARGS__)
+#define TB_SPLAY(name, ...)         name##_TB_SPLAY(__VA_ARGS__)
+#define TB_PARALLEL_FOREACH(name, ...) name##_TB_PARALLEL_FOREACH(__VA_ARGS__)
+#define TB_FREEZE(name, ...)        name##_TB_FREEZE(__VA_ARGS__)
+#define TB_FREEZE_KEY(name, ...)    name##_TB_FREEZE_KEY(__VA_ARGS__)
+#define TB_FROZEN_LOWER(name, ...)  name##_TB_FROZEN_LOWER(__VA_ARGS__)
+#define TB_FROZEN_UPPER(name, ...)  name##_TB_FROZEN_UPPER(__VA_ARGS__)
+#define TB_FROZEN_FIND(name, ...)   name##_TB_FROZEN_FIND(__VA_ARGS__)
+#define TB_FROZEN_NFIND(name, ...)  name##_TB_FROZEN_NFIND(__VA_ARGS__)
+#define TB_FROZEN_LOWER_KEY(name, ...)  name##_TB_FROZEN_LOWER_KEY(__VA_ARGS__)
+#define TB_FROZEN_UPPER_KEY(name, ...)  name##_TB_FROZEN_UPPER_KEY(__VA_ARGS__)
+#define TB_FROZEN_FIND_KEY(name, ...)   name##_TB_FROZEN_FIND_KEY(__VA_ARGS__)
+#define TB_FROZEN_NFIND_KEY(name, ...)  name##_TB_FROZEN_NFIND_KEY(__VA_ARGS__)
 
 #define TB_FOREACH(var, name, head) \
     for ((var) = TB_FIRST(name, head); \
@@ -407,3 +3982,69 @@
     for ((var) = ((var) ? (var) : TB_LAST(name, head)); \
          (var) && ((tvar) = TB_PREV(name, var), 1); \
          (var) = (tvar))
+
+#define TB_FOREACH_IDX(var, name, head) \
+    for ((var) = TB_FIRST(name, head); \
+         (var); \
+         (var) = TB_NEXT(name, head, var))
+
+#define TB_FOREACH_REVERSE_IDX(var, name, head) \
+    for ((var) = TB_LAST(name, head); \
+         (var); \
+         (var) = TB_PREV(name, head, var))
+
+#define TB_REMOVE_RANGE(name, head, lo, hi, cb) \
+    name##_TB_REMOVE_RANGE(head, lo, hi, TB_CLOSED, cb)
+
+#define TB_REMOVE_RANGE_BOUNDS(name, head, lo, hi, bounds, cb) \
+    name##_TB_REMOVE_RANGE(head, lo, hi, bounds, cb)
+
+#define TB_FOREACH_RANGE(var, name, head, lo, hi) \
+    TB_FOREACH_RANGE_BOUNDS(var, name, head, lo, hi, TB_CLOSED)
+
+#define TB_FOREACH_RANGE_BOUNDS(var, name, head, lo, hi, bounds) \
+    for ((var) = TB_RANGE_FIRST(name, head, lo, hi, bounds); \
+         (var); \
+         (var) = TB_RANGE_NEXT(name, var, hi, bounds))
+
+/* Iterates over run `i` of a TB_PARTITION. */
+#define TB_FOREACH_RUN(var, name, out, i) \
+    for ((var) = (out)[i]; \
+         (var) != (out)[(i) + 1]; \
+         (var) = TB_NEXT(name, var))
+
+#define TB_FOREACH_EQUAL(var, name, head, elm, end) \
+    for ((var) = TB_EQUAL_RANGE(name, head, elm, &(end)); \
+         (var) && (var) != (end); \
+         (var) = TB_NEXT(name, var))
+
+/* Iterates over the positions of a frozen snapshot of `count` nodes. */
+#define TB_FOREACH_FROZEN(pos, count) \
+    for ((pos) = tb_frozen_first(count); \
+         (pos); \
+         (pos) = tb_frozen_next(pos, count))
+
+#define TB_FOREACH_FROZEN_REVERSE(pos, count) \
+    for ((pos) = tb_frozen_last(count); \
+         (pos); \
+         (pos) = tb_frozen_prev(pos, count))
+
+/* Iterates over the positions of the nodes from `lo` to `hi` included,
+ * with `end` holding the position past the last one. `lo` must not be
+ * greater than `hi`. */
+#define TB_FOREACH_FROZEN_RANGE(pos, name, elms, count, lo, hi, end) \
+    for ((pos) = TB_FROZEN_LOWER(name, elms, count, lo), \
+         (end) = TB_FROZEN_UPPER(name, elms, count, hi); \
+         (pos) && (pos) != (end); \
+         (pos) = tb_frozen_next(pos, count))
+
+#define TB_FOREACH_FROZEN_RANGE_KEY(pos, name, keys, count, lo, hi, end) \
+    for ((pos) = TB_FROZEN_LOWER_KEY(name, keys, count, lo), \
+         (end) = TB_FROZEN_UPPER_KEY(name, keys, count, hi); \
+         (pos) && (pos) != (end); \
+         (pos) = tb_frozen_next(pos, count))
+
+#define TB_FOREACH_OVERLAP(var, name, head, key) \
+    for ((var) = TB_OVERLAP(name, head, key); \
+         (var); \
+         (var) = TB_OVERLAP_NEXT(name, var, key))
@@ -0,0 +1,272 @@
+#pragma once
+
+/* C++ wrapper of TBTREE: an intrusive red-black tree container over the
+ * threaded links of `tbtree.h`.
+ *
+ * Nodes derive from a `tb::base_hook` and the tree is declared with the tag
+ * of that hook and a strict weak order, both as template parameters, so that
+ * the comparator is inlined into the generated descent:
+ *
+ *     struct by_key;
+ *
+ *     struct item : tb::base_hook<by_key> {
+ *         int key;
+ *         bool operator<(const item &o) const { return key < o.key; }
+ *     };
+ *
+ *     tb::rbtree<item, by_key> tree;
+ *
+ * The nodes are reached from their hooks with a static_cast, so T may be any
+ * class type. The tree never allocates nor owns its nodes: they must outlive
+ * their membership and not be moved while linked. Keys are unique and a node
+ * can be in as many trees as it has hooks of distinct tags. The head is
+ * move-only.
+ */
+
+#include <cstddef>
+#include <functional>
+#include <iterator>
+#include <type_traits>
+#include <utility>
+
+#include "tbtree.h"
+
+namespace tb {
+
+/* The links point to the hooks, which are aligned for the color bit. */
+struct alignas(8) hook {
+    TB_ENTRY(hook) tb_entry;
+};
+
+/* The hook of the trees declared with `Tag`. */
+template <typename Tag = void>
+struct base_hook : hook {};
+
+template <typename T, typename Tag = void, typename Compare = std::less<T>>
+class rbtree {
+    static_assert(std::is_base_of<base_hook<Tag>, T>::value,
+                  "tree nodes must derive from tb::base_hook<Tag>");
+
+    /* The C operations of the family, generated as static members so that
+     * only the ones in use are instantiated. */
+    TB_HEAD(tb_tree, hook);
+
+    static hook *hook_of(const T &elm) noexcept {
+        return const_cast<base_hook<Tag> *>(static_cast<const base_hook<Tag> *>(&elm));
+    }
+
+    static T *node_of(hook *elm) noexcept {
+        return static_cast<T *>(static_cast<base_hook<Tag> *>(elm));
+    }
+
+    static int cmp(hook *a, hook *b) {
+        const T &x = *node_of(a), &y = *node_of(b);
+        return Compare()(x, y) ? -1 : Compare()(y, x);
+    }
+
+    TB_GENERATE_RB_INTERNAL(tb_tree, hook, tb_entry, cmp, static)
+
+    template <bool Const>
+    class iter {
+        friend class rbtree;
+        template <bool> friend class iter;
+
+        hook *elm_;
+        const struct tb_tree *head_;
+
+        iter(hook *elm, const struct tb_tree *head) noexcept
+            : elm_(elm), head_(head) {}
+
+    public:
+        typedef std::bidirectional_iterator_tag iterator_category;
+        typedef T value_type;
+        typedef std::ptrdiff_t difference_type;
+        typedef typename std::conditional<Const, const T *, T *>::type pointer;
+        typedef typename std::conditional<Const, const T &, T &>::type reference;
+
+        iter() noexcept : elm_(nullptr), head_(nullptr) {}
+
+        template <bool C, typename = typename std::enable_if<Const && !C>::type>
+        iter(const iter<C> &it) noexcept : elm_(it.elm_), head_(it.head_) {}
+
+        reference operator*() const noexcept { return *node_of(elm_); }
+        pointer operator->() const noexcept { return node_of(elm_); }
+
+        iter &operator++() noexcept {
+            elm_ = TB_NEXT(tb_tree, elm_);
+            return *this;
+        }
+
+        /* Decrementing the end lands on the last node. */
+        iter &operator--() noexcept {
+            elm_ = elm_ ? TB_PREV(tb_tree, elm_) :
+                   TB_LAST(tb_tree, const_cast<struct tb_tree *>(head_));
+            return *this;
+        }
+
+        iter operator++(int) noexcept {
+            iter it = *this;
+            ++*this;
+            return it;
+        }
+
+        iter operator--(int) noexcept {
+            iter it = *this;
+            --*this;
+            return it;
+        }
+
+        friend bool operator==(const iter &a, const iter &b) noexcept {
+            return a.elm_ == b.elm_;
+        }
+
+        friend bool operator!=(const iter &a, const iter &b) noexcept {
+            return a.elm_ != b.elm_;
+        }
+    };
+
+    struct tb_tree head_;
+    std::size_t size_;
+
+    iter<false> make(hook *elm) noexcept { return iter<false>(elm, &head_); }
+    iter<true> make(hook *elm) const noexcept { return iter<true>(elm, &head_); }
+
+    struct tb_tree *head() const noexcept { return const_cast<struct tb_tree *>(&head_); }
+
+public:
+    typedef T value_type;
+    typedef T &reference;
+    typedef const T &const_reference;
+    typedef std::size_t size_type;
+    typedef std::ptrdiff_t difference_type;
+    typedef Compare value_compare;
+    typedef iter<false> iterator;
+    typedef iter<true> const_iterator;
+    typedef std::reverse_iterator<iterator> reverse_iterator;
+    typedef std::reverse_iterator<const_iterator> const_reverse_iterator;
+
+    rbtree() noexcept : size_(0) { TB_INIT(&head_); }
+
+    rbtree(rbtree &&other) noexcept : head_(other.head_), size_(other.size_) {
+        TB_INIT(&other.head_);
+        other.size_ = 0;
+    }
+
+    rbtree &operator=(rbtree &&other) noexcept {
+        swap(other);
+        return *this;
+    }
+
+    rbtree(const rbtree &) = delete;
+    rbtree &operator=(const rbtree &) = delete;
+
+    bool empty() const noexcept { return TB_EMPTY(&head_); }
+    size_type size() const noexcept { return size_; }
+
+    iterator begin() noexcept { return make(TB_FIRST(tb_tree, &head_)); }
+    const_iterator begin() const noexcept { return make(TB_FIRST(tb_tree, head())); }
+    const_iterator cbegin() const noexcept { return begin(); }
+    iterator end() noexcept { return make(nullptr); }
+    const_iterator end() const noexcept { return make(nullptr); }
+    const_iterator cend() const noexcept { return end(); }
+
+    reverse_iterator rbegin() noexcept { return reverse_iterator(end()); }
+    const_reverse_iterator rbegin() const noexcept { return const_reverse_iterator(end()); }
+    reverse_iterator rend() noexcept { return reverse_iterator(begin()); }
+    const_reverse_iterator rend() const noexcept { return const_reverse_iterator(begin()); }
+
+    T &front() noexcept { return *begin(); }
+    T &back() noexcept { return *node_of(TB_LAST(tb_tree, &head_)); }
+
+    /* Links `elm` unless an equal node is already linked, which is
+     * returned instead. */
+    std::pair<iterator, bool> insert(T &elm) {
+        hook *tmp = TB_INSERT(tb_tree, &head_, hook_of(elm));
+        if (tmp)
+            return std::make_pair(make(tmp), false);
+        ++size_;
+        return std::make_pair(make(hook_of(elm)), true);
+    }
+
+    /* Unlinks `pos` and returns the node after it. */
+    iterator erase(const_iterator pos) noexcept {
+        hook *next = TB_NEXT(tb_tree, pos.elm_);
+        TB_REMOVE(tb_tree, &head_, pos.elm_);
+        --size_;
+        return make(next);
+    }
+
+    iterator erase(const_iterator first, const_iterator last) noexcept {
+        while (first != last)
+            first = erase(first);
+        return make(last.elm_);
+    }
+
+    size_type erase(const T &key) {
+        const_iterator it = find(key);
+        if (it == end())
+            return 0;
+        erase(it);
+        return 1;
+    }
+
+    /* Forgets all nodes in O(1), leaving their hooks stale. */
+    void clear() noexcept {
+        TB_INIT(&head_);
+        size_ = 0;
+    }
+
+    void swap(rbtree &other) noexcept {
+        std::swap(head_, other.head_);
+        std::swap(size_, other.size_);
+    }
+
+    iterator find(const T &key) { return make(TB_FIND(tb_tree, &head_, hook_of(key))); }
+    const_iterator find(const T &key) const { return make(TB_FIND(tb_tree, head(), hook_of(key))); }
+
+    size_type count(const T &key) const { return find(key) != end(); }
+    bool contains(const T &key) const { return find(key) != end(); }
+
+    iterator lower_bound(const T &key) { return make(TB_NFIND(tb_tree, &head_, hook_of(key))); }
+
+    const_iterator lower_bound(const T &key) const {
+        return make(TB_NFIND(tb_tree, head(), hook_of(key)));
+    }
+
+    iterator upper_bound(const T &key) { return make(upper(key)); }
+    const_iterator upper_bound(const T &key) const { return make(upper(key)); }
+
+    std::pair<iterator, iterator> equal_range(const T &key) {
+        iterator it = lower_bound(key);
+        if (it != end() && !Compare()(key, *it))
+            return std::make_pair(it, std::next(it));
+        return std::make_pair(it, it);
+    }
+
+    std::pair<const_iterator, const_iterator> equal_range(const T &key) const {
+        const_iterator it = lower_bound(key);
+        if (it != end() && !Compare()(key, *it))
+            return std::make_pair(it, std::next(it));
+        return std::make_pair(it, it);
+    }
+
+    /* The iterator of a linked node. */
+    iterator iterator_to(T &elm) noexcept { return make(hook_of(elm)); }
+    const_iterator iterator_to(const T &elm) const noexcept { return make(hook_of(elm)); }
+
+    /* Rebuilds the tree into a complete one in O(n). */
+    void rebalance() noexcept { TB_REBALANCE(tb_tree, &head_); }
+
+private:
+    hook *upper(const T &key) const {
+        return tb_tree_TB_RANGE_FIRST(head(), hook_of(key), nullptr, TB_LOPEN);
+    }
+};
+
+template <typename T, typename Tag, typename Compare>
+void swap(rbtree<T, Tag, Compare> &a, rbtree<T, Tag, Compare> &b) noexcept
+{
+    a.swap(b);
+}
+
+} // namespace tb
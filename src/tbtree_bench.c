@@ -0,0 +1,527 @@
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+
+#include "tbtree.h"
+#include "tbtree_pool.h"
+
+#if defined(TBTREE_BENCH_SYS_TREE)
+#include <sys/tree.h>
+#elif defined(TBTREE_BENCH_BSD_TREE)
+#include <bsd/sys/tree.h>
+#endif
+
+// Usage: tbtree_bench [max nodes]
+//
+// Runs every tree over every key distribution for the sizes from 1K up to
+// `max nodes` (1M by default, 100M at most) in steps of ten and prints
+// ns/op and Mop/s for each operation. The distributions set the order of
+// the inserted, removed and reinserted keys and of the lookups, except for
+// zipf, which inserts and removes in random order and skews the lookups
+// towards a few hot keys. The unbalanced tree inserts sorted keys next to
+// the previous one with TB_INSERT_HINT and then runs TB_REBALANCE, as its
+// plain inserts would degrade into a list. The frozen lines look the keys up
+// in a TB_FREEZE snapshot. The nscan lines gather the nodes BENCH_BATCH at
+// a time with TB_NEXT_N. The pscan lines walk the tree in BENCH_RUNS runs
+// of TB_PARTITION with TB_PARALLEL_FOREACH, which spreads them over the
+// OpenMP threads when built with it. The splay tree (tb_sp) is best compared
+// on the skewed zipf lookups. The malloc and pool lines allocate the nodes
+// of a red-black tree from malloc or a tbtree_pool, replace each of them
+// (churn) and free them all (release). The sharded tree (tb_sh) inserts,
+// looks up and removes the keys in BENCH_RUNS runs spread over the OpenMP
+// threads, so its lines show how the updates scale with OMP_NUM_THREADS.
+
+struct bnode {
+    TB_ENTRY(bnode) entry;
+    uint64_t key;
+};
+
+static inline int bnode_cmp(const struct bnode *a, const struct bnode *b)
+{
+    return (a->key > b->key) - (a->key < b->key);
+}
+
+TB_HEAD(btree, bnode);
+TB_GENERATE_STATIC(btree, bnode, entry, bnode_cmp)
+
+TB_HEAD(rbtree, bnode);
+TB_GENERATE_RB_STATIC(rbtree, bnode, entry, bnode_cmp)
+
+TB_HEAD_SG(sgtree, bnode);
+TB_GENERATE_SG_STATIC(sgtree, bnode, entry, bnode_cmp)
+
+TB_HEAD(sptree, bnode);
+TB_GENERATE_SPLAY_STATIC(sptree, bnode, entry, bnode_cmp)
+
+#if defined(TBTREE_BENCH_SYS_TREE) || defined(TBTREE_BENCH_BSD_TREE)
+struct snode {
+    RB_ENTRY(snode) entry;
+    uint64_t key;
+};
+
+static int snode_cmp(struct snode *a, struct snode *b)
+{
+    return (a->key > b->key) - (a->key < b->key);
+}
+
+RB_HEAD(systree, snode);
+RB_GENERATE_STATIC(systree, snode, entry, snode_cmp)
+#endif
+
+struct workload {
+    const char *dist;
+    size_t n;
+    int sorted;
+    size_t *order;
+    size_t *queries;
+};
+
+static volatile size_t bench_sink;
+
+static uint64_t rng_state = 0x9e3779b97f4a7c15u;
+
+static uint64_t rng_next(void)
+{
+    rng_state ^= rng_state >> 12;
+    rng_state ^= rng_state << 25;
+    rng_state ^= rng_state >> 27;
+    return rng_state * 0x2545f4914f6cdd1du;
+}
+
+static double rng_unit(void)
+{
+    return (double)(rng_next() >> 11) * (1.0 / 9007199254740992.0);
+}
+
+static double now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec * 1e9 + (double)ts.tv_nsec;
+}
+
+static void report(const char *tree, const struct workload *w, const char *op,
+                   size_t ops, double ns)
+{
+    printf("%-6s %-7s %10zu  %-9s %9.2f ns/op %9.2f Mop/s\n",
+           tree, w->dist, w->n, op, ns / (double)ops, (double)ops * 1e3 / ns);
+}
+
+static void shuffle(size_t *a, size_t n)
+{
+    for (size_t i = n; i > 1; --i) {
+        size_t j = (size_t)(rng_next() % i);
+        size_t tmp = a[i - 1];
+        a[i - 1] = a[j];
+        a[j] = tmp;
+    }
+}
+
+// Zipfian ranks with theta 0.99 as in YCSB (Gray et al., "Quickly generating
+// billion-record synthetic databases"), mapped to keys through `perm` so that
+// the hot keys are spread over the tree.
+static void zipf_fill(size_t *out, size_t n, const size_t *perm)
+{
+    const double theta = 0.99;
+    double zetan = 0, zeta2 = 1 + pow(0.5, theta);
+
+    for (size_t i = 1; i <= n; ++i)
+        zetan += 1 / pow((double)i, theta);
+
+    double alpha = 1 / (1 - theta);
+    double eta = (1 - pow(2.0 / (double)n, 1 - theta)) / (1 - zeta2 / zetan);
+
+    for (size_t i = 0; i < n; ++i) {
+        double u = rng_unit(), uz = u * zetan;
+        size_t rank;
+        if (uz < 1)
+            rank = 0;
+        else if (uz < zeta2)
+            rank = 1;
+        else
+            rank = (size_t)((double)n * pow(eta * u - eta + 1, alpha));
+        out[i] = perm[rank < n ? rank : n - 1];
+    }
+}
+
+#define BENCH_RUNS 64
+#define BENCH_BATCH 64
+
+// Keys are even while scanned, so the sink is never written concurrently.
+static void bench_visit(struct bnode *elm, void *arg)
+{
+    if (elm->key & 1)
+        __atomic_add_fetch((size_t *)arg, 1, __ATOMIC_RELAXED);
+}
+
+// The new key of node `j` on reinsert: a distinct odd key at a scattered
+// position, since 7919 is prime to the powers of ten.
+#define BENCH_MOVED(j, n) \
+    (2 * (((uint64_t)(j) * 7919 + (n) / 2) % (n)) + 1)
+
+#define BENCH_INSERT(name, head, prev, elm) \
+    ((void)(prev), TB_INSERT(name, head, elm))
+
+#define BENCH_INSERT_SORTED(name, head, prev, elm) \
+    (w->sorted ? TB_INSERT_HINT(name, head, prev, elm) : TB_INSERT(name, head, elm))
+
+// Runs the operations over a tree generated as `name`, which starts from
+// the head initializer `init`, inserts with `insert` and is rebalanced after
+// sorted inserts if `rebalance` is set.
+#define BENCH_TB(name, init, insert, rebalance) \
+    static void bench_##name(const char *label, const struct workload *w) \
+    { \
+        struct name head = init; \
+        struct bnode *nodes, *elm, *prev = NULL, **frozen, key; \
+        struct bnode *runs[BENCH_RUNS + 1], *batch[BENCH_BATCH]; \
+        size_t n = w->n, hits = 0, sink = 0; \
+        double t; \
+        \
+        nodes = (struct bnode *)calloc(n, sizeof(*nodes)); \
+        if (!nodes) { \
+            perror("calloc"); \
+            exit(EXIT_FAILURE); \
+        } \
+        for (size_t i = 0; i < n; ++i) \
+            nodes[i].key = 2 * (uint64_t)i; \
+        \
+        t = now(); \
+        for (size_t i = 0; i < n; ++i) { \
+            elm = &nodes[w->order[i]]; \
+            insert(name, &head, prev, elm); \
+            prev = elm; \
+        } \
+        report(label, w, "insert", n, now() - t); \
+        \
+        if ((rebalance) && w->sorted) { \
+            t = now(); \
+            TB_REBALANCE(name, &head); \
+            report(label, w, "rebalance", n, now() - t); \
+        } \
+        \
+        t = now(); \
+        for (size_t i = 0; i < n; ++i) { \
+            key.key = 2 * (uint64_t)w->queries[i]; \
+            hits += TB_FIND(name, &head, &key) != NULL; \
+        } \
+        report(label, w, "find", n, now() - t); \
+        \
+        t = now(); \
+        for (size_t i = 0; i < n; ++i) { \
+            key.key = 2 * (uint64_t)w->queries[i] + 1; \
+            sink += TB_NFIND(name, &head, &key) != NULL; \
+        } \
+        report(label, w, "nfind", n, now() - t); \
+        \
+        frozen = (struct bnode **)malloc((n + 1) * sizeof(*frozen)); \
+        if (!frozen) { \
+            perror("malloc"); \
+            exit(EXIT_FAILURE); \
+        } \
+        t = now(); \
+        TB_FREEZE(name, &head, frozen, n + 1); \
+        report(label, w, "freeze", n, now() - t); \
+        \
+        t = now(); \
+        for (size_t i = 0; i < n; ++i) { \
+            key.key = 2 * (uint64_t)w->queries[i]; \
+            sink += TB_FROZEN_FIND(name, frozen, n, &key) != NULL; \
+        } \
+        report(label, w, "frozen", n, now() - t); \
+        free(frozen); \
+        \
+        t = now(); \
+        TB_FOREACH(elm, name, &head) \
+            sink += elm->key & 1; \
+        report(label, w, "iterate", n, now() - t); \
+        \
+        t = now(); \
+        elm = TB_FIRST(name, &head); \
+        for (size_t k; (k = TB_NEXT_N(name, &elm, batch, BENCH_BATCH)) > 0;) \
+            for (size_t i = 0; i < k; ++i) \
+                sink += batch[i]->key & 1; \
+        report(label, w, "nscan", n, now() - t); \
+        \
+        t = now(); \
+        TB_PARALLEL_FOREACH(name, runs, TB_PARTITION(name, &head, BENCH_RUNS, runs), \
+                            bench_visit, &sink); \
+        report(label, w, "pscan", n, now() - t); \
+        \
+        t = now(); \
+        for (size_t i = 0; i < n; ++i) { \
+            size_t j = w->order[i]; \
+            nodes[j].key = BENCH_MOVED(j, n); \
+            TB_REINSERT(name, &head, &nodes[j]); \
+        } \
+        report(label, w, "reinsert", n, now() - t); \
+        \
+        t = now(); \
+        for (size_t i = 0; i < n; ++i) \
+            TB_REMOVE(name, &head, &nodes[w->order[i]]); \
+        report(label, w, "remove", n, now() - t); \
+        \
+        if (hits != n) \
+            fprintf(stderr, "%s: %zu of %zu keys found\n", label, hits, n); \
+        bench_sink = sink; \
+        free(nodes); \
+    }
+
+BENCH_TB(btree, TB_HEAD_INITIALIZER(head), BENCH_INSERT_SORTED, 1)
+BENCH_TB(rbtree, TB_HEAD_INITIALIZER(head), BENCH_INSERT, 0)
+BENCH_TB(sgtree, TB_HEAD_SG_INITIALIZER(head), BENCH_INSERT, 0)
+BENCH_TB(sptree, TB_HEAD_INITIALIZER(head), BENCH_INSERT, 0)
+
+TB_GENERATE_POOL_STATIC(rbtree, bnode, entry)
+
+#define BENCH_SLAB 4096
+
+// Allocates every node of a red-black tree from malloc or from a pool when
+// `pool` is set, replaces them all and frees the tree.
+static void bench_alloc(const char *label, const struct workload *w, int pool)
+{
+    struct rbtree head = TB_HEAD_INITIALIZER(head);
+    struct tb_pool nodes = TB_POOL_INITIALIZER(BENCH_SLAB);
+    struct bnode *elm, *tmp, **live;
+    size_t n = w->n;
+    double t;
+
+    live = (struct bnode **)malloc(n * sizeof(*live));
+    if (!live) {
+        perror("malloc");
+        exit(EXIT_FAILURE);
+    }
+
+#define BENCH_NEW() \
+    (pool ? TB_POOL_ALLOC(rbtree, &nodes) : (struct bnode *)malloc(sizeof(struct bnode)))
+#define BENCH_DELETE(elm) \
+    (pool ? TB_POOL_FREE(rbtree, &nodes, elm) : free(elm))
+
+    t = now();
+    for (size_t i = 0; i < n; ++i) {
+        if (!(elm = BENCH_NEW())) {
+            perror("malloc");
+            exit(EXIT_FAILURE);
+        }
+        elm->key = 2 * (uint64_t)w->order[i];
+        TB_INSERT(rbtree, &head, elm);
+        live[w->order[i]] = elm;
+    }
+    report(label, w, "insert", n, now() - t);
+
+    t = now();
+    for (size_t i = 0; i < n; ++i) {
+        size_t j = w->order[i];
+        TB_REMOVE(rbtree, &head, live[j]);
+        BENCH_DELETE(live[j]);
+        if (!(elm = BENCH_NEW())) {
+            perror("malloc");
+            exit(EXIT_FAILURE);
+        }
+        elm->key = BENCH_MOVED(j, n);
+        TB_INSERT(rbtree, &head, elm);
+        live[j] = elm;
+    }
+    report(label, w, "churn", n, now() - t);
+
+    t = now();
+    if (pool) {
+        tb_pool_release(&nodes);
+    } else {
+        TB_FOREACH_SAFE(elm, rbtree, &head, tmp)
+            free(elm);
+    }
+    TB_INIT(&head);
+    report(label, w, "release", n, now() - t);
+
+#undef BENCH_NEW
+#undef BENCH_DELETE
+
+    free(live);
+}
+
+static void bench_spin_init(int *lock)
+{
+    *lock = 0;
+}
+
+static void bench_spin_lock(int *lock)
+{
+    while (__atomic_exchange_n(lock, 1, __ATOMIC_ACQUIRE))
+        while (__atomic_load_n(lock, __ATOMIC_RELAXED))
+            ;
+}
+
+static void bench_spin_unlock(int *lock)
+{
+    __atomic_store_n(lock, 0, __ATOMIC_RELEASE);
+}
+
+#define BENCH_SHARDS 16
+
+TB_HEAD_SHARDED(shtree, rbtree, bnode, int, BENCH_SHARDS);
+TB_GENERATE_SHARDED_STATIC(shtree, rbtree, bnode, entry, bnode_cmp,
+                           bench_spin_lock, bench_spin_unlock)
+
+// Runs `body` for the `i` of every run of BENCH_RUNS over the `n` keys.
+#define BENCH_PARALLEL(n, body) do { \
+        __tbtree_parallel_for \
+        for (size_t r = 0; r < BENCH_RUNS; ++r) \
+            for (size_t i = r * (n) / BENCH_RUNS; i < (r + 1) * (n) / BENCH_RUNS; ++i) \
+                body; \
+    } while (0)
+
+static void bench_sharded(const char *label, const struct workload *w)
+{
+    struct shtree head;
+    struct bnode *nodes;
+    size_t n = w->n, hits = 0;
+    double t;
+
+    nodes = (struct bnode *)calloc(n, sizeof(*nodes));
+    if (!nodes) {
+        perror("calloc");
+        exit(EXIT_FAILURE);
+    }
+    for (size_t i = 0; i < n; ++i)
+        nodes[i].key = 2 * (uint64_t)i;
+    TB_INIT_SHARDED(&head, bench_spin_init);
+
+    t = now();
+    BENCH_PARALLEL(n, TB_INSERT(shtree, &head, &nodes[w->order[i]]));
+    report(label, w, "insert", n, now() - t);
+
+    t = now();
+    BENCH_PARALLEL(n, {
+        struct bnode key;
+        key.key = 2 * (uint64_t)w->queries[i];
+        if (TB_FIND(shtree, &head, &key))
+            __atomic_add_fetch(&hits, 1, __ATOMIC_RELAXED);
+    });
+    report(label, w, "find", n, now() - t);
+
+    t = now();
+    BENCH_PARALLEL(n, TB_REMOVE(shtree, &head, &nodes[w->order[i]]));
+    report(label, w, "remove", n, now() - t);
+
+    if (hits != n)
+        fprintf(stderr, "%s: %zu of %zu keys found\n", label, hits, n);
+    free(nodes);
+}
+
+#if defined(TBTREE_BENCH_SYS_TREE) || defined(TBTREE_BENCH_BSD_TREE)
+static void bench_systree(const char *label, const struct workload *w)
+{
+    struct systree head = RB_INITIALIZER(&head);
+    struct snode *nodes, *elm, key;
+    size_t n = w->n, hits = 0, sink = 0;
+    double t;
+
+    nodes = (struct snode *)calloc(n, sizeof(*nodes));
+    if (!nodes) {
+        perror("calloc");
+        exit(EXIT_FAILURE);
+    }
+    for (size_t i = 0; i < n; ++i)
+        nodes[i].key = 2 * (uint64_t)i;
+
+    t = now();
+    for (size_t i = 0; i < n; ++i)
+        RB_INSERT(systree, &head, &nodes[w->order[i]]);
+    report(label, w, "insert", n, now() - t);
+
+    t = now();
+    for (size_t i = 0; i < n; ++i) {
+        key.key = 2 * (uint64_t)w->queries[i];
+        hits += RB_FIND(systree, &head, &key) != NULL;
+    }
+    report(label, w, "find", n, now() - t);
+
+    t = now();
+    for (size_t i = 0; i < n; ++i) {
+        key.key = 2 * (uint64_t)w->queries[i] + 1;
+        sink += RB_NFIND(systree, &head, &key) != NULL;
+    }
+    report(label, w, "nfind", n, now() - t);
+
+    t = now();
+    RB_FOREACH(elm, systree, &head)
+        sink += elm->key & 1;
+    report(label, w, "iterate", n, now() - t);
+
+    t = now();
+    for (size_t i = 0; i < n; ++i) {
+        size_t j = w->order[i];
+        RB_REMOVE(systree, &head, &nodes[j]);
+        nodes[j].key = BENCH_MOVED(j, n);
+        RB_INSERT(systree, &head, &nodes[j]);
+    }
+    report(label, w, "reinsert", n, now() - t);
+
+    t = now();
+    for (size_t i = 0; i < n; ++i)
+        RB_REMOVE(systree, &head, &nodes[w->order[i]]);
+    report(label, w, "remove", n, now() - t);
+
+    if (hits != n)
+        fprintf(stderr, "%s: %zu of %zu keys found\n", label, hits, n);
+    bench_sink = sink;
+    free(nodes);
+}
+#endif
+
+int main(int argc, char **argv)
+{
+    static const char *const dists[] = { "seq", "reverse", "random", "zipf" };
+    size_t max = 1000000;
+
+    if (argc > 1) {
+        char *end;
+        unsigned long long arg = strtoull(argv[1], &end, 10);
+        if (*end || arg < 1000 || arg > 100000000) {
+            fprintf(stderr, "usage: %s [max nodes, 1000 to 100000000]\n", argv[0]);
+            return EXIT_FAILURE;
+        }
+        max = (size_t)arg;
+    }
+
+    for (size_t n = 1000; n <= max; n *= 10) {
+        size_t *order = (size_t *)malloc(n * sizeof(*order));
+        size_t *queries = (size_t *)malloc(n * sizeof(*queries));
+        if (!order || !queries) {
+            perror("malloc");
+            return EXIT_FAILURE;
+        }
+
+        for (size_t d = 0; d < sizeof(dists) / sizeof(dists[0]); ++d) {
+            struct workload w = { dists[d], n, d < 2, order, queries };
+
+            for (size_t i = 0; i < n; ++i)
+                order[i] = d == 1 ? n - 1 - i : i;
+            if (d >= 2)
+                shuffle(order, n);
+            if (d == 3)
+                zipf_fill(queries, n, order);
+            else
+                memcpy(queries, order, n * sizeof(*queries));
+
+            bench_btree("tb", &w);
+            bench_rbtree("tb_rb", &w);
+            bench_sgtree("tb_sg", &w);
+            bench_sptree("tb_sp", &w);
+            bench_alloc("malloc", &w, 0);
+            bench_alloc("pool", &w, 1);
+            bench_sharded("tb_sh", &w);
+#if defined(TBTREE_BENCH_SYS_TREE) || defined(TBTREE_BENCH_BSD_TREE)
+            bench_systree("sys_rb", &w);
+#endif
+        }
+
+        free(order);
+        free(queries);
+    }
+
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,147 @@
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <set>
+#include <utility>
+#include <vector>
+
+#include "tbtree.hpp"
+
+// Usage: tbtree_hpp_bench [max nodes]
+//
+// Compares tb::rbtree with std::set over random keys for the sizes from 1K
+// up to `max nodes` (1M by default, 100M at most) in steps of ten, in the
+// format of tbtree_bench. The std::set lines include the allocation of
+// every node, which the intrusive tree leaves to its caller. Both remove the
+// keys by value.
+
+struct bnode : tb::base_hook<> {
+    std::uint64_t key;
+
+    bool operator<(const bnode &other) const { return key < other.key; }
+};
+
+static volatile std::size_t bench_sink;
+
+static std::uint64_t rng_state = 0x9e3779b97f4a7c15u;
+
+static std::uint64_t rng_next()
+{
+    rng_state ^= rng_state >> 12;
+    rng_state ^= rng_state << 25;
+    rng_state ^= rng_state >> 27;
+    return rng_state * 0x2545f4914f6cdd1du;
+}
+
+static double now()
+{
+    return std::chrono::duration<double, std::nano>(
+               std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+static void report(const char *tree, std::size_t n, const char *op, double ns)
+{
+    std::printf("%-6s %-7s %10zu  %-9s %9.2f ns/op %9.2f Mop/s\n",
+                tree, "random", n, op, ns / (double)n, (double)n * 1e3 / ns);
+}
+
+static void bench_rbtree(const std::vector<std::size_t> &order)
+{
+    std::size_t n = order.size(), hits = 0, sink = 0;
+    std::vector<bnode> nodes(n);
+    tb::rbtree<bnode> tree;
+    bnode key;
+    double t;
+
+    for (std::size_t i = 0; i < n; ++i)
+        nodes[i].key = 2 * (std::uint64_t)i;
+
+    t = now();
+    for (std::size_t i = 0; i < n; ++i)
+        tree.insert(nodes[order[i]]);
+    report("tb_hpp", n, "insert", now() - t);
+
+    t = now();
+    for (std::size_t i = 0; i < n; ++i) {
+        key.key = 2 * (std::uint64_t)order[n - 1 - i];
+        hits += tree.find(key) != tree.end();
+    }
+    report("tb_hpp", n, "find", now() - t);
+
+    t = now();
+    for (const bnode &elm : tree)
+        sink += elm.key & 1;
+    report("tb_hpp", n, "iterate", now() - t);
+
+    t = now();
+    for (std::size_t i = 0; i < n; ++i) {
+        key.key = 2 * (std::uint64_t)order[i];
+        tree.erase(key);
+    }
+    report("tb_hpp", n, "remove", now() - t);
+
+    if (hits != n)
+        std::fprintf(stderr, "tb_hpp: %zu of %zu keys found\n", hits, n);
+    bench_sink = sink;
+}
+
+static void bench_set(const std::vector<std::size_t> &order)
+{
+    std::size_t n = order.size(), hits = 0, sink = 0;
+    std::set<std::uint64_t> tree;
+    double t;
+
+    t = now();
+    for (std::size_t i = 0; i < n; ++i)
+        tree.insert(2 * (std::uint64_t)order[i]);
+    report("stdset", n, "insert", now() - t);
+
+    t = now();
+    for (std::size_t i = 0; i < n; ++i)
+        hits += tree.find(2 * (std::uint64_t)order[n - 1 - i]) != tree.end();
+    report("stdset", n, "find", now() - t);
+
+    t = now();
+    for (std::uint64_t key : tree)
+        sink += key & 1;
+    report("stdset", n, "iterate", now() - t);
+
+    t = now();
+    for (std::size_t i = 0; i < n; ++i)
+        tree.erase(2 * (std::uint64_t)order[i]);
+    report("stdset", n, "remove", now() - t);
+
+    if (hits != n)
+        std::fprintf(stderr, "stdset: %zu of %zu keys found\n", hits, n);
+    bench_sink = sink;
+}
+
+int main(int argc, char **argv)
+{
+    std::size_t max = 1000000;
+
+    if (argc > 1) {
+        char *end;
+        unsigned long long arg = std::strtoull(argv[1], &end, 10);
+        if (*end || arg < 1000 || arg > 100000000) {
+            std::fprintf(stderr, "usage: %s [max nodes, 1000 to 100000000]\n", argv[0]);
+            return EXIT_FAILURE;
+        }
+        max = (std::size_t)arg;
+    }
+
+    for (std::size_t n = 1000; n <= max; n *= 10) {
+        std::vector<std::size_t> order(n);
+
+        for (std::size_t i = 0; i < n; ++i)
+            order[i] = i;
+        for (std::size_t i = n; i > 1; --i)
+            std::swap(order[i - 1], order[(std::size_t)(rng_next() % i)]);
+
+        bench_rbtree(order);
+        bench_set(order);
+    }
+
+    return EXIT_SUCCESS;
+}
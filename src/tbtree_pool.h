@@ -0,0 +1,154 @@
+#pragma once
+
+/* Optional node pool of TBTREE: hands out fixed-size nodes carved from
+ * large slabs instead of one allocation per node.
+ *
+ * A freed node is linked into the free list through its own TB_ENTRY, so
+ * the pool costs no memory per node. Nodes are carved in address order and
+ * the pool rewinds to its first slab once all of them are freed, so that
+ * trees filled again stay laid out in order. A whole tree is discarded with
+ * tb_pool_clear() in O(1), keeping the slabs, or tb_pool_release() in
+ * O(slabs), instead of freeing its nodes one by one:
+ *
+ *     struct tb_pool pool = TB_POOL_INITIALIZER(4096);
+ *     struct node *elm = TB_POOL_ALLOC(tree, &pool);
+ *     ...
+ *     TB_INIT(&head);
+ *     tb_pool_release(&pool);
+ *
+ * The pools serve the families of TB_ENTRY and its pointer variants. They
+ * are not thread safe, and under TBTREE_RCU a removed node may only be
+ * freed into the pool once it is safe to reuse (see `struct tb_epoch`). */
+
+#include <stdlib.h>
+
+#include "tbtree.h"
+
+#ifndef __tbtree_malloc
+#   define __tbtree_malloc(size) malloc(size)
+#endif
+
+#ifndef __tbtree_free
+#   define __tbtree_free(ptr) free(ptr)
+#endif
+
+/* The slab header, aligned as malloc so that the nodes after it are. */
+union tb_slab {
+    union tb_slab *tb_next;
+    max_align_t tb_align;
+};
+
+struct tb_pool {
+    union tb_slab *tb_slabs;    /* oldest first */
+    union tb_slab *tb_slab;     /* the slab being carved */
+    void *tb_free;              /* freed nodes, linked by their right thread */
+    size_t tb_carved;           /* nodes carved out of `tb_slab` */
+    size_t tb_nodes;            /* nodes per slab */
+    size_t tb_count;            /* nodes in use */
+};
+
+#define TB_POOL_INITIALIZER(nodes) \
+    { NULL, NULL, NULL, 0, (nodes), 0 }
+
+/* `nodes` per slab must not be zero. */
+__tbtree_unused static inline void tb_pool_init(struct tb_pool *pool, size_t nodes)
+{
+    pool->tb_slabs = NULL;
+    pool->tb_slab = NULL;
+    pool->tb_free = NULL;
+    pool->tb_carved = 0;
+    pool->tb_nodes = nodes;
+    pool->tb_count = 0;
+}
+
+/* Frees all nodes at once and keeps the slabs for the next ones. */
+__tbtree_unused static inline void tb_pool_clear(struct tb_pool *pool)
+{
+    pool->tb_slab = pool->tb_slabs;
+    pool->tb_free = NULL;
+    pool->tb_carved = 0;
+    pool->tb_count = 0;
+}
+
+/* Frees all nodes at once and returns the slabs to the system. */
+__tbtree_unused static inline void tb_pool_release(struct tb_pool *pool)
+{
+    union tb_slab *slab = pool->tb_slabs;
+
+    while (slab) {
+        union tb_slab *next = slab->tb_next;
+        __tbtree_free(slab);
+        slab = next;
+    }
+    tb_pool_init(pool, pool->tb_nodes);
+}
+
+/* Returns the next node of `size` bytes of the current slab, moving to the
+ * next slab or allocating one when it is used up, or NULL when out of
+ * memory. */
+__tbtree_unused static inline void *tb_pool_carve(struct tb_pool *pool, size_t size)
+{
+    if (!pool->tb_slab || pool->tb_carved == pool->tb_nodes) {
+        union tb_slab *slab = pool->tb_slab ? pool->tb_slab->tb_next : pool->tb_slabs;
+        if (!slab) {
+            if (pool->tb_nodes > (SIZE_MAX - sizeof(*slab)) / size)
+                return NULL;
+            slab = (union tb_slab *)__tbtree_malloc(sizeof(*slab) + pool->tb_nodes * size);
+            if (!slab)
+                return NULL;
+            slab->tb_next = NULL;
+            if (pool->tb_slab)
+                pool->tb_slab->tb_next = slab;
+            else
+                pool->tb_slabs = slab;
+        }
+        pool->tb_slab = slab;
+        pool->tb_carved = 0;
+    }
+    return (char *)(pool->tb_slab + 1) + size * pool->tb_carved++;
+}
+
+#define TB_PROTOTYPE_POOL(name, type, field) \
+    TB_PROTOTYPE_POOL_INTERNAL(name, type, field,)
+
+#define TB_PROTOTYPE_POOL_STATIC(name, type, field) \
+    TB_PROTOTYPE_POOL_INTERNAL(name, type, field, __tbtree_unused static)
+
+#define TB_PROTOTYPE_POOL_INTERNAL(name, type, field, attr) \
+    attr struct type *name##_TB_POOL_ALLOC(struct tb_pool *); \
+    attr void name##_TB_POOL_FREE(struct tb_pool *, struct type *)
+
+#define TB_GENERATE_POOL(name, type, field) \
+    TB_GENERATE_POOL_INTERNAL(name, type, field,)
+
+#define TB_GENERATE_POOL_STATIC(name, type, field) \
+    TB_GENERATE_POOL_INTERNAL(name, type, field, __tbtree_unused static)
+
+/* TB_POOL_ALLOC returns an uninitialized node, or NULL when out of memory.
+ * Freed nodes are reused first, and freeing the last node in use rewinds
+ * the pool. The slabs only align the nodes as malloc does, so over-aligned
+ * node types are rejected. */
+#define TB_GENERATE_POOL_INTERNAL(name, type, field, attr) \
+    attr struct type *name##_TB_POOL_ALLOC(struct tb_pool *pool) { \
+        struct type *elm = (struct type *)pool->tb_free; \
+        __tbtree_static_assert(__tbtree_alignof(struct type) <= __tbtree_alignof(max_align_t), \
+                               "pool nodes must not be aligned beyond max_align_t"); \
+        if (elm) \
+            pool->tb_free = elm->field.tb_right; \
+        else if (!(elm = (struct type *)tb_pool_carve(pool, sizeof(*elm)))) \
+            return NULL; \
+        ++pool->tb_count; \
+        return elm; \
+    } \
+    \
+    attr void name##_TB_POOL_FREE(struct tb_pool *pool, struct type *elm) { \
+        if (--pool->tb_count == 0) { \
+            tb_pool_clear(pool); \
+            return; \
+        } \
+        elm->field.tb_right = (struct type *)pool->tb_free; \
+        pool->tb_free = elm; \
+    }
+
+#define TB_POOL_ALLOC(name, ...)    name##_TB_POOL_ALLOC(__VA_ARGS__)
+#define TB_POOL_FREE(name, ...)     name##_TB_POOL_FREE(__VA_ARGS__)
@@ -4,7 +4,12 @@
 #include <string.h>
 #include <stdbool.h>
 
+#ifdef TBTREE_RCU
+#include <pthread.h>
+#endif
+
 #include "tbtree.h"
+#include "tbtree_pool.h"
 
 #define TEST(func) static void func(const char *__unit)
 
@@ -54,6 +59,74 @@ static inline int node_cmp(const struct node *a, const struct node *b)
 TB_HEAD(tree, node);
 TB_GENERATE_STATIC(tree, node, entry, node_cmp)
 
+TB_HEAD(rbtree, node);
+TB_GENERATE_RB_STATIC(rbtree, node, entry, node_cmp)
+
+TB_HEAD_SG(sgtree, node);
+TB_GENERATE_SG_STATIC(sgtree, node, entry, node_cmp)
+
+// Validates parent links, threads, ordering and (optionally) red-black
+// invariants of the subtree at `elm` bounded by `prev` and `next`.
+static size_t check_subtree(const char *__unit, struct node *elm,
+                            struct node *parent, struct node *prev,
+                            struct node *next, bool rb, int *height)
+{
+    size_t count = 1;
+    int lheight = 1, rheight = 1;
+
+    assert_equal(TB_PARENT(elm, entry), parent);
+    if (prev)
+        assert_true(prev->value < elm->value);
+    if (next)
+        assert_true(elm->value < next->value);
+
+    if (TB_LLEAF(elm, entry)) {
+        assert_equal(TB_LEFT(elm, entry), prev);
+    } else {
+        struct node *child = TB_LEFT(elm, entry);
+        if (rb && TB_IS_RED(elm, entry))
+            assert_true(TB_IS_BLACK(child, entry));
+        count += check_subtree(__unit, child, elm, prev, elm, rb, &lheight);
+    }
+
+    if (TB_RLEAF(elm, entry)) {
+        assert_equal(TB_RIGHT(elm, entry), next);
+    } else {
+        struct node *child = TB_RIGHT(elm, entry);
+        if (rb && TB_IS_RED(elm, entry))
+            assert_true(TB_IS_BLACK(child, entry));
+        count += check_subtree(__unit, child, elm, elm, next, rb, &rheight);
+    }
+
+    if (rb) {
+        assert_equal(lheight, rheight);
+        *height = lheight + TB_IS_BLACK(elm, entry);
+    } else {
+        *height = 1 + (lheight > rheight ? lheight : rheight);
+    }
+    return count;
+}
+
+static int tree_height(struct node *elm)
+{
+    if (!elm)
+        return 0;
+
+    int lheight = TB_LLEAF(elm, entry) ? 0 : tree_height(TB_LEFT(elm, entry));
+    int rheight = TB_RLEAF(elm, entry) ? 0 : tree_height(TB_RIGHT(elm, entry));
+    return 1 + (lheight > rheight ? lheight : rheight);
+}
+
+static size_t check_tree(const char *__unit, struct node *root, bool rb)
+{
+    int height = 0;
+    if (!root)
+        return 0;
+    if (rb)
+        assert_true(TB_IS_BLACK(root, entry));
+    return check_subtree(__unit, root, NULL, NULL, NULL, rb, &height);
+}
+
 TEST(test_tbtree_init)
 {
     struct tree tree = TB_HEAD_INITIALIZER(tree);
@@ -321,6 +394,2266 @@ TEST(test_tbtree_remove_first)
     assert_null(TB_LAST(tree, &tree));
 }
 
+TEST(test_tbtree_remove_random)
+{
+    struct tree tree = TB_HEAD_INITIALIZER(tree);
+    struct node nodes[64];
+    bool used[64] = { false };
+    size_t count = 0;
+
+    srand(1);
+    for (size_t i = 0; i < 64; ++i)
+        nodes[i].value = (int)i;
+
+    for (size_t i = 0; i < 4096; ++i) {
+        size_t j = (size_t)rand() % 64;
+        if (used[j]) {
+            assert_equal(TB_REMOVE(tree, &tree, &nodes[j]), &nodes[j]);
+            --count;
+        } else {
+            assert_null(TB_INSERT(tree, &tree, &nodes[j]));
+            ++count;
+        }
+        used[j] = !used[j];
+        assert_equal(check_tree(__unit, TB_ROOT(&tree), false), count);
+    }
+}
+
+TEST(test_tbtree_rb_insert)
+{
+    struct rbtree tree = TB_HEAD_INITIALIZER(tree);
+    struct node *node, nodes[1000];
+
+    for (size_t i = 0; i < 1000; ++i) {
+        nodes[i].value = (int)i;
+        assert_null(TB_INSERT(rbtree, &tree, &nodes[i]));
+        assert_equal(check_tree(__unit, TB_ROOT(&tree), true), i + 1);
+    }
+
+    int height = 0;
+    for (node = TB_ROOT(&tree); node; node = TB_LEFT(node, entry))
+        ++height;
+    assert_true(height <= 20);
+
+    size_t i = 0;
+    TB_FOREACH(node, rbtree, &tree) {
+        assert_equal(node, &nodes[i++]);
+    }
+    assert_equal(i, 1000);
+
+    struct node key = { .value = 500 };
+    assert_equal(TB_FIND(rbtree, &tree, &key), &nodes[500]);
+    assert_equal(TB_INSERT(rbtree, &tree, &key), &nodes[500]);
+}
+
+TEST(test_tbtree_rb_remove)
+{
+    struct rbtree tree = TB_HEAD_INITIALIZER(tree);
+    struct node nodes[256];
+    bool used[256] = { false };
+    size_t count = 0;
+
+    srand(2);
+    for (size_t i = 0; i < 256; ++i)
+        nodes[i].value = (int)i;
+
+    for (size_t i = 0; i < 8192; ++i) {
+        size_t j = (size_t)rand() % 256;
+        if (used[j]) {
+            assert_equal(TB_REMOVE(rbtree, &tree, &nodes[j]), &nodes[j]);
+            --count;
+        } else {
+            assert_null(TB_INSERT(rbtree, &tree, &nodes[j]));
+            ++count;
+        }
+        used[j] = !used[j];
+        assert_equal(check_tree(__unit, TB_ROOT(&tree), true), count);
+    }
+
+    struct node *node, *tmp;
+    TB_FOREACH_SAFE(node, rbtree, &tree, tmp) {
+        TB_REMOVE(rbtree, &tree, node);
+        assert_equal(check_tree(__unit, TB_ROOT(&tree), true), --count);
+    }
+    assert_true(TB_EMPTY(&tree));
+}
+
+TEST(test_tbtree_rebalance)
+{
+    struct tree tree = TB_HEAD_INITIALIZER(tree);
+    struct node *node, nodes[1000];
+
+    TB_REBALANCE(tree, &tree);
+    assert_true(TB_EMPTY(&tree));
+
+    for (size_t n = 1; n <= 1000; n = n * 2 + 1) {
+        TB_INIT(&tree);
+        for (size_t i = 0; i < n; ++i) {
+            nodes[i].value = (int)i;
+            assert_null(TB_INSERT(tree, &tree, &nodes[i]));
+        }
+        assert_equal(tree_height(TB_ROOT(&tree)), (int)n);
+
+        TB_REBALANCE(tree, &tree);
+        assert_equal(check_tree(__unit, TB_ROOT(&tree), false), n);
+
+        int height = 0;
+        for (size_t i = n; i; i >>= 1)
+            ++height;
+        assert_equal(tree_height(TB_ROOT(&tree)), height);
+
+        size_t i = 0;
+        TB_FOREACH(node, tree, &tree) {
+            assert_equal(node, &nodes[i++]);
+        }
+        assert_equal(i, n);
+    }
+
+    for (size_t n = 1; n <= 1000; n += 37) {
+        TB_INIT(&tree);
+        for (size_t i = 0; i < n; ++i) {
+            nodes[i].value = (int)(n - i);
+            assert_null(TB_INSERT(tree, &tree, &nodes[i]));
+        }
+        TB_REBALANCE(tree, &tree);
+        assert_equal(check_tree(__unit, TB_ROOT(&tree), false), n);
+        assert_equal(TB_FIRST(tree, &tree), &nodes[n - 1]);
+        assert_equal(TB_LAST(tree, &tree), &nodes[0]);
+    }
+
+    struct rbtree rbtree = TB_HEAD_INITIALIZER(rbtree);
+    for (size_t i = 0; i < 1000; ++i) {
+        nodes[i].value = (int)((i * 7919) % 1000);
+        assert_null(TB_INSERT(rbtree, &rbtree, &nodes[i]));
+    }
+    TB_REBALANCE(rbtree, &rbtree);
+    assert_equal(check_tree(__unit, TB_ROOT(&rbtree), true), 1000);
+    assert_equal(tree_height(TB_ROOT(&rbtree)), 10);
+
+    for (size_t i = 0; i < 1000; i += 2) {
+        TB_REMOVE(rbtree, &rbtree, &nodes[i]);
+        assert_equal(check_tree(__unit, TB_ROOT(&rbtree), true), 999 - i / 2);
+    }
+}
+
+// Plain nodes only need room for the thread bits: on 32-bit targets they
+// are aligned to 4 bytes and the third low bit belongs to the parent link.
+TEST(test_tbtree_aligned)
+{
+    struct tree tree = TB_HEAD_INITIALIZER(tree);
+    struct node *node, *prev = NULL, nodes[1000];
+    size_t count = 0;
+
+    assert_equal(TB_NODE_FLAGS((int32_t *)NULL), TB_MASK);
+    assert_equal(TB_NODE_FLAGS((int64_t *)NULL), TB_FLAGS);
+    assert_equal(TB_NODE_FLAGS(nodes), TB_FLAGS & (__tbtree_alignof(struct node) - 1));
+
+    for (size_t i = 0; i < 1000; ++i) {
+        nodes[i].value = (int)((i * 7919) % 1000);
+        assert_null(TB_INSERT(tree, &tree, &nodes[i]));
+    }
+    TB_REBALANCE(tree, &tree);
+    for (size_t i = 0; i < 1000; i += 2)
+        assert_equal(TB_REMOVE(tree, &tree, &nodes[i]), &nodes[i]);
+    TB_REBALANCE(tree, &tree);
+
+    TB_FOREACH(node, tree, &tree) {
+        assert_false(TB_BITS(node, entry) & TB_CBIT & TB_NODE_FLAGS(node));
+        assert_true(!prev || prev->value < node->value);
+        prev = node;
+        ++count;
+    }
+    assert_equal(count, 500);
+    assert_equal(check_tree(__unit, TB_ROOT(&tree), false), 500);
+}
+
+TEST(test_tbtree_sg)
+{
+    struct sgtree tree = TB_HEAD_SG_INITIALIZER(tree);
+    struct node nodes[1024];
+    bool used[1024] = { false };
+
+    for (size_t i = 0; i < 1024; ++i) {
+        nodes[i].value = (int)i;
+        assert_null(TB_INSERT(sgtree, &tree, &nodes[i]));
+        used[i] = true;
+        assert_equal(check_tree(__unit, TB_ROOT(&tree), false), i + 1);
+        assert_true(tree_height(TB_ROOT(&tree)) <= 21);
+    }
+    assert_equal(tree.tb_count, 1024);
+    assert_equal(tree.tb_max, 1024);
+
+    srand(3);
+    for (size_t i = 0; i < 8192; ++i) {
+        size_t j = (size_t)rand() % 1024;
+        if (used[j]) {
+            assert_equal(TB_REMOVE(sgtree, &tree, &nodes[j]), &nodes[j]);
+        } else {
+            assert_null(TB_INSERT(sgtree, &tree, &nodes[j]));
+        }
+        used[j] = !used[j];
+
+        size_t count = check_tree(__unit, TB_ROOT(&tree), false);
+        assert_equal(count, tree.tb_count);
+        assert_true(tree.tb_count <= tree.tb_max);
+
+        int limit = 1;
+        for (count = tree.tb_max; count > 1; count >>= 1)
+            limit += 2;
+        assert_true(tree_height(TB_ROOT(&tree)) <= limit);
+    }
+
+    TB_INIT_SG(&tree);
+    assert_true(TB_EMPTY(&tree));
+}
+
+TEST(test_tbtree_build_sorted)
+{
+    struct tree tree = TB_HEAD_INITIALIZER(tree);
+    struct node *node, nodes[1000], *elms[1000];
+
+    for (size_t i = 0; i < 1000; ++i) {
+        nodes[i].value = (int)i * 2;
+        elms[i] = &nodes[i];
+    }
+
+    TB_BUILD_SORTED(tree, &tree, elms, 0);
+    assert_true(TB_EMPTY(&tree));
+
+    for (size_t n = 1; n <= 1000; n += 111) {
+        TB_BUILD_SORTED(tree, &tree, elms, n);
+        assert_equal(check_tree(__unit, TB_ROOT(&tree), false), n);
+
+        size_t i = 0;
+        TB_FOREACH(node, tree, &tree) {
+            assert_equal(node, elms[i++]);
+        }
+        assert_equal(i, n);
+
+        struct node key = { .value = (int)n - 1 };
+        assert_equal(TB_NFIND(tree, &tree, &key), elms[n / 2]);
+    }
+
+    struct rbtree rbtree = TB_HEAD_INITIALIZER(rbtree);
+    TB_BUILD_SORTED(rbtree, &rbtree, elms, 1000);
+    assert_equal(check_tree(__unit, TB_ROOT(&rbtree), true), 1000);
+    assert_equal(tree_height(TB_ROOT(&rbtree)), 10);
+
+    struct node extra = { .value = 1001 };
+    assert_null(TB_INSERT(rbtree, &rbtree, &extra));
+    assert_equal(TB_REMOVE(rbtree, &rbtree, &nodes[0]), &nodes[0]);
+    assert_equal(check_tree(__unit, TB_ROOT(&rbtree), true), 1000);
+
+    struct sgtree sgtree = TB_HEAD_SG_INITIALIZER(sgtree);
+    TB_BUILD_SORTED(sgtree, &sgtree, elms, 1000);
+    assert_equal(check_tree(__unit, TB_ROOT(&sgtree), false), 1000);
+    assert_equal(sgtree.tb_count, 1000);
+    assert_equal(sgtree.tb_max, 1000);
+}
+
+static size_t merge_dups;
+
+static struct node *merge_keep_src(struct node *dst, struct node *src)
+{
+    ++merge_dups;
+    dst->value = -1;
+    return src;
+}
+
+static struct node *merge_drop(struct node *dst, struct node *src)
+{
+    ++merge_dups;
+    return NULL;
+}
+
+TEST(test_tbtree_merge)
+{
+    struct tree dst = TB_HEAD_INITIALIZER(dst);
+    struct tree src = TB_HEAD_INITIALIZER(src);
+    struct node *node, nodes[300];
+
+    // dst holds multiples of 2, src holds multiples of 3 in 0..299
+    for (size_t i = 0; i < 150; ++i) {
+        nodes[i].value = (int)i * 2;
+        assert_null(TB_INSERT(tree, &dst, &nodes[i]));
+    }
+    for (size_t i = 0; i < 100; ++i) {
+        nodes[150 + i].value = (int)i * 3;
+        assert_null(TB_INSERT(tree, &src, &nodes[150 + i]));
+    }
+
+    merge_dups = 0;
+    TB_MERGE(tree, &dst, &src, merge_keep_src);
+    assert_true(TB_EMPTY(&src));
+    assert_equal(merge_dups, 50);
+    assert_equal(check_tree(__unit, TB_ROOT(&dst), false), 200);
+
+    int prev = -1;
+    TB_FOREACH(node, tree, &dst) {
+        assert_true(node->value > prev);
+        assert_true(node->value % 2 == 0 || node->value % 3 == 0);
+        if (node->value % 6 == 0)
+            assert_true(node >= &nodes[150]);
+        prev = node->value;
+    }
+
+    TB_MERGE(tree, &dst, &src, NULL);
+    assert_equal(check_tree(__unit, TB_ROOT(&dst), false), 200);
+    TB_MERGE(tree, &src, &dst, NULL);
+    assert_true(TB_EMPTY(&dst));
+    assert_equal(check_tree(__unit, TB_ROOT(&src), false), 200);
+
+    struct rbtree rbdst = TB_HEAD_INITIALIZER(rbdst);
+    struct rbtree rbsrc = TB_HEAD_INITIALIZER(rbsrc);
+    for (size_t i = 0; i < 300; ++i) {
+        nodes[i].value = (int)(i % 150);
+        assert_null(TB_INSERT(rbtree, i < 150 ? &rbdst : &rbsrc, &nodes[i]));
+    }
+
+    merge_dups = 0;
+    TB_MERGE(rbtree, &rbdst, &rbsrc, merge_drop);
+    assert_equal(merge_dups, 150);
+    assert_true(TB_EMPTY(&rbdst));
+
+    for (size_t i = 0; i < 300; ++i) {
+        nodes[i].value = (int)i;
+        assert_null(TB_INSERT(rbtree, i % 2 ? &rbdst : &rbsrc, &nodes[i]));
+    }
+    TB_MERGE(rbtree, &rbdst, &rbsrc, NULL);
+    assert_equal(check_tree(__unit, TB_ROOT(&rbdst), true), 300);
+    assert_equal(TB_REMOVE(rbtree, &rbdst, &nodes[7]), &nodes[7]);
+    assert_equal(check_tree(__unit, TB_ROOT(&rbdst), true), 299);
+}
+
+TEST(test_tbtree_split_join)
+{
+    struct tree tree = TB_HEAD_INITIALIZER(tree);
+    struct tree lo = TB_HEAD_INITIALIZER(lo);
+    struct tree hi = TB_HEAD_INITIALIZER(hi);
+    struct node *node, nodes[200];
+
+    srand(4);
+    for (size_t i = 0; i < 200; ++i) {
+        nodes[i].value = (int)i * 2;
+        while (TB_INSERT(tree, &tree, &nodes[i]))
+            nodes[i].value = rand() % 400;
+    }
+
+    for (int k = -1; k <= 401; k += 3) {
+        struct node key = { .value = k };
+        struct node *first = TB_FIRST(tree, &tree);
+        struct node *last = TB_LAST(tree, &tree);
+        struct node *cut = TB_NFIND(tree, &tree, &key);
+
+        TB_SPLIT(tree, &tree, &key, &lo, &hi);
+        assert_true(TB_EMPTY(&tree));
+        size_t nlo = check_tree(__unit, TB_ROOT(&lo), false);
+        size_t nhi = check_tree(__unit, TB_ROOT(&hi), false);
+        assert_equal(nlo + nhi, 200);
+        assert_equal(TB_FIRST(tree, &hi), cut);
+        if (nlo)
+            assert_true(TB_LAST(tree, &lo)->value < k);
+
+        TB_JOIN(tree, &lo, &hi);
+        assert_true(TB_EMPTY(&hi));
+        assert_equal(check_tree(__unit, TB_ROOT(&lo), false), 200);
+        assert_equal(TB_FIRST(tree, &lo), first);
+        assert_equal(TB_LAST(tree, &lo), last);
+
+        TB_SPLIT(tree, &lo, &key, &lo, &tree);
+        TB_JOIN(tree, &lo, &tree);
+        TB_JOIN(tree, &tree, &lo);
+        assert_equal(check_tree(__unit, TB_ROOT(&tree), false), 200);
+    }
+
+    struct rbtree rbtree = TB_HEAD_INITIALIZER(rbtree);
+    struct rbtree rblo = TB_HEAD_INITIALIZER(rblo);
+    struct rbtree rbhi = TB_HEAD_INITIALIZER(rbhi);
+    for (size_t i = 0; i < 200; ++i) {
+        nodes[i].value = (int)((i * 37) % 200);
+        assert_null(TB_INSERT(rbtree, &rbtree, &nodes[i]));
+    }
+
+    for (int k = -1; k <= 201; ++k) {
+        struct node key = { .value = k };
+        TB_SPLIT(rbtree, &rbtree, &key, &rblo, &rbhi);
+        size_t nlo = check_tree(__unit, TB_ROOT(&rblo), true);
+        size_t nhi = check_tree(__unit, TB_ROOT(&rbhi), true);
+        assert_equal(nlo, (size_t)(k < 0 ? 0 : k > 200 ? 200 : k));
+        assert_equal(nlo + nhi, 200);
+
+        // split the upper half again and join the pieces back in order
+        struct node mid = { .value = k + 50 };
+        TB_SPLIT(rbtree, &rbhi, &mid, &rbtree, &rbhi);
+        TB_JOIN(rbtree, &rblo, &rbtree);
+        assert_equal(check_tree(__unit, TB_ROOT(&rblo), true), nlo + nhi -
+                     check_tree(__unit, TB_ROOT(&rbhi), true));
+        TB_JOIN(rbtree, &rblo, &rbhi);
+        assert_true(TB_EMPTY(&rbhi));
+        assert_equal(check_tree(__unit, TB_ROOT(&rblo), true), 200);
+        TB_JOIN(rbtree, &rbtree, &rblo);
+
+        int i = 0;
+        TB_FOREACH(node, rbtree, &rbtree) {
+            assert_equal(node->value, i++);
+        }
+        assert_equal(i, 200);
+    }
+
+    for (size_t i = 0; i < 200; i += 3)
+        TB_REMOVE(rbtree, &rbtree, TB_FIRST(rbtree, &rbtree));
+    struct node key = { .value = 120 };
+    TB_SPLIT(rbtree, &rbtree, &key, &rblo, &rbhi);
+    assert_equal(check_tree(__unit, TB_ROOT(&rblo), true), 53);
+    assert_equal(TB_FIRST(rbtree, &rbhi)->value, 120);
+    TB_REMOVE(rbtree, &rbhi, TB_FIRST(rbtree, &rbhi));
+    TB_JOIN(rbtree, &rblo, &rbhi);
+    assert_equal(check_tree(__unit, TB_ROOT(&rblo), true), 132);
+}
+
+TB_HEAD(sptree, node);
+TB_GENERATE_SPLAY_STATIC(sptree, node, entry, node_cmp)
+
+TEST(test_tbtree_splay)
+{
+    struct sptree tree = TB_HEAD_INITIALIZER(tree);
+    struct node *node, nodes[1000], key;
+
+    key.value = 1;
+    assert_null(TB_FIND(sptree, &tree, &key));
+    assert_null(TB_NFIND(sptree, &tree, &key));
+
+    // every inserted node becomes the root
+    for (size_t i = 0; i < 1000; ++i) {
+        nodes[i].value = (int)((i * 7919) % 1000) * 2;
+        assert_null(TB_INSERT(sptree, &tree, &nodes[i]));
+        assert_equal(TB_ROOT(&tree), &nodes[i]);
+    }
+    assert_equal(check_tree(__unit, TB_ROOT(&tree), false), 1000);
+    key.value = 10;
+    node = TB_FIND(sptree, &tree, &key);
+    assert_equal(TB_INSERT(sptree, &tree, &key), node);
+
+    for (int value = -1; value <= 2000; ++value) {
+        key.value = value;
+        node = TB_FIND(sptree, &tree, &key);
+        if (value < 0 || value > 1998 || value % 2) {
+            assert_null(node);
+        } else {
+            assert_equal(node->value, value);
+            assert_equal(TB_ROOT(&tree), node);
+        }
+
+        node = TB_NFIND(sptree, &tree, &key);
+        if (value > 1998)
+            assert_null(node);
+        else
+            assert_equal(node->value, value < 0 ? 0 : (value + 1) / 2 * 2);
+
+        node = TB_PFIND(sptree, &tree, &key);
+        if (value < 0)
+            assert_null(node);
+        else
+            assert_equal(node->value, value > 1998 ? 1998 : value / 2 * 2);
+    }
+    assert_equal(check_tree(__unit, TB_ROOT(&tree), false), 1000);
+
+    // a few hot keys stay near the root
+    srand(7);
+    for (int round = 0; round < 5000; ++round) {
+        key.value = (rand() % 8) * 250;
+        assert_equal(TB_FIND(sptree, &tree, &key)->value, key.value);
+    }
+    for (int hot = 0; hot < 8; ++hot) {
+        int depth = 0;
+        key.value = hot * 250;
+        for (node = TB_ROOT(&tree); node->value != key.value; ++depth)
+            node = key.value < node->value ? TB_LEFT(node, entry) : TB_RIGHT(node, entry);
+        assert_true(depth < 8);
+    }
+    assert_equal(check_tree(__unit, TB_ROOT(&tree), false), 1000);
+
+    for (size_t i = 0; i < 1000; i += 2) {
+        TB_REMOVE(sptree, &tree, &nodes[i]);
+        key.value = nodes[i + 1].value;
+        assert_equal(TB_FIND(sptree, &tree, &key), &nodes[i + 1]);
+    }
+    assert_equal(check_tree(__unit, TB_ROOT(&tree), false), 500);
+
+    // splaying the extremes turns a sorted chain around
+    TB_INIT(&tree);
+    for (size_t i = 0; i < 1000; ++i) {
+        nodes[i].value = (int)i;
+        assert_null(TB_INSERT(sptree, &tree, &nodes[i]));
+    }
+    assert_equal(tree_height(TB_ROOT(&tree)), 1000);
+    TB_SPLAY(sptree, &tree, &nodes[0]);
+    assert_equal(TB_ROOT(&tree), &nodes[0]);
+    assert_true(tree_height(TB_ROOT(&tree)) <= 502);
+    assert_equal(check_tree(__unit, TB_ROOT(&tree), false), 1000);
+    assert_equal(TB_FIRST(sptree, &tree), &nodes[0]);
+    assert_equal(TB_LAST(sptree, &tree), &nodes[999]);
+}
+
+struct rnode {
+    TB_ENTRY_RANKED(rnode) entry;
+    int value;
+};
+
+static inline int rnode_cmp(const struct rnode *a, const struct rnode *b)
+{
+    return (a->value > b->value) - (a->value < b->value);
+}
+
+TB_HEAD(ranktree, rnode);
+TB_GENERATE_RANKED_STATIC(ranktree, rnode, entry, rnode_cmp)
+
+TB_HEAD(rbranktree, rnode);
+TB_GENERATE_RB_RANKED_STATIC(rbranktree, rnode, entry, rnode_cmp)
+
+static size_t check_size(const char *__unit, struct rnode *elm)
+{
+    size_t size = 1;
+    if (!TB_LLEAF(elm, entry))
+        size += check_size(__unit, TB_LEFT(elm, entry));
+    if (!TB_RLEAF(elm, entry))
+        size += check_size(__unit, TB_RIGHT(elm, entry));
+    assert_equal(TB_SIZE(elm, entry), size);
+    return size;
+}
+
+#define check_ranks(name, head, n) do { \
+        struct rnode *rnode; \
+        size_t k = 0; \
+        if (!TB_EMPTY(head)) \
+            assert_equal(check_size(__unit, TB_ROOT(head)), (n)); \
+        assert_equal(TB_COUNT(name, head), (n)); \
+        TB_FOREACH(rnode, name, head) { \
+            assert_equal(TB_SELECT(name, head, k), rnode); \
+            assert_equal(TB_RANK(name, head, rnode), k); \
+            ++k; \
+        } \
+        assert_equal(k, (n)); \
+        assert_null(TB_SELECT(name, head, k)); \
+    } while (0)
+
+TEST(test_tbtree_rank)
+{
+    struct ranktree tree = TB_HEAD_INITIALIZER(tree);
+    struct ranktree lo = TB_HEAD_INITIALIZER(lo);
+    struct rbranktree rbtree = TB_HEAD_INITIALIZER(rbtree);
+    struct rbranktree rbother = TB_HEAD_INITIALIZER(rbother);
+    struct rnode *elms[300], nodes[300];
+
+    check_ranks(ranktree, &tree, 0);
+
+    srand(5);
+    for (size_t i = 0; i < 300; ++i) {
+        nodes[i].value = (int)((i * 7) % 300);
+        assert_null(TB_INSERT(ranktree, &tree, &nodes[i]));
+    }
+    check_ranks(ranktree, &tree, 300);
+    for (size_t i = 0; i < 300; i += 2)
+        TB_REMOVE(ranktree, &tree, &nodes[i]);
+    check_ranks(ranktree, &tree, 150);
+    for (size_t i = 1; i < 300; i += 4) {
+        nodes[i].value = 1000 - nodes[i].value;
+        TB_REINSERT(ranktree, &tree, &nodes[i]);
+    }
+    check_ranks(ranktree, &tree, 150);
+
+    struct rnode key = { .value = 150 };
+    TB_SPLIT(ranktree, &tree, &key, &lo, &tree);
+    size_t n = TB_COUNT(ranktree, &lo);
+    check_ranks(ranktree, &lo, n);
+    check_ranks(ranktree, &tree, 150 - n);
+    TB_JOIN(ranktree, &lo, &tree);
+    check_ranks(ranktree, &lo, 150);
+    TB_REBALANCE(ranktree, &lo);
+    check_ranks(ranktree, &lo, 150);
+
+    for (size_t i = 0; i < 300; ++i) {
+        nodes[i].value = (int)((i * 7) % 300);
+        assert_null(TB_INSERT(rbranktree, &rbtree, &nodes[i]));
+    }
+    check_ranks(rbranktree, &rbtree, 300);
+    for (size_t i = 0; i < 300; ++i) {
+        struct rnode *elm = &nodes[rand() % 300];
+        if (TB_FIND(rbranktree, &rbtree, elm) == elm) {
+            TB_REMOVE(rbranktree, &rbtree, elm);
+            elm->value += 300;
+            assert_null(TB_INSERT(rbranktree, &rbtree, elm));
+        }
+    }
+    check_ranks(rbranktree, &rbtree, 300);
+    TB_REBALANCE(rbranktree, &rbtree);
+    check_ranks(rbranktree, &rbtree, 300);
+
+    key.value = 200;
+    TB_SPLIT(rbranktree, &rbtree, &key, &rbother, &rbtree);
+    n = TB_COUNT(rbranktree, &rbother);
+    check_ranks(rbranktree, &rbother, n);
+    check_ranks(rbranktree, &rbtree, 300 - n);
+    TB_MERGE(rbranktree, &rbtree, &rbother, NULL);
+    check_ranks(rbranktree, &rbtree, 300);
+    TB_SPLIT(rbranktree, &rbtree, &key, &rbother, &rbtree);
+    TB_JOIN(rbranktree, &rbother, &rbtree);
+    check_ranks(rbranktree, &rbother, 300);
+
+    for (size_t i = 0; i < 300; ++i) {
+        nodes[i].value = (int)i;
+        elms[i] = &nodes[i];
+    }
+    TB_BUILD_SORTED(rbranktree, &rbtree, elms, 300);
+    check_ranks(rbranktree, &rbtree, 300);
+    assert_equal(TB_SELECT(rbranktree, &rbtree, 149)->value, 149);
+    assert_equal(TB_RANK(rbranktree, &rbtree, &nodes[299]), 299);
+}
+
+struct snode {
+    TB_ENTRY(snode) entry;
+    int value;
+    long sum;
+};
+
+static inline int snode_cmp(const struct snode *a, const struct snode *b)
+{
+    return (a->value > b->value) - (a->value < b->value);
+}
+
+static int snode_augment(struct snode *elm)
+{
+    long sum = elm->value;
+    if (!TB_LLEAF(elm, entry))
+        sum += TB_LEFT(elm, entry)->sum;
+    if (!TB_RLEAF(elm, entry))
+        sum += TB_RIGHT(elm, entry)->sum;
+    if (elm->sum == sum)
+        return 0;
+    elm->sum = sum;
+    return 1;
+}
+
+TB_HEAD(sumtree, snode);
+TB_GENERATE_AUGMENT_STATIC(sumtree, snode, entry, snode_cmp, snode_augment)
+
+static long check_sum(const char *__unit, struct snode *elm)
+{
+    long sum = elm->value;
+    if (!TB_LLEAF(elm, entry))
+        sum += check_sum(__unit, TB_LEFT(elm, entry));
+    if (!TB_RLEAF(elm, entry))
+        sum += check_sum(__unit, TB_RIGHT(elm, entry));
+    assert_equal(elm->sum, sum);
+    return sum;
+}
+
+TEST(test_tbtree_augment)
+{
+    struct sumtree tree = TB_HEAD_INITIALIZER(tree);
+    struct sumtree hi = TB_HEAD_INITIALIZER(hi);
+    struct snode nodes[256];
+    long total = 0;
+
+    srand(6);
+    for (size_t i = 0; i < 256; ++i) {
+        nodes[i].value = (int)i;
+        nodes[i].sum = -1;
+        assert_null(TB_INSERT(sumtree, &tree, &nodes[i]));
+        total += (long)i;
+    }
+    assert_equal(check_sum(__unit, TB_ROOT(&tree)), total);
+
+    for (size_t i = 0; i < 256; ++i) {
+        struct snode *elm = &nodes[rand() % 256];
+        if (TB_FIND(sumtree, &tree, elm) != elm)
+            continue;
+        TB_REMOVE(sumtree, &tree, elm);
+        total -= elm->value;
+        assert_equal(check_sum(__unit, TB_ROOT(&tree)), total);
+        elm->value += 1000;
+        assert_null(TB_INSERT(sumtree, &tree, elm));
+        total += elm->value;
+    }
+    assert_equal(check_sum(__unit, TB_ROOT(&tree)), total);
+
+    TB_REBALANCE(sumtree, &tree);
+    assert_equal(check_sum(__unit, TB_ROOT(&tree)), total);
+
+    struct snode key = { .value = 500 };
+    TB_SPLIT(sumtree, &tree, &key, &tree, &hi);
+    assert_equal(check_sum(__unit, TB_ROOT(&tree)) +
+                 check_sum(__unit, TB_ROOT(&hi)), total);
+    TB_JOIN(sumtree, &tree, &hi);
+    assert_equal(check_sum(__unit, TB_ROOT(&tree)), total);
+}
+
+struct ival {
+    TB_ENTRY(ival) entry;
+    int lo, hi, max;
+};
+
+static inline int ival_cmp(const struct ival *a, const struct ival *b)
+{
+    if (a->lo != b->lo)
+        return (a->lo > b->lo) - (a->lo < b->lo);
+    return (a->hi > b->hi) - (a->hi < b->hi);
+}
+
+TB_HEAD(itree, ival);
+TB_GENERATE_INTERVAL_STATIC(itree, ival, entry, ival_cmp, lo, hi, max)
+
+static int check_max(const char *__unit, struct ival *elm)
+{
+    int max = elm->hi;
+    if (!TB_LLEAF(elm, entry)) {
+        int lmax = check_max(__unit, TB_LEFT(elm, entry));
+        max = lmax > max ? lmax : max;
+    }
+    if (!TB_RLEAF(elm, entry)) {
+        int rmax = check_max(__unit, TB_RIGHT(elm, entry));
+        max = rmax > max ? rmax : max;
+    }
+    assert_equal(elm->max, max);
+    return max;
+}
+
+TEST(test_tbtree_interval)
+{
+    struct itree tree = TB_HEAD_INITIALIZER(tree);
+    struct ival *elm, nodes[500];
+    bool linked[500] = { false };
+
+    srand(7);
+    for (size_t i = 0; i < 500; ++i) {
+        nodes[i].lo = rand() % 1000;
+        nodes[i].hi = nodes[i].lo + rand() % (i % 10 ? 20 : 300);
+        linked[i] = !TB_INSERT(itree, &tree, &nodes[i]);
+    }
+    for (size_t i = 0; i < 500; i += 3) {
+        if (linked[i]) {
+            TB_REMOVE(itree, &tree, &nodes[i]);
+            linked[i] = false;
+        }
+    }
+    check_max(__unit, TB_ROOT(&tree));
+
+    for (int q = 0; q < 200; ++q) {
+        struct ival key = { .lo = rand() % 1100 - 50 };
+        key.hi = key.lo + rand() % 50;
+
+        size_t expected = 0, found = 0;
+        for (size_t i = 0; i < 500; ++i)
+            expected += linked[i] && nodes[i].lo <= key.hi && key.lo <= nodes[i].hi;
+
+        struct ival *prev = NULL;
+        TB_FOREACH_OVERLAP(elm, itree, &tree, &key) {
+            assert_true(elm->lo <= key.hi && key.lo <= elm->hi);
+            if (prev)
+                assert_true(ival_cmp(prev, elm) < 0);
+            prev = elm;
+            ++found;
+        }
+        assert_equal(found, expected);
+    }
+
+    struct ival key = { .lo = 2000, .hi = 3000 };
+    assert_null(TB_OVERLAP(itree, &tree, &key));
+}
+
+static size_t range_removed;
+
+static void range_cb(struct node *elm)
+{
+    elm->value = -1;
+    ++range_removed;
+}
+
+TEST(test_tbtree_range)
+{
+    struct tree tree = TB_HEAD_INITIALIZER(tree);
+    struct rbtree rbtree = TB_HEAD_INITIALIZER(rbtree);
+    struct sgtree sgtree = TB_HEAD_SG_INITIALIZER(sgtree);
+    struct node *node, nodes[100];
+
+    // even values 0..198
+    for (size_t i = 0; i < 100; ++i) {
+        nodes[i].value = (int)((i * 37) % 100) * 2;
+        assert_null(TB_INSERT(tree, &tree, &nodes[i]));
+    }
+
+    struct node key = { .value = -1 };
+    assert_null(TB_PFIND(tree, &tree, &key));
+    key.value = 0;
+    assert_equal(TB_PFIND(tree, &tree, &key)->value, 0);
+    key.value = 51;
+    assert_equal(TB_PFIND(tree, &tree, &key)->value, 50);
+    key.value = 500;
+    assert_equal(TB_PFIND(tree, &tree, &key)->value, 198);
+
+    for (int lo = -3; lo < 203; lo += 7) {
+        for (int hi = lo - 2; hi < 205; hi += 11) {
+            struct node klo = { .value = lo }, khi = { .value = hi };
+            for (int bounds = TB_CLOSED; bounds <= TB_OPEN; ++bounds) {
+                int expected = 0, count = 0, prev = -1;
+                for (int v = 0; v < 200; v += 2) {
+                    expected += (bounds & TB_LOPEN ? v > lo : v >= lo) &&
+                                (bounds & TB_HOPEN ? v < hi : v <= hi);
+                }
+                TB_FOREACH_RANGE_BOUNDS(node, tree, &tree, &klo, &khi, bounds) {
+                    assert_true(node->value > prev);
+                    prev = node->value;
+                    ++count;
+                }
+                assert_equal(count, expected);
+            }
+        }
+    }
+
+    int count = 0;
+    key.value = 101;
+    TB_FOREACH_RANGE(node, tree, &tree, NULL, &key) {
+        ++count;
+    }
+    assert_equal(count, 51);
+    count = 0;
+    TB_FOREACH_RANGE(node, tree, &tree, &key, NULL) {
+        ++count;
+    }
+    assert_equal(count, 49);
+
+    struct node klo = { .value = 20 }, khi = { .value = 60 };
+    range_removed = 0;
+    assert_equal(TB_REMOVE_RANGE(tree, &tree, &klo, &khi, range_cb), 21);
+    assert_equal(range_removed, 21);
+    assert_equal(check_tree(__unit, TB_ROOT(&tree), false), 79);
+    assert_equal(TB_REMOVE_RANGE_BOUNDS(tree, &tree, &klo, &khi, TB_OPEN, NULL), 0);
+    assert_equal(TB_REMOVE_RANGE(tree, &tree, NULL, &klo, NULL), 10);
+    assert_equal(TB_REMOVE_RANGE(tree, &tree, &khi, NULL, NULL), 69);
+    assert_true(TB_EMPTY(&tree));
+
+    srand(8);
+    for (int round = 0; round < 50; ++round) {
+        TB_INIT(&rbtree);
+        TB_INIT_SG(&sgtree);
+        for (size_t i = 0; i < 100; ++i) {
+            nodes[i].value = (int)i;
+            assert_null(TB_INSERT(rbtree, &rbtree, &nodes[i]));
+        }
+        klo.value = rand() % 110 - 5;
+        khi.value = klo.value + rand() % 40;
+        int bounds = rand() % 4;
+        size_t expected = 0;
+        for (int v = 0; v < 100; ++v) {
+            expected += (bounds & TB_LOPEN ? v > klo.value : v >= klo.value) &&
+                        (bounds & TB_HOPEN ? v < khi.value : v <= khi.value);
+        }
+        assert_equal(TB_REMOVE_RANGE_BOUNDS(rbtree, &rbtree, &klo, &khi, bounds, NULL),
+                     expected);
+        assert_equal(check_tree(__unit, TB_ROOT(&rbtree), true), 100 - expected);
+
+        for (size_t i = 0; i < 100; ++i) {
+            nodes[i].value = (int)i;
+            assert_null(TB_INSERT(sgtree, &sgtree, &nodes[i]));
+        }
+        assert_equal(TB_REMOVE_RANGE_BOUNDS(sgtree, &sgtree, &klo, &khi, bounds, NULL),
+                     expected);
+        assert_equal(check_tree(__unit, TB_ROOT(&sgtree), false), 100 - expected);
+        assert_equal(sgtree.tb_count, 100 - expected);
+    }
+}
+
+TEST(test_tbtree_insert_hint)
+{
+    struct tree tree = TB_HEAD_INITIALIZER(tree);
+    struct rbtree rbtree = TB_HEAD_INITIALIZER(rbtree);
+    struct sgtree sgtree = TB_HEAD_SG_INITIALIZER(sgtree);
+    struct rbranktree ranktree = TB_HEAD_INITIALIZER(ranktree);
+    struct node *hint, dup, nodes[300];
+    struct rnode *rhint, rnodes[300];
+
+    // appends and prepends
+    hint = NULL;
+    for (size_t i = 0; i < 150; ++i) {
+        nodes[i].value = (int)i;
+        assert_null(TB_INSERT_HINT(rbtree, &rbtree, hint, &nodes[i]));
+        hint = &nodes[i];
+    }
+    for (size_t i = 150; i < 300; ++i) {
+        nodes[i].value = 149 - (int)i;
+        assert_null(TB_INSERT_HINT(rbtree, &rbtree, hint, &nodes[i]));
+        hint = &nodes[i];
+    }
+    assert_equal(check_tree(__unit, TB_ROOT(&rbtree), true), 300);
+
+    dup.value = 42;
+    assert_equal(TB_INSERT_HINT(rbtree, &rbtree, &nodes[42], &dup), &nodes[42]);
+    assert_equal(TB_INSERT_HINT(rbtree, &rbtree, &nodes[0], &dup), &nodes[42]);
+    assert_equal(TB_INSERT_HINT(rbtree, &rbtree, &nodes[299], &dup), &nodes[42]);
+
+    // random keys with random and wrong hints
+    srand(9);
+    hint = NULL;
+    for (size_t i = 0; i < 300; ++i) {
+        nodes[i].value = (int)i * 2;
+        while (TB_INSERT_HINT(tree, &tree, hint, &nodes[i]))
+            nodes[i].value = rand() % 600;
+        hint = &nodes[rand() % (i + 1)];
+    }
+    assert_equal(check_tree(__unit, TB_ROOT(&tree), false), 300);
+
+    hint = NULL;
+    for (size_t i = 0; i < 300; ++i) {
+        nodes[i].value = (int)(i * 7 % 300);
+        assert_null(TB_INSERT_HINT(sgtree, &sgtree, hint, &nodes[i]));
+        hint = i % 3 ? &nodes[i] : TB_FIRST(sgtree, &sgtree);
+    }
+    assert_equal(check_tree(__unit, TB_ROOT(&sgtree), false), 300);
+    assert_true(tree_height(TB_ROOT(&sgtree)) <= 18);
+
+    rhint = NULL;
+    for (size_t i = 0; i < 300; ++i) {
+        rnodes[i].value = (int)(i % 2 ? i : 1000 - i);
+        assert_null(TB_INSERT_HINT(rbranktree, &ranktree, rhint, &rnodes[i]));
+        rhint = &rnodes[i];
+    }
+    check_ranks(rbranktree, &ranktree, 300);
+}
+
+struct knode {
+    TB_ENTRY(knode) entry;
+    uint64_t key;
+};
+
+TB_HEAD(ktree, knode);
+TB_GENERATE_KEY_STATIC(ktree, knode, entry, key, uint64_t)
+
+TB_HEAD(rbktree, knode);
+TB_GENERATE_RB_KEY_STATIC(rbktree, knode, entry, key, uint64_t)
+
+TEST(test_tbtree_key)
+{
+    struct ktree tree = TB_HEAD_INITIALIZER(tree);
+    struct rbktree rbtree = TB_HEAD_INITIALIZER(rbtree);
+    struct knode *node, nodes[200];
+
+    assert_null(TB_FIND_KEY(ktree, &tree, 0));
+    assert_null(TB_NFIND_KEY(ktree, &tree, 0));
+    assert_null(TB_PFIND_KEY(ktree, &tree, 0));
+
+    // keys 10, 20, ..., 2000 in scattered order
+    for (size_t i = 0; i < 200; ++i) {
+        nodes[i].key = (uint64_t)((i * 77) % 200 + 1) * 10;
+        assert_null(TB_INSERT(ktree, &tree, &nodes[i]));
+    }
+    assert_equal(TB_INSERT(ktree, &tree, &(struct knode){ .key = 500 }),
+                 TB_FIND_KEY(ktree, &tree, 500));
+
+    uint64_t prev = 0;
+    TB_FOREACH(node, ktree, &tree) {
+        assert_true(node->key > prev);
+        prev = node->key;
+    }
+
+    for (uint64_t key = 0; key <= 2020; ++key) {
+        node = TB_FIND_KEY(ktree, &tree, key);
+        if (key % 10 || !key || key > 2000)
+            assert_null(node);
+        else
+            assert_equal(node->key, key);
+
+        node = TB_NFIND_KEY(ktree, &tree, key);
+        if (key > 2000)
+            assert_null(node);
+        else
+            assert_equal(node->key, key < 10 ? 10 : (key + 9) / 10 * 10);
+
+        node = TB_PFIND_KEY(ktree, &tree, key);
+        if (key < 10)
+            assert_null(node);
+        else
+            assert_equal(node->key, key > 2000 ? 2000 : key / 10 * 10);
+    }
+
+    for (size_t i = 0; i < 200; ++i) {
+        nodes[i].key = UINT64_MAX - i * 3;
+        assert_null(TB_INSERT(rbktree, &rbtree, &nodes[i]));
+    }
+    assert_equal(TB_FIND_KEY(rbktree, &rbtree, UINT64_MAX), &nodes[0]);
+    assert_equal(TB_NFIND_KEY(rbktree, &rbtree, 0), &nodes[199]);
+    assert_equal(TB_PFIND_KEY(rbktree, &rbtree, UINT64_MAX - 1), &nodes[1]);
+    for (size_t i = 0; i < 200; i += 2)
+        TB_REMOVE(rbktree, &rbtree, TB_FIND_KEY(rbktree, &rbtree, nodes[i].key));
+    assert_null(TB_FIND_KEY(rbktree, &rbtree, UINT64_MAX));
+    assert_null(TB_NFIND_KEY(rbktree, &rbtree, UINT64_MAX - 2));
+    assert_equal(TB_PFIND_KEY(rbktree, &rbtree, UINT64_MAX - 2), &nodes[1]);
+}
+
+struct mnode {
+    TB_ENTRY(mnode) entry;
+    int key;
+    int seq;
+};
+
+static inline int mnode_cmp(const struct mnode *a, const struct mnode *b)
+{
+    return (a->key > b->key) - (a->key < b->key);
+}
+
+TB_HEAD(mtree, mnode);
+TB_GENERATE_MULTI_STATIC(mtree, mnode, entry, mnode_cmp)
+
+TB_HEAD(rbmtree, mnode);
+TB_GENERATE_RB_MULTI_STATIC(rbmtree, mnode, entry, mnode_cmp)
+
+// Validates parent links and red-black invariants, returning the black
+// height of the subtree at `elm`.
+static int check_mnode(const char *__unit, struct mnode *elm,
+                       struct mnode *parent, bool rb)
+{
+    int lheight = 1, rheight = 1;
+
+    assert_equal(TB_PARENT(elm, entry), parent);
+    if (!TB_LLEAF(elm, entry)) {
+        if (rb && TB_IS_RED(elm, entry))
+            assert_true(TB_IS_BLACK(TB_LEFT(elm, entry), entry));
+        lheight = check_mnode(__unit, TB_LEFT(elm, entry), elm, rb);
+    }
+    if (!TB_RLEAF(elm, entry)) {
+        if (rb && TB_IS_RED(elm, entry))
+            assert_true(TB_IS_BLACK(TB_RIGHT(elm, entry), entry));
+        rheight = check_mnode(__unit, TB_RIGHT(elm, entry), elm, rb);
+    }
+    if (rb)
+        assert_equal(lheight, rheight);
+    return lheight + TB_IS_BLACK(elm, entry);
+}
+
+// Equal keys must follow in insertion order.
+#define check_multi(name, head, n, rb) do { \
+        struct mnode *mprev = NULL, *mnode; \
+        size_t k = 0; \
+        if (!TB_EMPTY(head)) \
+            check_mnode(__unit, TB_ROOT(head), NULL, rb); \
+        TB_FOREACH(mnode, name, head) { \
+            if (mprev) \
+                assert_true(mprev->key < mnode->key || \
+                            (mprev->key == mnode->key && mprev->seq < mnode->seq)); \
+            assert_equal(TB_PREV(name, mnode), mprev); \
+            mprev = mnode; \
+            ++k; \
+        } \
+        assert_equal(k, (n)); \
+    } while (0)
+
+#define check_equal_range(name, head, lo, hi, dups) do { \
+        struct mnode mkey, *mnode, *end; \
+        for (mkey.key = (lo); mkey.key <= (hi); ++mkey.key) { \
+            size_t k = 0; \
+            int seq = -1; \
+            TB_FOREACH_EQUAL(mnode, name, head, &mkey, end) { \
+                assert_equal(mnode->key, mkey.key); \
+                assert_true(mnode->seq > seq); \
+                seq = mnode->seq; \
+                ++k; \
+            } \
+            assert_equal(k, (dups)(mkey.key)); \
+            mnode = TB_EQUAL_RANGE(name, head, &mkey, &end); \
+            assert_equal(mnode, TB_FIND(name, head, &mkey)); \
+            if (!mnode) \
+                continue; \
+            assert_equal(mnode, TB_NFIND(name, head, &mkey)); \
+            assert_true(!TB_PREV(name, mnode) || TB_PREV(name, mnode)->key < mkey.key); \
+            assert_equal(TB_NEXT(name, TB_PFIND(name, head, &mkey)), end); \
+            assert_true(!end || end->key > mkey.key); \
+        } \
+    } while (0)
+
+static size_t mnode_dups(int key)
+{
+    return key >= 0 && key < 50 ? 12 : 0;
+}
+
+static size_t mnode_odd_dups(int key)
+{
+    return key % 2 ? mnode_dups(key) : 0;
+}
+
+TEST(test_tbtree_multi)
+{
+    struct mtree tree = TB_HEAD_INITIALIZER(tree);
+    struct mtree hi = TB_HEAD_INITIALIZER(hi);
+    struct rbmtree rbtree = TB_HEAD_INITIALIZER(rbtree);
+    struct rbmtree rbhi = TB_HEAD_INITIALIZER(rbhi);
+    struct mnode nodes[600], rbnodes[600], key, *node;
+
+    key.key = 7;
+    assert_null(TB_FIND(mtree, &tree, &key));
+    assert_null(TB_EQUAL_RANGE(rbmtree, &rbtree, &key, &node));
+
+    // keys 0..49, twelve of each, interleaved
+    for (int i = 0; i < 600; ++i) {
+        nodes[i].key = rbnodes[i].key = (i * 37) % 50;
+        nodes[i].seq = rbnodes[i].seq = i;
+        assert_null(TB_INSERT(mtree, &tree, &nodes[i]));
+        assert_null(TB_INSERT(rbmtree, &rbtree, &rbnodes[i]));
+    }
+    check_multi(mtree, &tree, 600, false);
+    check_multi(rbmtree, &rbtree, 600, true);
+    check_equal_range(mtree, &tree, -2, 52, mnode_dups);
+    check_equal_range(rbmtree, &rbtree, -2, 52, mnode_dups);
+
+    key.key = -1;
+    assert_equal(TB_NFIND(mtree, &tree, &key), TB_FIRST(mtree, &tree));
+    assert_null(TB_PFIND(mtree, &tree, &key));
+    key.key = 50;
+    assert_null(TB_NFIND(rbmtree, &rbtree, &key));
+    assert_equal(TB_PFIND(rbmtree, &rbtree, &key), TB_LAST(rbmtree, &rbtree));
+
+    // a changed key moves behind the nodes already holding it
+    rbnodes[0].key = 49;
+    rbnodes[0].seq = 600;
+    assert_null(TB_REINSERT(rbmtree, &rbtree, &rbnodes[0]));
+    assert_equal(TB_LAST(rbmtree, &rbtree), &rbnodes[0]);
+    rbnodes[0].key = 0;
+    rbnodes[0].seq = 601;
+    assert_null(TB_REINSERT(rbmtree, &rbtree, &rbnodes[0]));
+    assert_equal(TB_PFIND(rbmtree, &rbtree, &rbnodes[0]), &rbnodes[0]);
+    check_multi(rbmtree, &rbtree, 600, true);
+
+    // removing the even keys leaves the odd runs intact
+    for (int i = 0; i < 600; ++i) {
+        if (nodes[i].key % 2)
+            continue;
+        TB_REMOVE(mtree, &tree, &nodes[i]);
+        TB_REMOVE(rbmtree, &rbtree, &rbnodes[i]);
+    }
+    check_multi(mtree, &tree, 300, false);
+    check_multi(rbmtree, &rbtree, 300, true);
+    check_equal_range(mtree, &tree, -2, 52, mnode_odd_dups);
+    check_equal_range(rbmtree, &rbtree, -2, 52, mnode_odd_dups);
+
+    // duplicates follow the hint
+    for (int i = 0; i < 600; ++i) {
+        if (nodes[i].key % 2)
+            continue;
+        nodes[i].seq = rbnodes[i].seq = 600 + i;
+        node = TB_PFIND(mtree, &tree, &nodes[i]);
+        assert_null(TB_INSERT_HINT(mtree, &tree, node, &nodes[i]));
+        assert_null(TB_INSERT(rbmtree, &rbtree, &rbnodes[i]));
+    }
+    check_multi(mtree, &tree, 600, false);
+    check_multi(rbmtree, &rbtree, 600, true);
+    check_equal_range(mtree, &tree, -2, 52, mnode_dups);
+    check_equal_range(rbmtree, &rbtree, -2, 52, mnode_dups);
+
+    // splits keep whole runs together
+    key.key = 20;
+    TB_SPLIT(mtree, &tree, &key, &tree, &hi);
+    TB_SPLIT(rbmtree, &rbtree, &key, &rbtree, &rbhi);
+    check_multi(mtree, &tree, 240, false);
+    check_multi(mtree, &hi, 360, false);
+    check_multi(rbmtree, &rbtree, 240, true);
+    check_multi(rbmtree, &rbhi, 360, true);
+    assert_equal(TB_FIRST(mtree, &hi), TB_FIND(mtree, &hi, &key));
+    assert_equal(TB_FIRST(rbmtree, &rbhi), TB_FIND(rbmtree, &rbhi, &key));
+    TB_JOIN(mtree, &tree, &hi);
+    TB_JOIN(rbmtree, &rbtree, &rbhi);
+    check_multi(mtree, &tree, 600, false);
+    check_multi(rbmtree, &rbtree, 600, true);
+
+    struct mnode lo = { .key = 10 }, top = { .key = 14 };
+    assert_equal(TB_REMOVE_RANGE(mtree, &tree, &lo, &top, NULL), 60);
+    assert_equal(TB_REMOVE_RANGE_BOUNDS(rbmtree, &rbtree, &lo, &top, TB_HOPEN, NULL), 48);
+    check_multi(mtree, &tree, 540, false);
+    check_multi(rbmtree, &rbtree, 552, true);
+    assert_null(TB_FIND(mtree, &tree, &top));
+    assert_not_null(TB_FIND(rbmtree, &rbtree, &top));
+}
+
+struct pnode {
+    TB_ENTRY_PREFIX(pnode) entry;
+    char name[32];
+};
+
+static size_t pnode_cmps;
+
+static int pnode_cmp(struct pnode *a, struct pnode *b)
+{
+    ++pnode_cmps;
+    return strcmp(a->name, b->name);
+}
+
+TB_HEAD(ptree, pnode);
+TB_GENERATE_PREFIX_STATIC(ptree, pnode, entry, pnode_cmp)
+
+TB_HEAD(rbptree, pnode);
+TB_GENERATE_RB_PREFIX_STATIC(rbptree, pnode, entry, pnode_cmp)
+
+TEST(test_tbtree_prefix)
+{
+    struct ptree tree = TB_HEAD_INITIALIZER(tree);
+    struct rbptree rbtree = TB_HEAD_INITIALIZER(rbtree);
+    struct pnode *node, *prev, nodes[400], key;
+
+    assert_equal(tb_prefix("", 0), 0);
+    assert_equal(tb_prefix("\x01\x02", 2), 0x0102000000000000u);
+    assert_equal(tb_prefix_str("abcdefghij"), tb_prefix("abcdefgh", 8));
+    assert_true(tb_prefix_str("ab") < tb_prefix_str("ab\x01"));
+    assert_true(tb_prefix_str("ab\x7f") < tb_prefix_str("ab\xff"));
+    assert_true(tb_prefix_str("b") > tb_prefix_str("abcdefgh"));
+
+    // short names have distinct prefixes, long ones share theirs
+    for (size_t i = 0; i < 400; ++i) {
+        if (i % 2)
+            snprintf(nodes[i].name, sizeof(nodes[i].name), "k%zu", (i * 7) % 400);
+        else
+            snprintf(nodes[i].name, sizeof(nodes[i].name), "shared-prefix-%zu", i);
+        TB_PREFIX(&nodes[i], entry) = tb_prefix_str(nodes[i].name);
+        assert_null(TB_INSERT(ptree, &tree, &nodes[i]));
+    }
+
+    prev = NULL;
+    TB_FOREACH(node, ptree, &tree) {
+        if (prev)
+            assert_true(strcmp(prev->name, node->name) < 0);
+        prev = node;
+    }
+
+    for (size_t i = 0; i < 400; ++i) {
+        memcpy(key.name, nodes[i].name, sizeof(key.name));
+        TB_PREFIX(&key, entry) = tb_prefix_str(key.name);
+        pnode_cmps = 0;
+        assert_equal(TB_FIND(ptree, &tree, &key), &nodes[i]);
+        if (i % 2)
+            assert_equal(pnode_cmps, 1);
+    }
+
+    strcpy(key.name, "k2");
+    TB_PREFIX(&key, entry) = tb_prefix_str(key.name);
+    node = TB_NFIND(ptree, &tree, &key);
+    assert_str_equal(node->name, "k201");
+    node = TB_PFIND(ptree, &tree, &key);
+    assert_str_equal(node->name, "k199");
+
+    // a renamed node moves once its prefix is refreshed
+    strcpy(nodes[1].name, "zz");
+    TB_PREFIX(&nodes[1], entry) = tb_prefix_str(nodes[1].name);
+    assert_null(TB_REINSERT(ptree, &tree, &nodes[1]));
+    assert_equal(TB_LAST(ptree, &tree), &nodes[1]);
+
+    for (size_t i = 0; i < 400; ++i)
+        assert_null(TB_INSERT(rbptree, &rbtree, &nodes[i]));
+    prev = NULL;
+    TB_FOREACH(node, rbptree, &rbtree) {
+        if (prev)
+            assert_true(strcmp(prev->name, node->name) < 0);
+        prev = node;
+    }
+    for (size_t i = 0; i < 400; i += 3)
+        assert_equal(TB_REMOVE(rbptree, &rbtree, &nodes[i]), &nodes[i]);
+    for (size_t i = 0; i < 400; ++i) {
+        memcpy(key.name, nodes[i].name, sizeof(key.name));
+        TB_PREFIX(&key, entry) = tb_prefix_str(key.name);
+        assert_equal(TB_FIND(rbptree, &rbtree, &key), i % 3 ? &nodes[i] : NULL);
+    }
+}
+
+TEST(test_tbtree_find_batch)
+{
+    struct tree tree = TB_HEAD_INITIALIZER(tree);
+    struct rbtree rbtree = TB_HEAD_INITIALIZER(rbtree);
+    struct node nodes[500], rbnodes[500], keys[150];
+    struct node *pkeys[150], *out[150];
+
+    TB_FIND_BATCH(tree, &tree, pkeys, 0, out);
+    for (size_t i = 0; i < 150; ++i) {
+        keys[i].value = (int)i;
+        pkeys[i] = &keys[i];
+    }
+    TB_NFIND_BATCH(tree, &tree, pkeys, 150, out);
+    for (size_t i = 0; i < 150; ++i)
+        assert_null(out[i]);
+
+    srand(11);
+    for (size_t i = 0; i < 500; ++i) {
+        nodes[i].value = (int)i * 2;
+        while (TB_INSERT(tree, &tree, &nodes[i]))
+            nodes[i].value = rand() % 1000;
+        rbnodes[i].value = nodes[i].value;
+        assert_null(TB_INSERT(rbtree, &rbtree, &rbnodes[i]));
+    }
+
+    for (int round = 0; round < 20; ++round) {
+        size_t n = (size_t)(rand() % 150) + 1;
+        for (size_t i = 0; i < n; ++i)
+            keys[i].value = rand() % 1010 - 5;
+
+        TB_FIND_BATCH(tree, &tree, pkeys, n, out);
+        for (size_t i = 0; i < n; ++i)
+            assert_equal(out[i], TB_FIND(tree, &tree, pkeys[i]));
+
+        TB_NFIND_BATCH(tree, &tree, pkeys, n, out);
+        for (size_t i = 0; i < n; ++i)
+            assert_equal(out[i], TB_NFIND(tree, &tree, pkeys[i]));
+
+        TB_NFIND_BATCH(rbtree, &rbtree, pkeys, n, out);
+        for (size_t i = 0; i < n; ++i)
+            assert_equal(out[i], TB_NFIND(rbtree, &rbtree, pkeys[i]));
+    }
+}
+
+TEST(test_tbtree_freeze)
+{
+    struct rbtree tree = TB_HEAD_INITIALIZER(tree);
+    struct ktree ktree = TB_HEAD_INITIALIZER(ktree);
+    struct node nodes[100], key, hi, *elm, *elms[101];
+    struct knode knodes[100], *kelms[101];
+    uint64_t keys[101];
+    size_t pos, end, count;
+
+    assert_equal(TB_FREEZE(rbtree, &tree, elms, 1), 0);
+    assert_null(elms[0]);
+    key.value = 0;
+    assert_equal(TB_FROZEN_LOWER(rbtree, elms, 0, &key), 0);
+    assert_null(TB_FROZEN_NFIND(rbtree, elms, 0, &key));
+    TB_FOREACH_FROZEN(pos, 0)
+        assert_true(false);
+
+    // Every size, so that each shape of the bottom level is covered.
+    for (size_t n = 1; n <= 100; ++n) {
+        nodes[n - 1].value = 2 * (int)(n - 1);
+        assert_null(TB_INSERT(rbtree, &tree, &nodes[n - 1]));
+
+        elms[n - 1] = NULL;
+        assert_equal(TB_FREEZE(rbtree, &tree, elms, n), n);
+        assert_null(elms[n - 1]);
+        assert_equal(TB_FREEZE(rbtree, &tree, elms, n + 1), n);
+
+        count = 0;
+        elm = TB_FIRST(rbtree, &tree);
+        TB_FOREACH_FROZEN(pos, n) {
+            assert_equal(elms[pos], elm);
+            elm = TB_NEXT(rbtree, elm);
+            ++count;
+        }
+        assert_equal(count, n);
+        elm = TB_LAST(rbtree, &tree);
+        TB_FOREACH_FROZEN_REVERSE(pos, n) {
+            assert_equal(elms[pos], elm);
+            elm = TB_PREV(rbtree, elm);
+        }
+        assert_null(elm);
+
+        for (int i = -1; i <= 2 * (int)n; ++i) {
+            key.value = i;
+            assert_equal(TB_FROZEN_FIND(rbtree, elms, n, &key), TB_FIND(rbtree, &tree, &key));
+            assert_equal(TB_FROZEN_NFIND(rbtree, elms, n, &key), TB_NFIND(rbtree, &tree, &key));
+            elm = elms[TB_FROZEN_UPPER(rbtree, elms, n, &key)];
+            assert_equal(elm, TB_NFIND(rbtree, &tree, &(struct node){ .value = i + 1 }));
+        }
+    }
+
+    key.value = 51;
+    hi.value = 120;
+    elm = TB_NFIND(rbtree, &tree, &key);
+    TB_FOREACH_FROZEN_RANGE(pos, rbtree, elms, 100, &key, &hi, end) {
+        assert_equal(elms[pos], elm);
+        elm = TB_NEXT(rbtree, elm);
+    }
+    assert_equal(elm->value, 122);
+    hi.value = 1000;
+    count = 0;
+    TB_FOREACH_FROZEN_RANGE(pos, rbtree, elms, 100, &key, &hi, end)
+        ++count;
+    assert_equal(count, 74);
+
+    // Keyed snapshots.
+    for (size_t i = 0; i < 100; ++i) {
+        knodes[i].key = (uint64_t)((i * 37) % 100) * 10 + 10;
+        assert_null(TB_INSERT(ktree, &ktree, &knodes[i]));
+    }
+    assert_equal(TB_FREEZE_KEY(ktree, &ktree, keys, kelms, 101), 100);
+    for (size_t k = 1; k <= 100; ++k)
+        assert_equal(keys[k], kelms[k]->key);
+    for (uint64_t k = 0; k <= 1020; ++k) {
+        assert_equal(TB_FROZEN_FIND_KEY(ktree, keys, kelms, 100, k), TB_FIND_KEY(ktree, &ktree, k));
+        assert_equal(TB_FROZEN_NFIND_KEY(ktree, keys, kelms, 100, k),
+                     TB_NFIND_KEY(ktree, &ktree, k));
+    }
+    count = 0;
+    TB_FOREACH_FROZEN_RANGE_KEY(pos, ktree, keys, 100, 15, 100, end) {
+        assert_equal(keys[pos], 20 + 10 * count);
+        ++count;
+    }
+    assert_equal(count, 9);
+}
+
+static void partition_cb(struct node *node, void *arg)
+{
+    node->value = -node->value - 1;
+    (void)arg;
+}
+
+#define check_partition(name, head, k, total, out) do { \
+        size_t pruns = TB_PARTITION(name, head, k, out), seen = 0; \
+        struct node *pnode, *pprev = NULL; \
+        assert_true(pruns <= (k)); \
+        assert_equal((out)[0], TB_FIRST(name, head)); \
+        assert_null((out)[pruns]); \
+        for (size_t r = 0; r < pruns; ++r) { \
+            size_t len = 0; \
+            assert_equal(TB_PREV(name, (out)[r]), pprev); \
+            TB_FOREACH_RUN(pnode, name, out, r) { \
+                pprev = pnode; \
+                ++len; \
+            } \
+            assert_true(len > 0); \
+            seen += len; \
+        } \
+        assert_equal(seen, (total)); \
+    } while (0)
+
+TEST(test_tbtree_partition)
+{
+    struct tree tree = TB_HEAD_INITIALIZER(tree);
+    struct rbtree rbtree = TB_HEAD_INITIALIZER(rbtree);
+    struct node *node, *out[41], nodes[1000], rbnodes[1000];
+
+    assert_equal(TB_PARTITION(tree, &tree, 8, out), 0);
+    assert_null(out[0]);
+    TB_PARALLEL_FOREACH(tree, out, 0, partition_cb, NULL);
+
+    // a chain still yields as many runs as asked for
+    for (size_t i = 0; i < 1000; ++i) {
+        nodes[i].value = (int)i;
+        assert_null(TB_INSERT(tree, &tree, &nodes[i]));
+    }
+    for (size_t k = 1; k <= 40; ++k) {
+        check_partition(tree, &tree, k, 1000, out);
+        assert_equal(TB_PARTITION(tree, &tree, k, out), k);
+    }
+    assert_equal(TB_PARTITION(tree, &tree, 0, out), 0);
+    assert_null(out[0]);
+
+    // a perfect tree is cut into runs within a factor of two
+    TB_INIT(&tree);
+    for (size_t i = 0; i < 511; ++i)
+        assert_null(TB_INSERT(tree, &tree, &nodes[i]));
+    TB_REBALANCE(tree, &tree);
+    for (size_t k = 1; k <= 40; ++k) {
+        size_t runs = TB_PARTITION(tree, &tree, k, out);
+        assert_equal(runs, k);
+        check_partition(tree, &tree, k, 511, out);
+        for (size_t r = 0; r < runs; ++r) {
+            size_t len = 0;
+            TB_FOREACH_RUN(node, tree, out, r)
+                ++len;
+            assert_true(len * k * 2 >= 511);
+            assert_true(len * k <= 2 * 511);
+        }
+    }
+
+    for (size_t i = 0; i < 1000; ++i) {
+        rbnodes[i].value = (int)((i * 7919) % 1000);
+        assert_null(TB_INSERT(rbtree, &rbtree, &rbnodes[i]));
+    }
+    for (size_t k = 1; k <= 40; ++k)
+        check_partition(rbtree, &rbtree, k, 1000, out);
+
+    // every node is visited exactly once
+    size_t runs = TB_PARTITION(rbtree, &rbtree, 7, out);
+    TB_PARALLEL_FOREACH(rbtree, out, runs, partition_cb, NULL);
+    for (size_t i = 0; i < 1000; ++i)
+        assert_equal(rbnodes[i].value, -(int)((i * 7919) % 1000) - 1);
+
+    struct rbtree small = TB_HEAD_INITIALIZER(small);
+    assert_null(TB_INSERT(rbtree, &small, &(struct node){ .value = 1 }));
+    assert_equal(TB_PARTITION(rbtree, &small, 4, out), 1);
+    assert_equal(out[0], TB_ROOT(&small));
+    assert_null(out[1]);
+}
+
+TEST(test_tbtree_next_n)
+{
+    struct rbtree rbtree = TB_HEAD_INITIALIZER(rbtree);
+    struct node *cur, *out[64], nodes[1000];
+    size_t k, total = 0, calls = 0;
+
+    cur = TB_FIRST(rbtree, &rbtree);
+    assert_equal(TB_NEXT_N(rbtree, &cur, out, 64), 0);
+    assert_equal(TB_PREV_N(rbtree, &cur, out, 64), 0);
+    assert_null(cur);
+
+    for (size_t i = 0; i < 1000; ++i) {
+        nodes[i].value = (int)((i * 7919) % 1000);
+        assert_null(TB_INSERT(rbtree, &rbtree, &nodes[i]));
+    }
+
+    // batches resume where the previous one stopped
+    for (cur = TB_FIRST(rbtree, &rbtree); (k = TB_NEXT_N(rbtree, &cur, out, 7));) {
+        assert_true(k == 7 || (k == 1000 % 7 && !cur));
+        for (size_t i = 0; i < k; ++i)
+            assert_equal(out[i]->value, (int)(total + i));
+        total += k;
+        ++calls;
+    }
+    assert_equal(total, 1000);
+    assert_equal(calls, 143);
+    assert_null(cur);
+    assert_equal(TB_NEXT_N(rbtree, &cur, out, 7), 0);
+
+    total = 0;
+    for (cur = TB_LAST(rbtree, &rbtree); (k = TB_PREV_N(rbtree, &cur, out, 64));) {
+        for (size_t i = 0; i < k; ++i)
+            assert_equal(out[i]->value, 999 - (int)(total + i));
+        total += k;
+    }
+    assert_equal(total, 1000);
+
+    // a cursor may start anywhere and a zero count leaves it in place
+    struct node key = { .value = 500 };
+    cur = TB_FIND(rbtree, &rbtree, &key);
+    assert_equal(TB_NEXT_N(rbtree, &cur, out, 0), 0);
+    assert_equal(cur->value, 500);
+    assert_equal(TB_PREV_N(rbtree, &cur, out, 3), 3);
+    assert_equal(out[2]->value, 498);
+    assert_equal(cur->value, 497);
+    assert_equal(TB_NEXT_N(rbtree, &cur, out, 64), 64);
+    assert_equal(out[0]->value, 497);
+    assert_equal(cur->value, 561);
+}
+
+TB_GENERATE_POOL_STATIC(rbtree, node, entry)
+
+static size_t pool_slabs(const struct tb_pool *pool)
+{
+    size_t n = 0;
+    for (union tb_slab *slab = pool->tb_slabs; slab; slab = slab->tb_next)
+        ++n;
+    return n;
+}
+
+TEST(test_tbtree_pool)
+{
+    struct rbtree rbtree = TB_HEAD_INITIALIZER(rbtree);
+    struct tb_pool pool = TB_POOL_INITIALIZER(100);
+    struct node *node, *tmp, *nodes[250];
+
+    // nodes are carved in address order, a slab at a time
+    for (size_t i = 0; i < 250; ++i) {
+        nodes[i] = TB_POOL_ALLOC(rbtree, &pool);
+        assert_not_null(nodes[i]);
+        if (i % 100)
+            assert_equal(nodes[i], nodes[i - 1] + 1);
+        nodes[i]->value = (int)((i * 7919) % 250);
+        assert_null(TB_INSERT(rbtree, &rbtree, nodes[i]));
+    }
+    assert_equal(pool.tb_count, 250);
+    assert_equal(pool_slabs(&pool), 3);
+
+    // freed nodes are reused before carving new ones
+    for (size_t i = 0; i < 250; i += 2) {
+        TB_REMOVE(rbtree, &rbtree, nodes[i]);
+        TB_POOL_FREE(rbtree, &pool, nodes[i]);
+    }
+    assert_equal(pool.tb_count, 125);
+    for (size_t i = 0; i < 250; i += 2) {
+        node = TB_POOL_ALLOC(rbtree, &pool);
+        assert_equal(node, nodes[248 - i]);
+        node->value = (int)(((248 - i) * 7919) % 250);
+        assert_null(TB_INSERT(rbtree, &rbtree, node));
+    }
+    assert_equal(pool.tb_count, 250);
+    assert_equal(pool_slabs(&pool), 3);
+    assert_equal(check_tree(__unit, TB_ROOT(&rbtree), true), 250);
+
+    // freeing the last node rewinds the pool
+    TB_FOREACH_SAFE(node, rbtree, &rbtree, tmp) {
+        TB_REMOVE(rbtree, &rbtree, node);
+        TB_POOL_FREE(rbtree, &pool, node);
+    }
+    assert_true(TB_EMPTY(&rbtree));
+    assert_equal(pool.tb_count, 0);
+    assert_equal(TB_POOL_ALLOC(rbtree, &pool), nodes[0]);
+
+    // a whole tree is dropped at once, keeping or releasing the slabs
+    for (size_t i = 1; i < 250; ++i)
+        assert_equal(TB_POOL_ALLOC(rbtree, &pool), nodes[i]);
+    tb_pool_clear(&pool);
+    assert_equal(TB_POOL_ALLOC(rbtree, &pool), nodes[0]);
+    assert_equal(pool_slabs(&pool), 3);
+    tb_pool_release(&pool);
+    assert_null(pool.tb_slabs);
+    assert_equal(pool.tb_count, 0);
+    assert_equal(pool.tb_nodes, 100);
+
+    assert_not_null(TB_POOL_ALLOC(rbtree, &pool));
+    assert_equal(pool_slabs(&pool), 1);
+    tb_pool_release(&pool);
+}
+
+struct inode {
+    TB_ENTRY_IDX(inode) entry;
+    int value;
+};
+
+static inline int inode_cmp(const struct inode *a, const struct inode *b)
+{
+    return (a->value > b->value) - (a->value < b->value);
+}
+
+TB_HEAD_IDX(idxtree, inode);
+TB_GENERATE_IDX_STATIC(idxtree, inode, entry, inode_cmp)
+
+static size_t check_idx(const char *__unit, struct idxtree *head,
+                        struct inode *elm, struct inode *parent,
+                        struct inode *prev, struct inode *next, int *height)
+{
+    struct inode *base = head->tb_base;
+    size_t count = 1;
+    int lheight = 1, rheight = 1;
+
+    assert_equal(TB_IDX_PARENT(base, elm, entry), parent);
+    if (prev)
+        assert_true(prev->value < elm->value);
+    if (next)
+        assert_true(elm->value < next->value);
+
+    if (TB_IDX_LLEAF(elm, entry)) {
+        assert_equal(TB_IDX_LEFT(base, elm, entry), prev);
+    } else {
+        struct inode *child = TB_IDX_LEFT(base, elm, entry);
+        if (TB_IDX_IS_RED(elm, entry))
+            assert_false(TB_IDX_IS_RED(child, entry));
+        count += check_idx(__unit, head, child, elm, prev, elm, &lheight);
+    }
+
+    if (TB_IDX_RLEAF(elm, entry)) {
+        assert_equal(TB_IDX_RIGHT(base, elm, entry), next);
+    } else {
+        struct inode *child = TB_IDX_RIGHT(base, elm, entry);
+        if (TB_IDX_IS_RED(elm, entry))
+            assert_false(TB_IDX_IS_RED(child, entry));
+        count += check_idx(__unit, head, child, elm, elm, next, &rheight);
+    }
+
+    assert_equal(lheight, rheight);
+    *height = lheight + !TB_IDX_IS_RED(elm, entry);
+    return count;
+}
+
+static size_t check_idx_tree(const char *__unit, struct idxtree *head)
+{
+    struct inode *root = TB_IDX_PTR(head->tb_base, head->tb_root);
+    int height = 0;
+    if (!root)
+        return 0;
+    assert_false(TB_IDX_IS_RED(root, entry));
+    return check_idx(__unit, head, root, NULL, NULL, NULL, &height);
+}
+
+TEST(test_tbtree_idx)
+{
+    struct inode *nodes = (struct inode *)calloc(256, sizeof(*nodes));
+    struct idxtree tree = TB_HEAD_IDX_INITIALIZER(nodes);
+    struct inode *node, key;
+    bool used[256] = { false };
+    size_t count = 0;
+
+    assert_equal(sizeof(nodes[0].entry), 12);
+    assert_null(TB_FIRST(idxtree, &tree));
+    assert_null(TB_LAST(idxtree, &tree));
+
+    srand(12);
+    for (size_t i = 0; i < 256; ++i)
+        nodes[i].value = (int)i * 2;
+
+    for (size_t i = 0; i < 8192; ++i) {
+        size_t j = (size_t)rand() % 256;
+        if (used[j]) {
+            assert_equal(TB_REMOVE(idxtree, &tree, &nodes[j]), &nodes[j]);
+            --count;
+        } else {
+            assert_null(TB_INSERT(idxtree, &tree, &nodes[j]));
+            ++count;
+        }
+        used[j] = !used[j];
+        assert_equal(check_idx_tree(__unit, &tree), count);
+    }
+
+    for (size_t i = 0; i < 256; ++i) {
+        if (!used[i])
+            assert_null(TB_INSERT(idxtree, &tree, &nodes[i]));
+    }
+    key.value = 100;
+    assert_equal(TB_INSERT(idxtree, &tree, &key), &nodes[50]);
+
+    /* Relocation only needs the new base. */
+    nodes = (struct inode *)realloc(nodes, 512 * sizeof(*nodes));
+    assert_not_null(nodes);
+    tree.tb_base = nodes;
+    assert_equal(check_idx_tree(__unit, &tree), 256);
+
+    int value = 0;
+    TB_FOREACH_IDX(node, idxtree, &tree) {
+        assert_equal(node->value, value);
+        value += 2;
+    }
+    assert_equal(value, 512);
+    TB_FOREACH_REVERSE_IDX(node, idxtree, &tree) {
+        value -= 2;
+        assert_equal(node->value, value);
+    }
+    assert_equal(value, 0);
+
+    key.value = 101;
+    assert_null(TB_FIND(idxtree, &tree, &key));
+    assert_equal(TB_NFIND(idxtree, &tree, &key), &nodes[51]);
+    key.value = 1000;
+    assert_null(TB_NFIND(idxtree, &tree, &key));
+
+    for (size_t i = 256; i < 512; ++i) {
+        nodes[i].value = (int)(i - 256) * 2 + 1;
+        assert_null(TB_INSERT(idxtree, &tree, &nodes[i]));
+    }
+    assert_equal(check_idx_tree(__unit, &tree), 512);
+    assert_null(TB_FIND(idxtree, &tree, &key));
+    key.value = 101;
+    assert_equal(TB_FIND(idxtree, &tree, &key), &nodes[256 + 50]);
+
+    count = 512;
+    while ((node = TB_FIRST(idxtree, &tree))) {
+        assert_equal(TB_REMOVE(idxtree, &tree, node), node);
+        assert_equal(check_idx_tree(__unit, &tree), --count);
+    }
+    assert_equal(tree.tb_root, 0);
+    free(nodes);
+
+    /* Only nodes whose index fits in a link are linked. The base is moved
+     * back so that the nodes sit at the end of the range instead of
+     * allocating it all. */
+    nodes = (struct inode *)calloc(3, sizeof(*nodes));
+    assert_not_null(nodes);
+    TB_INIT_IDX(&tree, (struct inode *)((uintptr_t)nodes -
+                                        (TB_IDX_MAX - 2) * sizeof(*nodes)));
+    for (int i = 0; i < 3; ++i)
+        nodes[i].value = i;
+    assert_null(TB_INSERT(idxtree, &tree, &nodes[1]));
+    assert_equal(tree.tb_root, TB_IDX_MAX);
+    assert_null(TB_INSERT(idxtree, &tree, &nodes[0]));
+    assert_equal(TB_INSERT(idxtree, &tree, &nodes[2]), &nodes[2]);
+    nodes[2].value = 0;
+    assert_equal(TB_INSERT(idxtree, &tree, &nodes[2]), &nodes[0]);
+    assert_equal(check_idx_tree(__unit, &tree), 2);
+    assert_equal(TB_FIRST(idxtree, &tree), &nodes[0]);
+    assert_equal(TB_NEXT(idxtree, &tree, &nodes[0]), &nodes[1]);
+    free(nodes);
+}
+
+TEST(test_tbtree_image)
+{
+    struct inode *nodes = (struct inode *)calloc(300, sizeof(*nodes)), *node, key;
+    struct idxtree tree = TB_HEAD_IDX_INITIALIZER(nodes), loaded;
+    struct tb_image image;
+    size_t size = sizeof(image) + 300 * sizeof(*nodes);
+    unsigned char *data = (unsigned char *)malloc(size);
+    bool present[900] = { false };
+    int prev = -1;
+
+    assert_not_null(nodes);
+    assert_not_null(data);
+    assert_equal(sizeof(image), 32);
+
+    for (size_t i = 0; i < 300; ++i) {
+        nodes[i].value = (int)((i * 101) % 300) * 3;
+        assert_null(TB_INSERT(idxtree, &tree, &nodes[i]));
+    }
+    for (size_t i = 0; i < 300; ++i) {
+        if (i % 7 == 0)
+            TB_REMOVE(idxtree, &tree, &nodes[i]);
+        else
+            present[nodes[i].value] = true;
+    }
+
+    TB_SAVE(idxtree, &tree, 300, &image);
+    memcpy(data, &image, sizeof(image));
+    memcpy(data + sizeof(image), nodes, 300 * sizeof(*nodes));
+    free(nodes);
+
+    // The image is used in place: no node is copied or compared.
+    assert_equal(TB_VERIFY(idxtree, data, size), 0);
+    assert_equal(TB_LOAD(idxtree, &loaded, data, size), 0);
+    assert_equal((unsigned char *)loaded.tb_base, data + sizeof(image));
+    assert_equal(check_idx_tree(__unit, &loaded), 300 - 43);
+    TB_FOREACH_IDX(node, idxtree, &loaded) {
+        assert_true(node->value > prev);
+        prev = node->value;
+    }
+    for (int i = 0; i < 900; ++i) {
+        key.value = i;
+        node = TB_FIND(idxtree, &loaded, &key);
+        if (present[i])
+            assert_equal(node->value, i);
+        else
+            assert_null(node);
+    }
+
+    // Stale or truncated images are rejected by both, damaged nodes only
+    // by the checksum.
+    assert_equal(TB_LOAD(idxtree, &loaded, data, size - 1), -1);
+    assert_equal(TB_VERIFY(idxtree, data, size - 1), -1);
+    assert_equal(TB_LOAD(idxtree, &loaded, data, sizeof(image) - 1), -1);
+    assert_equal(TB_VERIFY(idxtree, data, sizeof(image) - 1), -1);
+    ((struct tb_image *)data)->tb_version++;
+    assert_equal(TB_LOAD(idxtree, &loaded, data, size), -1);
+    assert_equal(TB_VERIFY(idxtree, data, size), -1);
+    ((struct tb_image *)data)->tb_version--;
+    ((struct tb_image *)data)->tb_node_size++;
+    assert_equal(TB_LOAD(idxtree, &loaded, data, size), -1);
+    ((struct tb_image *)data)->tb_node_size--;
+    ((struct tb_image *)data)->tb_root++;
+    assert_equal(TB_VERIFY(idxtree, data, size), -1);
+    ((struct tb_image *)data)->tb_root--;
+    data[size - 1] ^= 1;
+    assert_equal(TB_VERIFY(idxtree, data, size), -1);
+    assert_equal(TB_LOAD(idxtree, &loaded, data, size), 0);
+    data[size - 1] ^= 1;
+    assert_equal(TB_VERIFY(idxtree, data, size), 0);
+
+    // An empty tree.
+    TB_INIT_IDX(&tree, NULL);
+    TB_SAVE(idxtree, &tree, 0, &image);
+    assert_equal(TB_VERIFY(idxtree, &image, sizeof(image)), 0);
+    assert_equal(TB_LOAD(idxtree, &loaded, &image, sizeof(image)), 0);
+    assert_null(TB_FIRST(idxtree, &loaded));
+
+    free(data);
+}
+
+static size_t shard_locks;
+
+static void shard_lock(int *lock)
+{
+    if ((*lock)++)
+        abort();
+    ++shard_locks;
+}
+
+static void shard_unlock(int *lock)
+{
+    if (!(*lock)--)
+        abort();
+}
+
+static void shard_init(int *lock)
+{
+    *lock = 0;
+}
+
+TB_HEAD_SHARDED(shtree, rbtree, node, int, 8);
+TB_GENERATE_SHARDED_STATIC(shtree, rbtree, node, entry, node_cmp, shard_lock, shard_unlock)
+
+static void shard_walk(struct node *elm, void *arg)
+{
+    int *prev = (int *)arg;
+    if (elm->value <= *prev)
+        abort();
+    *prev = elm->value;
+}
+
+static void check_shards(const char *__unit, struct shtree *head, size_t count)
+{
+    size_t total = 0;
+    int prev = -1;
+
+    for (size_t i = 0; i < TB_NSHARDS(head); ++i) {
+        struct rbtree *tree = &head->tb_shards[i].tb_tree;
+        struct node *first = TB_FIRST(rbtree, tree);
+        struct node *last = TB_LAST(rbtree, tree);
+
+        assert_equal(head->tb_shards[i].tb_lock, 0);
+        assert_equal(check_tree(__unit, TB_ROOT(tree), true), head->tb_shards[i].tb_count);
+        total += head->tb_shards[i].tb_count;
+        // the counts are all scanned at least every TB_SHARD_SLACK nodes
+        // of the updated shard, which may leave others that much behind
+        assert_false(TB_SHARD_SKEWED(head->tb_shards[i].tb_count > TB_SHARD_SLACK ?
+                                     head->tb_shards[i].tb_count - TB_SHARD_SLACK : 0,
+                                     count, TB_NSHARDS(head)));
+        if (i && first)
+            assert_true(head->tb_shards[i].tb_bounded &&
+                        head->tb_shards[i].tb_lo.value <= first->value);
+        if (i + 1 < TB_NSHARDS(head) && head->tb_shards[i + 1].tb_bounded)
+            assert_true(i == 0 || head->tb_shards[i].tb_bounded);
+        if (head->tb_shards[i].tb_bounded) {
+            assert_null(head->tb_shards[i].tb_lo.entry.tb_left);
+            assert_null(head->tb_shards[i].tb_lo.entry.tb_parent);
+        }
+        if (i + 1 < TB_NSHARDS(head) && last && head->tb_shards[i + 1].tb_bounded)
+            assert_true(last->value < head->tb_shards[i + 1].tb_lo.value);
+    }
+    assert_equal(total, count);
+    assert_equal(TB_COUNT(shtree, head), count);
+
+    TB_WALK(shtree, head, shard_walk, &prev);
+}
+
+TEST(test_tbtree_sharded)
+{
+    struct shtree tree;
+    struct node *node, key, nodes[4096];
+    size_t count = 0;
+
+    TB_INIT_SHARDED(&tree, shard_init);
+    key.value = 0;
+    assert_null(TB_FIND(shtree, &tree, &key));
+    assert_null(TB_NFIND(shtree, &tree, &key));
+
+    srand(14);
+    for (size_t i = 0; i < 4096; ++i) {
+        nodes[i].value = (int)i * 2;
+        size_t j = (size_t)rand() % (i + 1);
+        int tmp = nodes[i].value;
+        nodes[i].value = nodes[j].value;
+        nodes[j].value = tmp;
+    }
+
+    for (size_t i = 0; i < 4096; ++i) {
+        assert_null(TB_INSERT(shtree, &tree, &nodes[i]));
+        if (++count % 512 == 0)
+            check_shards(__unit, &tree, count);
+    }
+    assert_true(tree.tb_shards[TB_NSHARDS(&tree) - 1].tb_bounded);
+
+    key.value = 1001;
+    assert_null(TB_FIND(shtree, &tree, &key));
+    node = TB_NFIND(shtree, &tree, &key);
+    assert_not_null(node);
+    assert_equal(node->value, 1002);
+    key.value = 1002;
+    assert_equal(TB_FIND(shtree, &tree, &key), node);
+    assert_equal(TB_INSERT(shtree, &tree, &key), node);
+    key.value = 8191;
+    assert_null(TB_NFIND(shtree, &tree, &key));
+
+    /* Draining the low keys moves the bounds down. */
+    for (size_t i = 0; i < 4096; ++i) {
+        if (nodes[i].value >= 4096)
+            continue;
+        assert_equal(TB_REMOVE(shtree, &tree, &nodes[i]), &nodes[i]);
+        if (--count % 256 == 0)
+            check_shards(__unit, &tree, count);
+    }
+    check_shards(__unit, &tree, count);
+    key.value = 0;
+    assert_equal(TB_NFIND(shtree, &tree, &key)->value, 4096);
+
+    // growing keys mostly move single bounds between neighbours
+    TB_INIT_SHARDED(&tree, shard_init);
+    shard_locks = 0;
+    for (size_t i = 0; i < 4096; ++i) {
+        nodes[i].value = (int)i;
+        assert_null(TB_INSERT(shtree, &tree, &nodes[i]));
+        if ((i + 1) % 512 == 0)
+            check_shards(__unit, &tree, i + 1);
+    }
+    assert_true(shard_locks < 4096 + 384);
+}
+
+#ifdef TBTREE_RCU
+struct rcu_reader {
+    const char *unit;
+    struct rbtree *tree;
+    struct tb_epoch *epoch;
+    struct node *nodes;
+    size_t slot;
+    int stop;
+    size_t lookups;
+};
+
+static void *rcu_reader_run(void *arg)
+{
+    struct rcu_reader *reader = (struct rcu_reader *)arg;
+    const char *__unit = reader->unit;
+    struct node *keys[128], *found[128];
+
+    for (size_t i = 0; i < 128; ++i)
+        keys[i] = &reader->nodes[i * 2];
+
+    do {
+        unsigned long seq;
+
+        tb_epoch_enter(reader->epoch, reader->slot);
+        do {
+            seq = tb_epoch_read_begin(reader->epoch);
+            TB_FIND_BATCH(rbtree, reader->tree, keys, 128, found);
+        } while (tb_epoch_read_retry(reader->epoch, seq));
+        tb_epoch_exit(reader->epoch, reader->slot);
+        for (size_t i = 0; i < 128; ++i)
+            assert_equal(found[i], keys[i]);
+
+        for (size_t i = 0; i < 256; i += 2) {
+            struct node *node, *next, *prev, key;
+
+            key.value = (int)i + 1;
+            tb_epoch_enter(reader->epoch, reader->slot);
+            do {
+                seq = tb_epoch_read_begin(reader->epoch);
+                node = TB_FIND(rbtree, reader->tree, &reader->nodes[i]);
+                next = node ? TB_NEXT(rbtree, node) : NULL;
+                prev = TB_PFIND(rbtree, reader->tree, &key);
+                if (prev && prev->value == key.value)
+                    prev = TB_PREV(rbtree, prev);
+            } while (tb_epoch_read_retry(reader->epoch, seq));
+            assert_equal(node, &reader->nodes[i]);
+            assert_true(!next || next->value == (int)i + 1 || next->value == (int)i + 2);
+            assert_equal(prev, &reader->nodes[i]);
+            tb_epoch_exit(reader->epoch, reader->slot);
+            ++reader->lookups;
+        }
+    } while (!__atomic_load_n(&reader->stop, __ATOMIC_ACQUIRE));
+    return NULL;
+}
+
+TEST(test_tbtree_rcu)
+{
+    struct rbtree tree = TB_HEAD_INITIALIZER(tree);
+    struct tb_epoch epoch = TB_EPOCH_INITIALIZER;
+    struct node nodes[256], *odd[256] = { NULL };
+    struct rcu_reader readers[2];
+    pthread_t threads[2];
+    struct {
+        struct node *node;
+        unsigned long tag;
+    } retired[256];
+    size_t nretired = 0;
+    unsigned long tag;
+
+    tb_epoch_enter(&epoch, 3);
+    tag = tb_epoch_retire(&epoch);
+    assert_false(tb_epoch_safe(&epoch, tag));
+    tb_epoch_enter(&epoch, 5);
+    assert_true(tb_epoch_safe(&epoch, tag - 1));
+    tb_epoch_exit(&epoch, 3);
+    assert_true(tb_epoch_safe(&epoch, tag));
+    assert_false(tb_epoch_safe(&epoch, tag + 1));
+    tb_epoch_exit(&epoch, 5);
+    tb_epoch_init(&epoch);
+
+    for (size_t i = 0; i < 256; i += 2) {
+        nodes[i].value = (int)i;
+        assert_null(TB_INSERT(rbtree, &tree, &nodes[i]));
+    }
+
+    for (size_t i = 0; i < 2; ++i) {
+        readers[i] = (struct rcu_reader) {
+            __unit, &tree, &epoch, nodes, i, 0, 0
+        };
+        assert_equal(pthread_create(&threads[i], NULL, rcu_reader_run, &readers[i]), 0);
+    }
+
+    srand(13);
+    for (size_t n = 0; n < 20000; ++n) {
+        size_t i = (size_t)rand() % 128 * 2 + 1;
+        struct node *node = odd[i];
+
+        tb_epoch_write_begin(&epoch);
+        if (node) {
+            TB_REMOVE(rbtree, &tree, node);
+        } else {
+            node = (struct node *)malloc(sizeof(*node));
+            assert_not_null(node);
+            node->value = (int)i;
+            assert_null(TB_INSERT(rbtree, &tree, node));
+        }
+        tb_epoch_write_end(&epoch);
+
+        if (odd[i]) {
+            retired[nretired].node = node;
+            retired[nretired++].tag = tb_epoch_retire(&epoch);
+            odd[i] = NULL;
+        } else {
+            odd[i] = node;
+        }
+
+        for (size_t j = 0; j < nretired;) {
+            if (tb_epoch_safe(&epoch, retired[j].tag)) {
+                free(retired[j].node);
+                retired[j] = retired[--nretired];
+            } else {
+                ++j;
+            }
+        }
+        if (nretired == 256) {
+            tb_epoch_synchronize(&epoch);
+            while (nretired)
+                free(retired[--nretired].node);
+        }
+    }
+
+    for (size_t i = 0; i < 2; ++i) {
+        __atomic_store_n(&readers[i].stop, 1, __ATOMIC_RELEASE);
+        assert_equal(pthread_join(threads[i], NULL), 0);
+        assert_true(readers[i].lookups > 0);
+    }
+
+    assert_true(check_tree(__unit, TB_ROOT(&tree), true) > 0);
+    while (nretired)
+        free(retired[--nretired].node);
+    for (size_t i = 1; i < 256; i += 2)
+        free(odd[i]);
+}
+
+#define shard_mutex_init(mutex) pthread_mutex_init(mutex, NULL)
+
+TB_HEAD_SHARDED(mtshtree, rbtree, node, pthread_mutex_t, 4);
+TB_GENERATE_SHARDED_STATIC(mtshtree, rbtree, node, entry, node_cmp,
+                           pthread_mutex_lock, pthread_mutex_unlock)
+
+struct shard_writer {
+    struct mtshtree *tree;
+    struct node *nodes;
+    size_t first;
+};
+
+static void *shard_writer_run(void *arg)
+{
+    struct shard_writer *writer = (struct shard_writer *)arg;
+
+    for (size_t i = writer->first; i < 4096; i += 4)
+        TB_INSERT(mtshtree, writer->tree, &writer->nodes[i]);
+    for (int round = 0; round < 4; ++round) {
+        for (size_t i = writer->first; i < 4096; i += 4) {
+            if (i % 8 < 4)
+                TB_REMOVE(mtshtree, writer->tree, &writer->nodes[i]);
+        }
+        for (size_t i = writer->first; round < 3 && i < 4096; i += 4) {
+            if (i % 8 < 4)
+                TB_INSERT(mtshtree, writer->tree, &writer->nodes[i]);
+        }
+    }
+    return NULL;
+}
+
+static void shard_count(struct node *elm, void *arg)
+{
+    size_t *count = (size_t *)arg;
+    ++*count;
+    (void)elm;
+}
+
+TEST(test_tbtree_sharded_threads)
+{
+    struct mtshtree tree;
+    struct node *nodes = (struct node *)malloc(4096 * sizeof(*nodes));
+    struct shard_writer writers[4];
+    pthread_t threads[4];
+    size_t count = 0;
+    int prev = -1;
+
+    assert_not_null(nodes);
+    TB_INIT_SHARDED(&tree, shard_mutex_init);
+    for (size_t i = 0; i < 4096; ++i)
+        nodes[i].value = (int)((i * 2654435761u) % 4096) * 4 + (int)(i % 4);
+
+    for (size_t i = 0; i < 4; ++i) {
+        writers[i] = (struct shard_writer) { &tree, nodes, i };
+        assert_equal(pthread_create(&threads[i], NULL, shard_writer_run, &writers[i]), 0);
+    }
+    for (size_t i = 0; i < 4; ++i)
+        assert_equal(pthread_join(threads[i], NULL), 0);
+
+    TB_WALK(mtshtree, &tree, shard_walk, &prev);
+    TB_WALK(mtshtree, &tree, shard_count, &count);
+    assert_equal(count, 2048);
+    assert_equal(TB_COUNT(mtshtree, &tree), 2048);
+    for (size_t i = 0; i < 4096; ++i)
+        assert_equal(TB_FIND(mtshtree, &tree, &nodes[i]) != NULL, i % 8 >= 4);
+
+    for (size_t i = 0; i < TB_NSHARDS(&tree); ++i)
+        pthread_mutex_destroy(&tree.tb_shards[i].tb_lock);
+    free(nodes);
+}
+#endif
+
+#ifdef TBTREE_STATS
+TEST(test_tbtree_stats)
+{
+    struct tree tree = TB_HEAD_INITIALIZER(tree);
+    struct rbtree rbtree = TB_HEAD_INITIALIZER(rbtree);
+    struct node *nodes, key;
+    struct tb_stats stats;
+    const size_t n = 1000;
+    size_t sum = 0, total = 0;
+
+    nodes = (struct node *)calloc(n, sizeof(*nodes));
+    assert_not_null(nodes);
+    for (size_t i = 0; i < n; ++i)
+        nodes[i].value = (int)i;
+
+    TB_STATS(tree, &tree, &stats);
+    assert_equal(stats.tb_count, 0);
+    assert_equal(stats.tb_height, 0);
+
+    // Sorted inserts into the plain tree build a list: each lookup
+    // compares against every node above its key.
+    TB_COUNTERS_RESET();
+    for (size_t i = 0; i < 100; ++i)
+        assert_null(TB_INSERT(tree, &tree, &nodes[i]));
+    assert_equal(TB_COUNTERS.tb_inserts, 100);
+    assert_equal(TB_COUNTERS.tb_steps, 99 * 100 / 2);
+    assert_equal(TB_COUNTERS.tb_cmps, TB_COUNTERS.tb_steps);
+    assert_equal(TB_COUNTERS.tb_rotations, 0);
+
+    TB_STATS(tree, &tree, &stats);
+    assert_equal(stats.tb_count, 100);
+    assert_equal(stats.tb_height, 100);
+    for (size_t i = 0; i < TB_STATS_DEPTHS - 1; ++i)
+        assert_equal(stats.tb_depths[i], 1);
+    assert_equal(stats.tb_depths[TB_STATS_DEPTHS - 1], 100 - (TB_STATS_DEPTHS - 1));
+
+    TB_COUNTERS_RESET();
+    key.value = 99;
+    assert_equal(TB_FIND(tree, &tree, &key), &nodes[99]);
+    assert_equal(TB_COUNTERS.tb_lookups, 1);
+    assert_equal(TB_COUNTERS.tb_steps, 100);
+
+    TB_REBALANCE(tree, &tree);
+    assert_equal(TB_COUNTERS.tb_rebuilds, 1);
+    assert_true(TB_COUNTERS.tb_rotations > 0);
+    TB_STATS(tree, &tree, &stats);
+    assert_equal(stats.tb_count, 100);
+    assert_equal(stats.tb_height, 7);
+    assert_equal(stats.tb_height, (size_t)tree_height(TB_ROOT(&tree)));
+
+    TB_COUNTERS_RESET();
+    assert_equal(TB_FIND(tree, &tree, &key), &nodes[99]);
+    assert_true(TB_COUNTERS.tb_steps <= 7);
+    assert_equal(TB_REMOVE(tree, &tree, &nodes[99]), &nodes[99]);
+    assert_equal(TB_COUNTERS.tb_removes, 1);
+
+    // The histogram of a red-black tree adds up to the node count and
+    // the average depth.
+    for (size_t i = 0; i < n; ++i)
+        assert_null(TB_INSERT(rbtree, &rbtree, &nodes[(i * 7) % n]));
+    TB_STATS(rbtree, &rbtree, &stats);
+    assert_equal(stats.tb_count, n);
+    assert_equal(stats.tb_height, (size_t)tree_height(TB_ROOT(&rbtree)));
+    assert_true(stats.tb_height <= 2 * 10);
+    for (size_t i = 0; i < TB_STATS_DEPTHS; ++i) {
+        sum += stats.tb_depths[i];
+        total += i * stats.tb_depths[i];
+        if (i >= stats.tb_height)
+            assert_equal(stats.tb_depths[i], 0);
+    }
+    assert_equal(sum, n);
+    assert_true(stats.tb_avg_depth * (double)n > (double)total - 0.5);
+    assert_true(stats.tb_avg_depth * (double)n < (double)total + 0.5);
+
+    free(nodes);
+}
+#endif
+
 int main(void)
 {
     struct {
@@ -331,6 +2664,39 @@ int main(void)
         { "tbtree_insert", test_tbtree_insert },
         { "tbtree_remove_last", test_tbtree_remove_last },
         { "tbtree_remove_first", test_tbtree_remove_first },
+        { "tbtree_remove_random", test_tbtree_remove_random },
+        { "tbtree_rb_insert", test_tbtree_rb_insert },
+        { "tbtree_rb_remove", test_tbtree_rb_remove },
+        { "tbtree_rebalance", test_tbtree_rebalance },
+        { "tbtree_aligned", test_tbtree_aligned },
+        { "tbtree_sg", test_tbtree_sg },
+        { "tbtree_build_sorted", test_tbtree_build_sorted },
+        { "tbtree_merge", test_tbtree_merge },
+        { "tbtree_split_join", test_tbtree_split_join },
+        { "tbtree_splay", test_tbtree_splay },
+        { "tbtree_rank", test_tbtree_rank },
+        { "tbtree_augment", test_tbtree_augment },
+        { "tbtree_interval", test_tbtree_interval },
+        { "tbtree_range", test_tbtree_range },
+        { "tbtree_insert_hint", test_tbtree_insert_hint },
+        { "tbtree_key", test_tbtree_key },
+        { "tbtree_multi", test_tbtree_multi },
+        { "tbtree_prefix", test_tbtree_prefix },
+        { "tbtree_find_batch", test_tbtree_find_batch },
+        { "tbtree_freeze", test_tbtree_freeze },
+        { "tbtree_partition", test_tbtree_partition },
+        { "tbtree_next_n", test_tbtree_next_n },
+        { "tbtree_pool", test_tbtree_pool },
+        { "tbtree_idx", test_tbtree_idx },
+        { "tbtree_image", test_tbtree_image },
+        { "tbtree_sharded", test_tbtree_sharded },
+#ifdef TBTREE_RCU
+        { "tbtree_rcu", test_tbtree_rcu },
+        { "tbtree_sharded_threads", test_tbtree_sharded_threads },
+#endif
+#ifdef TBTREE_STATS
+        { "tbtree_stats", test_tbtree_stats },
+#endif
     };
 
     for (size_t i = 0, n = sizeof(tests) / sizeof(tests[0]); i < n; ++i) {
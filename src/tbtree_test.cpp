@@ -0,0 +1,249 @@
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <iterator>
+#include <utility>
+#include <vector>
+
+#include "tbtree.hpp"
+
+#define TEST(func) static void func(const char *__unit)
+
+// GCOVR_EXCL_START
+static void assert_expr(const char *unit, bool result,
+                        const char *const expression,
+                        const char *const file, const int line)
+{
+    if (result)
+        return;
+
+    fprintf(stderr, "%s:%d: unit test '%s' assertion failed: (%s)\n",
+            file, line, unit, expression);
+    fflush(stderr);
+    abort();
+}
+// GCOVR_EXCL_STOP
+
+#define assert_true(x) assert_expr(__unit, !!(x), #x, __FILE__, __LINE__)
+#define assert_false(x) assert_true(!(x))
+
+#define assert_equal(a, b) assert_true((a) == (b))
+#define assert_not_equal(a, b) assert_true((a) != (b))
+
+struct by_value;
+
+struct item : tb::base_hook<>, tb::base_hook<by_value> {
+    int key;
+    int value;
+
+    bool operator<(const item &other) const { return key < other.key; }
+};
+
+struct item_by_value {
+    bool operator()(const item &a, const item &b) const { return a.value < b.value; }
+};
+
+typedef tb::rbtree<item> item_tree;
+typedef tb::rbtree<item, by_value, item_by_value> value_tree;
+
+static item make_key(int key)
+{
+    item elm;
+    elm.key = key;
+    return elm;
+}
+
+TEST(test_tbtree_hpp_empty)
+{
+    item_tree tree;
+    const item_tree &ctree = tree;
+
+    assert_true(tree.empty());
+    assert_equal(tree.size(), 0u);
+    assert_true(tree.begin() == tree.end());
+    assert_true(ctree.cbegin() == ctree.cend());
+    assert_true(tree.rbegin() == tree.rend());
+    assert_true(tree.find(make_key(1)) == tree.end());
+    assert_true(tree.lower_bound(make_key(1)) == tree.end());
+    assert_true(tree.upper_bound(make_key(1)) == tree.end());
+    assert_equal(tree.erase(make_key(1)), 0u);
+}
+
+TEST(test_tbtree_hpp_insert)
+{
+    std::vector<item> items(500);
+    item_tree tree;
+    value_tree values;
+
+    for (size_t i = 0; i < items.size(); ++i) {
+        items[i].key = (int)((i * 7919) % 500) * 2;
+        items[i].value = -(int)i;
+        std::pair<item_tree::iterator, bool> res = tree.insert(items[i]);
+        assert_true(res.second);
+        assert_equal(&*res.first, &items[i]);
+        assert_true(values.insert(items[i]).second);
+    }
+    assert_equal(tree.size(), 500u);
+    assert_equal(values.size(), 500u);
+
+    item dup = make_key(items[10].key);
+    std::pair<item_tree::iterator, bool> res = tree.insert(dup);
+    assert_false(res.second);
+    assert_equal(&*res.first, &items[10]);
+    assert_equal(tree.size(), 500u);
+
+    // both trees order the same nodes through their own hooks
+    assert_true(std::is_sorted(tree.begin(), tree.end()));
+    assert_true(std::is_sorted(values.begin(), values.end(), item_by_value()));
+    assert_equal(std::distance(tree.begin(), tree.end()), 500);
+    assert_equal(&values.front(), &items.back());
+    assert_equal(&values.back(), &items.front());
+    assert_equal(tree.front().key, 0);
+    assert_equal(tree.back().key, 998);
+
+    int key = 998;
+    for (item_tree::reverse_iterator it = tree.rbegin(); it != tree.rend(); ++it) {
+        assert_equal(it->key, key);
+        key -= 2;
+    }
+    assert_equal(key, -2);
+
+    item_tree::iterator it = tree.end();
+    --it;
+    assert_equal(it->key, 998);
+    it--;
+    assert_equal(it->key, 996);
+    assert_true(tree.iterator_to(items[3]) == tree.find(items[3]));
+
+    int n = 0;
+    for (item &elm : tree) {
+        assert_equal(elm.key, n);
+        n += 2;
+    }
+}
+
+TEST(test_tbtree_hpp_bounds)
+{
+    std::vector<item> items(100);
+    item_tree tree;
+
+    for (size_t i = 0; i < items.size(); ++i) {
+        items[i].key = (int)i * 10;
+        tree.insert(items[i]);
+    }
+    const item_tree &ctree = tree;
+
+    for (int key = -5; key <= 1000; ++key) {
+        item probe = make_key(key);
+        item_tree::const_iterator lo = ctree.lower_bound(probe);
+        item_tree::const_iterator hi = ctree.upper_bound(probe);
+        std::pair<item_tree::iterator, item_tree::iterator> range = tree.equal_range(probe);
+        bool found = key >= 0 && key < 1000 && key % 10 == 0;
+
+        assert_true(range.first == lo);
+        assert_true(range.second == hi);
+        assert_equal(std::distance(range.first, range.second), found ? 1 : 0);
+        assert_equal(ctree.count(probe), found ? 1u : 0u);
+        assert_equal(tree.contains(probe), found);
+
+        if (key >= 990)
+            assert_true(hi == ctree.end());
+        else
+            assert_equal(hi->key, (key < 0 ? 0 : key / 10 * 10 + 10));
+        if (key > 990)
+            assert_true(lo == ctree.end());
+        else
+            assert_equal(lo->key, (key <= 0 ? 0 : (key + 9) / 10 * 10));
+    }
+}
+
+TEST(test_tbtree_hpp_erase)
+{
+    std::vector<item> items(300);
+    item_tree tree;
+
+    for (size_t i = 0; i < items.size(); ++i) {
+        items[i].key = (int)i;
+        tree.insert(items[i]);
+    }
+
+    // erasing returns the next node
+    for (item_tree::iterator it = tree.begin(); it != tree.end();) {
+        if (it->key % 3 == 0)
+            it = tree.erase(it);
+        else
+            ++it;
+    }
+    assert_equal(tree.size(), 200u);
+    assert_true(tree.find(make_key(3)) == tree.end());
+    assert_equal(tree.erase(make_key(4)), 1u);
+    assert_equal(tree.erase(make_key(4)), 0u);
+
+    item_tree::iterator first = tree.lower_bound(make_key(100));
+    item_tree::iterator last = tree.lower_bound(make_key(200));
+    item_tree::iterator next = tree.erase(first, last);
+    assert_true(next == last);
+    assert_equal(next->key, 200);
+    assert_true(tree.lower_bound(make_key(100)) == last);
+    assert_equal(tree.size(), 132u);
+    assert_true(std::is_sorted(tree.begin(), tree.end()));
+
+    tree.rebalance();
+    assert_equal(std::distance(tree.begin(), tree.end()), 132);
+    assert_true(std::is_sorted(tree.begin(), tree.end()));
+
+    // nodes may be linked again once erased
+    for (size_t i = 0; i < items.size(); i += 3)
+        assert_true(tree.insert(items[i]).second);
+    assert_equal(tree.size(), 232u);
+}
+
+TEST(test_tbtree_hpp_move)
+{
+    std::vector<item> items(50);
+    item_tree tree;
+
+    for (size_t i = 0; i < items.size(); ++i) {
+        items[i].key = (int)i;
+        tree.insert(items[i]);
+    }
+
+    item_tree other(std::move(tree));
+    assert_true(tree.empty());
+    assert_equal(tree.size(), 0u);
+    assert_equal(other.size(), 50u);
+    assert_equal((--other.end())->key, 49);
+
+    tree = std::move(other);
+    assert_equal(tree.size(), 50u);
+    assert_true(other.empty());
+
+    swap(tree, other);
+    assert_true(tree.empty());
+    assert_equal(other.front().key, 0);
+
+    other.clear();
+    assert_true(other.empty());
+    assert_true(other.begin() == other.end());
+}
+
+int main(void)
+{
+    struct {
+        const char *name;
+        void (*func)(const char *__unit);
+    } tests[] = {
+        { "tbtree_hpp_empty", test_tbtree_hpp_empty },
+        { "tbtree_hpp_insert", test_tbtree_hpp_insert },
+        { "tbtree_hpp_bounds", test_tbtree_hpp_bounds },
+        { "tbtree_hpp_erase", test_tbtree_hpp_erase },
+        { "tbtree_hpp_move", test_tbtree_hpp_move },
+    };
+
+    for (size_t i = 0, n = sizeof(tests) / sizeof(tests[0]); i < n; ++i) {
+        printf(">>> Testing (%zu of %zu) %s...\n", i + 1, n, tests[i].name);
+        tests[i].func(tests[i].name);
+    }
+
+    return EXIT_SUCCESS;
+}